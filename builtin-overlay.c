@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <kvm/util.h>
+#include <kvm/kvm-cmd.h>
+#include <kvm/builtin-overlay.h>
+#include <kvm/parse-options.h>
+#include <kvm/disk-image.h>
+#include <kvm/kvm.h>
+#include <kvm/kvm-ipc.h>
+
+static const char *instance_name;
+static int disk;
+static bool commit;
+static bool discard;
+
+static const char * const overlay_usage[] = {
+	"lkvm overlay [-n name] [-d disk] --commit|--discard",
+	NULL
+};
+
+static const struct option overlay_options[] = {
+	OPT_GROUP("Instance options:"),
+	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
+	OPT_INTEGER('d', "disk", &disk, "Index of the disk, in --disk order"),
+	OPT_GROUP("Operations:"),
+	OPT_BOOLEAN('\0', "commit", &commit,
+		    "Write the overlay to the base image, and empty it"),
+	OPT_BOOLEAN('\0', "discard", &discard,
+		    "Empty the overlay, reverting the disk to the base image"),
+	OPT_END(),
+};
+
+void kvm_overlay_help(void)
+{
+	usage_with_options(overlay_usage, overlay_options);
+}
+
+static void parse_overlay_options(int argc, const char **argv)
+{
+	while (argc != 0) {
+		argc = parse_options(argc, argv, overlay_options, overlay_usage,
+				PARSE_OPT_STOP_AT_NON_OPTION);
+		if (argc != 0)
+			kvm_overlay_help();
+	}
+}
+
+int kvm_cmd_overlay(int argc, const char **argv, const char *prefix)
+{
+	struct disk_overlay_msg msg;
+	int instance;
+	int r, status;
+
+	parse_overlay_options(argc, argv);
+
+	if (instance_name == NULL || disk < 0 || commit == discard)
+		kvm_overlay_help();
+
+	instance = kvm__get_sock_by_instance(instance_name);
+
+	if (instance <= 0)
+		die("Failed locating instance");
+
+	msg = (struct disk_overlay_msg) {
+		.disk	= disk,
+		.op	= commit ? DISK_OVERLAY_COMMIT : DISK_OVERLAY_DISCARD,
+	};
+
+	r = kvm_ipc__send_msg(instance, KVM_IPC_DISK_OVERLAY,
+			sizeof(msg), (u8 *)&msg);
+	if (r == 0 && read_in_full(instance, &status, sizeof(status)) != sizeof(status))
+		r = -1;
+
+	close(instance);
+
+	if (r < 0)
+		return -1;
+
+	if (status) {
+		pr_err("%s the overlay of disk %d failed: %s",
+		       commit ? "Committing" : "Discarding", disk,
+		       strerror(-status));
+		return -1;
+	}
+
+	return 0;
+}
@@ -4,6 +4,8 @@
 #include <kvm/kvm.h>
 #include <kvm/parse-options.h>
 #include <kvm/kvm-ipc.h>
+#include <kvm/disk-image.h>
+#include <kvm/read-write.h>
 
 #include <sys/select.h>
 #include <stdio.h>
@@ -13,6 +15,7 @@
 #include <linux/virtio_balloon.h>
 
 static bool mem;
+static bool disk;
 static bool all;
 static const char *instance_name;
 
@@ -24,6 +27,7 @@ static const char * const stat_usage[] = {
 static const struct option stat_options[] = {
 	OPT_GROUP("Commands options:"),
 	OPT_BOOLEAN('m', "memory", &mem, "Display memory statistics"),
+	OPT_BOOLEAN('d', "disk", &disk, "Display disk statistics"),
 	OPT_GROUP("Instance options:"),
 	OPT_BOOLEAN('a', "all", &all, "All instances"),
 	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
@@ -112,6 +116,93 @@ static int do_memstat(const char *name, int sock)
 	return 0;
 }
 
+static const char * const disk_stat_names[DISK_STAT_NR] = {
+	[DISK_STAT_READ]	= "read",
+	[DISK_STAT_WRITE]	= "write",
+	[DISK_STAT_FLUSH]	= "flush",
+};
+
+static void print_disk_latency(struct disk_stat_op *s)
+{
+	unsigned long long lo, hi;
+	int i;
+
+	for (i = 0; i < DISK_STAT_LAT_BUCKETS; i++) {
+		if (!s->lat_hist[i])
+			continue;
+
+		lo = i ? 1ULL << (i - 1) : 0;
+		hi = 1ULL << i;
+		if (i == DISK_STAT_LAT_BUCKETS - 1)
+			printf("\t\t%10llu us and more:  ", lo);
+		else
+			printf("\t\t%10llu - %-10llu us: ", lo, hi);
+		printf("%llu\n", (unsigned long long)s->lat_hist[i]);
+	}
+}
+
+static void print_disk_stats(u32 idx, struct disk_stats *stats)
+{
+	struct disk_stat_op *s;
+	int i;
+
+	printf("Disk %u: %llu requests in flight\n", idx,
+	       (unsigned long long)stats->inflight);
+
+	for (i = 0; i < DISK_STAT_NR; i++) {
+		s = &stats->ops[i];
+		printf("\t%-6s %llu requests, %llu bytes, %llu errors",
+		       disk_stat_names[i], (unsigned long long)s->count,
+		       (unsigned long long)s->bytes,
+		       (unsigned long long)s->errors);
+		if (s->count)
+			printf(", %llu us average latency",
+			       (unsigned long long)(s->lat_total / s->count / 1000));
+		printf("\n");
+		print_disk_latency(s);
+	}
+}
+
+static int do_diskstat(const char *name, int sock)
+{
+	struct disk_stats stats;
+	u32 i, nr;
+	int r;
+
+	r = kvm_ipc__send(sock, KVM_IPC_DISK_STAT);
+	if (r < 0)
+		return r;
+
+	if (read_in_full(sock, &nr, sizeof(nr)) != sizeof(nr)) {
+		pr_err("Could not retrieve disk stats from %s", name);
+		return -1;
+	}
+
+	printf("\n\n\t*** Disk statistics of %s ***\n\n", name);
+	for (i = 0; i < nr; i++) {
+		if (read_in_full(sock, &stats, sizeof(stats)) != sizeof(stats)) {
+			pr_err("Could not retrieve disk stats from %s", name);
+			return -1;
+		}
+		print_disk_stats(i, &stats);
+	}
+	printf("\n");
+
+	return 0;
+}
+
+static int do_stat(const char *name, int sock)
+{
+	int r = 0;
+
+	if (mem)
+		r = do_memstat(name, sock);
+	if (!r && disk)
+		r = do_diskstat(name, sock);
+
+	return r;
+}
+
 int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 {
 	int instance;
@@ -119,11 +210,11 @@ int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 
 	parse_stat_options(argc, argv);
 
-	if (!mem)
+	if (!mem && !disk)
 		usage_with_options(stat_usage, stat_options);
 
-	if (mem && all)
-		return kvm__enumerate_instances(do_memstat);
+	if (all)
+		return kvm__enumerate_instances(do_stat);
 
 	if (instance_name == NULL)
 		kvm_stat_help();
@@ -133,8 +224,7 @@ int kvm_cmd_stat(int argc, const char **argv, const char *prefix)
 	if (instance <= 0)
 		die("Failed locating instance");
 
-	if (mem)
-		r = do_memstat(instance_name, instance);
+	r = do_stat(instance_name, instance);
 
 	close(instance);
 
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <kvm/util.h>
+#include <kvm/kvm-cmd.h>
+#include <kvm/builtin-throttle.h>
+#include <kvm/parse-options.h>
+#include <kvm/disk-image.h>
+#include <kvm/kvm.h>
+#include <kvm/kvm-ipc.h>
+
+static const char *instance_name;
+static int disk;
+static struct disk_throttle_limits limits;
+
+static const char * const throttle_usage[] = {
+	"lkvm throttle [-n name] [-d disk] [--iops-rd n] [--iops-wr n] [--bps-rd n] [--bps-wr n]",
+	NULL
+};
+
+static const struct option throttle_options[] = {
+	OPT_GROUP("Instance options:"),
+	OPT_STRING('n', "name", &instance_name, "name", "Instance name"),
+	OPT_INTEGER('d', "disk", &disk, "Index of the disk, in --disk order"),
+	OPT_GROUP("Limits, 0 or omitted for none:"),
+	OPT_U64('\0', "iops-rd", &limits.rate[DISK_THROTTLE_IOPS_RD],
+		"Reads per second"),
+	OPT_U64('\0', "iops-wr", &limits.rate[DISK_THROTTLE_IOPS_WR],
+		"Writes per second"),
+	OPT_U64('\0', "bps-rd", &limits.rate[DISK_THROTTLE_BPS_RD],
+		"Bytes read per second"),
+	OPT_U64('\0', "bps-wr", &limits.rate[DISK_THROTTLE_BPS_WR],
+		"Bytes written per second"),
+	OPT_U64('\0', "iops-rd-burst", &limits.burst[DISK_THROTTLE_IOPS_RD],
+		"Reads allowed in a burst"),
+	OPT_U64('\0', "iops-wr-burst", &limits.burst[DISK_THROTTLE_IOPS_WR],
+		"Writes allowed in a burst"),
+	OPT_U64('\0', "bps-rd-burst", &limits.burst[DISK_THROTTLE_BPS_RD],
+		"Bytes read in a burst"),
+	OPT_U64('\0', "bps-wr-burst", &limits.burst[DISK_THROTTLE_BPS_WR],
+		"Bytes written in a burst"),
+	OPT_END(),
+};
+
+void kvm_throttle_help(void)
+{
+	usage_with_options(throttle_usage, throttle_options);
+}
+
+static void parse_throttle_options(int argc, const char **argv)
+{
+	while (argc != 0) {
+		argc = parse_options(argc, argv, throttle_options, throttle_usage,
+				PARSE_OPT_STOP_AT_NON_OPTION);
+		if (argc != 0)
+			kvm_throttle_help();
+	}
+}
+
+int kvm_cmd_throttle(int argc, const char **argv, const char *prefix)
+{
+	struct disk_throttle_msg msg;
+	int instance;
+	int r, status;
+
+	parse_throttle_options(argc, argv);
+
+	if (instance_name == NULL || disk < 0)
+		kvm_throttle_help();
+
+	instance = kvm__get_sock_by_instance(instance_name);
+
+	if (instance <= 0)
+		die("Failed locating instance");
+
+	msg = (struct disk_throttle_msg) {
+		.disk	= disk,
+		.limits	= limits,
+	};
+
+	r = kvm_ipc__send_msg(instance, KVM_IPC_DISK_THROTTLE,
+			sizeof(msg), (u8 *)&msg);
+	if (r == 0 && read_in_full(instance, &status, sizeof(status)) != sizeof(status))
+		r = -1;
+
+	close(instance);
+
+	if (r < 0)
+		return -1;
+
+	if (status) {
+		pr_err("Throttling disk %d failed: %s", disk, strerror(-status));
+		return -1;
+	}
+
+	return 0;
+}
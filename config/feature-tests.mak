@@ -167,6 +167,18 @@ int main(void)
 }
 endef
 
+define SOURCE_IO_URING
+#include <liburing.h>
+
+int main(void)
+{
+	struct io_uring ring;
+
+	io_uring_queue_init(1, &ring, 0);
+	return 0;
+}
+endef
+
 define SOURCE_STATIC
 #include <stdlib.h>
 
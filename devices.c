@@ -1,5 +1,6 @@
 #include "kvm/devices.h"
 #include "kvm/kvm.h"
+#include "kvm/pci.h"
 
 #include <linux/err.h>
 #include <linux/rbtree.h>
@@ -25,6 +26,10 @@ int device__register(struct device_header *dev)
 	}
 
 	bus = &device_trees[dev->bus_type];
+	if (dev->bus_type == DEVICE_BUS_PCI && bus->dev_num >= PCI_MAX_DEVICES) {
+		pr_err("No PCI slot left, use the MMIO transport for more devices");
+		return -ENOSPC;
+	}
 	dev->dev_num = bus->dev_num++;
 
 	node = &bus->root.rb_node;
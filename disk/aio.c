@@ -1,5 +1,4 @@
 #include <libaio.h>
-#include <pthread.h>
 #include <sys/eventfd.h>
 
 #include "kvm/brlock.h"
@@ -15,7 +14,7 @@ static int aio_submit(struct disk_image *disk, int nr, struct iocb **ios)
 
 	__sync_fetch_and_add(&disk->aio_inflight, nr);
 	/*
-	 * A wmb() is needed here, to ensure disk_aio_thread() sees this
+	 * A wmb() is needed here, to ensure disk_aio_complete() sees this
 	 * increase after receiving the events. It is included in the
 	 * __sync_fetch_and_add (as a full barrier).
 	 */
@@ -23,19 +22,17 @@ restart:
 	ret = io_submit(disk->ctx, nr, ios);
 	if (ret == -EAGAIN)
 		goto restart;
-	else if (ret <= 0)
-		/* disk_aio_thread() is never going to see those */
-		__sync_fetch_and_sub(&disk->aio_inflight, nr);
+	else if (ret < nr)
+		/* disk_aio_complete() is never going to see those */
+		disk_image__io_done(disk, ret > 0 ? nr - ret : nr);
 
 	return ret;
 }
 
-ssize_t raw_image__read_async(struct disk_image *disk, u64 sector,
-			      const struct iovec *iov, int iovcount,
-			      void *param)
+ssize_t disk_aio_read(struct disk_image *disk, u64 offset,
+		      const struct iovec *iov, int iovcount, void *param)
 {
 	struct iocb iocb;
-	u64 offset = sector << SECTOR_SHIFT;
 	struct iocb *ios[1] = { &iocb };
 
 	io_prep_preadv(&iocb, disk->fd, iov, iovcount, offset);
@@ -45,12 +42,10 @@ ssize_t raw_image__read_async(struct disk_image *disk, u64 sector,
 	return aio_submit(disk, 1, ios);
 }
 
-ssize_t raw_image__write_async(struct disk_image *disk, u64 sector,
-			       const struct iovec *iov, int iovcount,
-			       void *param)
+ssize_t disk_aio_write(struct disk_image *disk, u64 offset,
+		       const struct iovec *iov, int iovcount, void *param)
 {
 	struct iocb iocb;
-	u64 offset = sector << SECTOR_SHIFT;
 	struct iocb *ios[1] = { &iocb };
 
 	io_prep_pwritev(&iocb, disk->fd, iov, iovcount, offset);
@@ -61,57 +56,138 @@ ssize_t raw_image__write_async(struct disk_image *disk, u64 sector,
 }
 
 /*
- * When this function returns there are no in-flight I/O. Caller ensures that
- * io_submit() isn't called concurrently.
- *
- * Returns an inaccurate number of I/O that was in-flight when the function was
- * called.
+ * Prepare up to AIO_MAX iocbs at a time and hand each group to the kernel with
+ * a single io_submit().
  */
-int raw_image__wait(struct disk_image *disk)
+int disk_aio_submit_batch(struct disk_image *disk, struct disk_io *ios, int nr)
 {
-	u64 inflight = disk->aio_inflight;
+	struct iocb iocbs[AIO_MAX];
+	struct iocb *iocbps[AIO_MAX];
+	int done = 0, ret = 0;
+	int i, n;
+
+	while (done < nr) {
+		n = min(nr - done, AIO_MAX);
+
+		for (i = 0; i < n; i++) {
+			struct disk_io *io = &ios[done + i];
+			u64 offset = io->sector << SECTOR_SHIFT;
+
+			if (io->type == DISK_IO_FLUSH)
+				io_prep_fdsync(&iocbs[i], disk->fd);
+			else if (io->type == DISK_IO_WRITE)
+				io_prep_pwritev(&iocbs[i], disk->fd, io->iov,
+						io->iovcount, offset);
+			else
+				io_prep_preadv(&iocbs[i], disk->fd, io->iov,
+					       io->iovcount, offset);
+			io_set_eventfd(&iocbs[i], disk->evt);
+			iocbs[i].data = io->param;
+			iocbps[i] = &iocbs[i];
+		}
+
+		ret = aio_submit(disk, n, iocbps);
+		if (ret <= 0)
+			break;
 
-	while (disk->aio_inflight) {
-		usleep(100);
-		barrier();
+		done += ret;
 	}
 
-	return inflight;
+	return done ? done : ret;
+}
+
+static int disk_aio_complete(struct disk_image *disk, struct io_event *event,
+			     int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		disk->disk_req_cb(event[i].data, event[i].res);
+
+	/* Pairs with wmb() in aio_submit() */
+	rmb();
+	if (nr > 0)
+		disk_image__io_done(disk, nr);
+
+	return nr;
 }
 
-static int disk_aio_get_events(struct disk_image *disk)
+/*
+ * Called by the disk user when disk->evt fires. As with io_uring, completions
+ * are processed by the I/O thread of the disk user rather than by a thread of
+ * our own.
+ */
+void disk_aio_reap(struct disk_image *disk)
 {
 	struct io_event event[AIO_MAX];
 	struct timespec notime = {0};
-	int nr, i;
+	u64 dummy;
+	int nr;
 
-	do {
-		nr = io_getevents(disk->ctx, 1, ARRAY_SIZE(event), event, &notime);
-		for (i = 0; i < nr; i++)
-			disk->disk_req_cb(event[i].data, event[i].res);
+	if (read(disk->evt, &dummy, sizeof(dummy)) < 0 && errno != EAGAIN)
+		return;
 
-		/* Pairs with wmb() in aio_submit() */
-		rmb();
-		__sync_fetch_and_sub(&disk->aio_inflight, nr);
+	/* A thread draining the disk is reaping, it kicks us when it's done */
+	if (!mutex_trylock(&disk->reap_lock))
+		return;
 
+	do {
+		nr = io_getevents(disk->ctx, 1, ARRAY_SIZE(event), event, &notime);
+		disk_aio_complete(disk, event, nr);
 	} while (nr > 0);
 
-	return 0;
+	mutex_unlock(&disk->reap_lock);
+
+	/* The drain may have been waiting for us to let go of the events */
+	disk_image__drain_wake(disk);
 }
 
-static void *disk_aio_thread(void *param)
+/*
+ * When this function returns there are no in-flight I/O. Caller ensures that
+ * io_submit() isn't called concurrently.
+ *
+ * The disk user normally reaps the completions, and wakes us up as it goes.
+ * Whenever it isn't reaping, we take over and block for the events ourselves,
+ * since the disk user may be the caller, or be stuck behind it.
+ *
+ * Returns an inaccurate number of I/O that was in-flight when the function was
+ * called.
+ */
+int disk_aio_wait(struct disk_image *disk)
 {
-	struct disk_image *disk = param;
-	u64 dummy;
-
-	kvm__set_thread_name("disk-image-io");
-
-	while (read(disk->evt, &dummy, sizeof(dummy)) > 0) {
-		if (disk_aio_get_events(disk))
-			break;
+	struct io_event event[AIO_MAX];
+	u64 inflight = disk->aio_inflight;
+	u64 data = 1;
+	int nr = 0;
+
+	mutex_lock(&disk->drain_lock);
+	while (disk->aio_inflight && nr >= 0) {
+		if (!mutex_trylock(&disk->reap_lock)) {
+			pthread_cond_wait(&disk->drain_cond, &disk->drain_lock.mutex);
+			continue;
+		}
+		mutex_unlock(&disk->drain_lock);
+
+		while (disk->aio_inflight) {
+			nr = io_getevents(disk->ctx, 1, ARRAY_SIZE(event), event,
+					  NULL);
+			if (nr < 0 && nr != -EINTR)
+				break;
+			disk_aio_complete(disk, event, nr);
+		}
+
+		mutex_unlock(&disk->reap_lock);
+
+		/* Completions the disk user skipped while we held the events */
+		if (disk->aio_inflight &&
+		    write(disk->evt, &data, sizeof(data)) < 0)
+			pr_warning("Failed to kick the disk completions");
+
+		mutex_lock(&disk->drain_lock);
 	}
+	mutex_unlock(&disk->drain_lock);
 
-	return NULL;
+	return inflight;
 }
 
 int disk_aio_setup(struct disk_image *disk)
@@ -122,29 +198,29 @@ int disk_aio_setup(struct disk_image *disk)
 	if (!disk->ops->async)
 		return 0;
 
-	disk->evt = eventfd(0, 0);
+	disk->evt = eventfd(0, EFD_NONBLOCK);
 	if (disk->evt < 0)
 		return -errno;
 
-	io_setup(AIO_MAX, &disk->ctx);
-	r = pthread_create(&disk->thread, NULL, disk_aio_thread, disk);
+	r = io_setup(AIO_MAX, &disk->ctx);
 	if (r) {
-		r = -errno;
 		close(disk->evt);
 		return r;
 	}
 
+	disk->aio = true;
 	disk->async = true;
 	return 0;
 }
 
 void disk_aio_destroy(struct disk_image *disk)
 {
-	if (!disk->async)
+	if (!disk->aio)
 		return;
 
-	pthread_cancel(disk->thread);
-	pthread_join(disk->thread, NULL);
 	close(disk->evt);
 	io_destroy(disk->ctx);
+	/* The image may still be written back synchronously when closed */
+	disk->aio = false;
+	disk->async = false;
 }
@@ -3,14 +3,39 @@
 #include <linux/err.h>
 #include <mntent.h>
 
+static int blk_dev__discard(struct disk_image *disk, u64 sector, u64 nr_sectors)
+{
+	u64 range[2] = { sector << SECTOR_SHIFT, nr_sectors << SECTOR_SHIFT };
+
+	if (ioctl(disk->fd, BLKDISCARD, range) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* The block layer picks between unmapping and writing zeroes on its own */
+static int blk_dev__write_zeroes(struct disk_image *disk, u64 sector,
+				 u64 nr_sectors, bool unmap)
+{
+	u64 range[2] = { sector << SECTOR_SHIFT, nr_sectors << SECTOR_SHIFT };
+
+	if (ioctl(disk->fd, BLKZEROOUT, range) < 0)
+		return -errno;
+
+	return 0;
+}
+
 /*
  * raw image and blk dev are similar, so reuse raw image ops.
  */
 static struct disk_image_operations blk_dev_ops = {
-	.read	= raw_image__read,
-	.write	= raw_image__write,
-	.wait	= raw_image__wait,
-	.async	= true,
+	.read		= raw_image__read,
+	.write		= raw_image__write,
+	.submit_batch	= raw_image__batch,
+	.discard	= blk_dev__discard,
+	.write_zeroes	= blk_dev__write_zeroes,
+	.wait		= raw_image__wait,
+	.async		= true,
 };
 
 static bool is_mounted(struct stat *st)
@@ -0,0 +1,300 @@
+#include "kvm/disk-image.h"
+#include "kvm/iovec.h"
+#include "kvm/mutex.h"
+
+#include <linux/kernel.h>
+
+/*
+ * O_DIRECT requires buffers, lengths and offsets aligned to the logical block
+ * size of the host device. Guest buffers usually are, but nothing guarantees
+ * it. Requests with misaligned segments go through buffers taken from a small
+ * pool of aligned ones, while aligned segments are still used in place.
+ *
+ * The guest is told about the block size, so its requests should start and end
+ * on block boundaries. Those that don't are done on the whole blocks covering
+ * them, with a read-modify-write for writes.
+ */
+#define DISK_BOUNCE_BUFS	32
+#define DISK_BOUNCE_BUF_SIZE	(64 * 1024)
+
+/* Used when the alignment can't be queried */
+#define DISK_BOUNCE_DEFAULT_ALIGN	4096
+
+struct disk_bounce_pool {
+	struct mutex		lock;
+	/* Serialises read-modify-writes, which may share blocks */
+	struct mutex		rmw_lock;
+	void			*mem;
+	void			*free[DISK_BOUNCE_BUFS];
+	int			nr_free;
+};
+
+/* Consecutive misaligned segments, copied through a single buffer */
+struct disk_bounce_run {
+	int			first;
+	int			nr;
+	size_t			len;
+	void			*buf;
+};
+
+static u32 disk_bounce__get_align(struct disk_image *disk)
+{
+	struct stat st;
+	int size;
+
+	if (fstat(disk->fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+		if (ioctl(disk->fd, BLKSSZGET, &size) == 0 && size > 0)
+			return size;
+		return DISK_BOUNCE_DEFAULT_ALIGN;
+	}
+
+#ifdef STATX_DIOALIGN
+	{
+		struct statx stx;
+
+		if (statx(disk->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+		    (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_mem_align)
+			return max(stx.stx_dio_mem_align, stx.stx_dio_offset_align);
+	}
+#endif
+
+	return DISK_BOUNCE_DEFAULT_ALIGN;
+}
+
+int disk_bounce__setup(struct disk_image *disk)
+{
+	struct disk_bounce_pool *pool;
+	u32 align;
+	int i;
+
+	align = disk_bounce__get_align(disk);
+	if (align <= 1)
+		return 0;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return -ENOMEM;
+
+	if (posix_memalign(&pool->mem, max_t(u32, align, 4096),
+			   DISK_BOUNCE_BUFS * DISK_BOUNCE_BUF_SIZE)) {
+		free(pool);
+		return -ENOMEM;
+	}
+
+	mutex_init(&pool->lock);
+	mutex_init(&pool->rmw_lock);
+	for (i = 0; i < DISK_BOUNCE_BUFS; i++)
+		pool->free[i] = pool->mem + i * DISK_BOUNCE_BUF_SIZE;
+	pool->nr_free = DISK_BOUNCE_BUFS;
+
+	disk->bounce	= pool;
+	disk->dio_align	= align;
+
+	return 0;
+}
+
+void disk_bounce__destroy(struct disk_image *disk)
+{
+	struct disk_bounce_pool *pool = disk->bounce;
+
+	if (!pool)
+		return;
+
+	free(pool->mem);
+	free(pool);
+	disk->bounce = NULL;
+}
+
+bool disk_bounce__misaligned(struct disk_image *disk, u64 sector,
+			     const struct iovec *iov, int iovcount)
+{
+	unsigned long mask = disk->dio_align - 1;
+	int i;
+
+	if ((sector << SECTOR_SHIFT) & mask)
+		return true;
+
+	for (i = 0; i < iovcount; i++) {
+		if (((unsigned long)iov[i].iov_base | iov[i].iov_len) & mask)
+			return true;
+	}
+
+	return false;
+}
+
+/* Runs larger than a pool buffer, or a drained pool, get a buffer of their own */
+static void *disk_bounce__get(struct disk_image *disk, size_t len)
+{
+	struct disk_bounce_pool *pool = disk->bounce;
+	void *buf = NULL;
+
+	if (len <= DISK_BOUNCE_BUF_SIZE) {
+		mutex_lock(&pool->lock);
+		if (pool->nr_free)
+			buf = pool->free[--pool->nr_free];
+		mutex_unlock(&pool->lock);
+		if (buf)
+			return buf;
+	}
+
+	if (posix_memalign(&buf, disk->dio_align, len))
+		return NULL;
+
+	return buf;
+}
+
+static void disk_bounce__put(struct disk_image *disk, void *buf)
+{
+	struct disk_bounce_pool *pool = disk->bounce;
+
+	if (buf < pool->mem ||
+	    buf >= pool->mem + DISK_BOUNCE_BUFS * DISK_BOUNCE_BUF_SIZE) {
+		free(buf);
+		return;
+	}
+
+	mutex_lock(&pool->lock);
+	pool->free[pool->nr_free++] = buf;
+	mutex_unlock(&pool->lock);
+}
+
+static void disk_bounce__copy(struct disk_bounce_run *run,
+			      const struct iovec *iov, bool to_buf)
+{
+	void *buf = run->buf;
+	int i;
+
+	for (i = run->first; i < run->first + run->nr; i++) {
+		if (to_buf)
+			memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+		else
+			memcpy(iov[i].iov_base, buf, iov[i].iov_len);
+		buf += iov[i].iov_len;
+	}
+}
+
+/*
+ * A request that doesn't start or end on a block boundary is done on the whole
+ * blocks covering it. For a write, only the blocks at both ends hold data that
+ * isn't overwritten, and are read first.
+ */
+static ssize_t disk_bounce__rmw(struct disk_image *disk, int type, u64 offset,
+				const struct iovec *iov, int iovcount)
+{
+	struct disk_bounce_pool *pool = disk->bounce;
+	u64 mask = disk->dio_align - 1;
+	size_t len = iov_size(iov, iovcount);
+	u64 start = offset & ~mask;
+	u64 end = (offset + len + mask) & ~mask;
+	size_t head = offset - start;
+	void *buf;
+	ssize_t ret;
+
+	buf = disk_bounce__get(disk, end - start);
+	if (!buf)
+		return -ENOMEM;
+
+	/* Past the end of the image, blocks read as zeroes */
+	memset(buf, 0, end - start);
+
+	mutex_lock(&pool->rmw_lock);
+
+	if (type == DISK_IO_READ) {
+		ret = pread_in_full(disk->fd, buf, end - start, start);
+		if (ret >= 0)
+			memcpy_toiovecend(iov, buf + head, 0, len);
+		goto out;
+	}
+
+	ret = pread_in_full(disk->fd, buf, disk->dio_align, start);
+	if (ret >= 0 && end - start > disk->dio_align)
+		ret = pread_in_full(disk->fd, buf + end - start - disk->dio_align,
+				    disk->dio_align, end - disk->dio_align);
+	if (ret < 0)
+		goto out;
+
+	memcpy_fromiovecend(buf + head, iov, 0, len);
+	ret = pwrite_in_full(disk->fd, buf, end - start, start);
+
+out:
+	mutex_unlock(&pool->rmw_lock);
+	disk_bounce__put(disk, buf);
+
+	return ret < 0 ? -errno : (ssize_t)len;
+}
+
+/*
+ * Synchronous read or write of a request with misaligned segments. Each run
+ * of misaligned segments is replaced by one aligned buffer, which is possible
+ * as long as the run adds up to a multiple of the alignment.
+ */
+ssize_t disk_bounce__rw(struct disk_image *disk, int type, u64 offset,
+			const struct iovec *iov, int iovcount)
+{
+	unsigned long mask = disk->dio_align - 1;
+	struct disk_bounce_run *runs, *run;
+	int i, n = 0, nr_runs = 0;
+	struct iovec *biov;
+	ssize_t ret;
+
+	if ((offset | iov_size(iov, iovcount)) & mask)
+		return disk_bounce__rmw(disk, type, offset, iov, iovcount);
+
+	biov = malloc(iovcount * (sizeof(*biov) + sizeof(*runs)));
+	if (!biov)
+		return -ENOMEM;
+	runs = (void *)(biov + iovcount);
+
+	for (i = 0; i < iovcount;) {
+		if (!(((unsigned long)iov[i].iov_base | iov[i].iov_len) & mask)) {
+			biov[n++] = iov[i++];
+			continue;
+		}
+
+		run = &runs[nr_runs];
+		*run = (struct disk_bounce_run) { .first = i };
+		do {
+			run->len += iov[i++].iov_len;
+		} while (i < iovcount && (run->len & mask));
+		run->nr = i - run->first;
+
+		if (run->len & mask) {
+			ret = -EINVAL;
+			goto out;
+		}
+
+		run->buf = disk_bounce__get(disk, run->len);
+		if (!run->buf) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		nr_runs++;
+
+		if (type == DISK_IO_WRITE)
+			disk_bounce__copy(run, iov, true);
+
+		biov[n++] = (struct iovec) {
+			.iov_base	= run->buf,
+			.iov_len	= run->len,
+		};
+	}
+
+	if (type == DISK_IO_WRITE)
+		ret = pwritev_in_full(disk->fd, biov, n, offset);
+	else
+		ret = preadv_in_full(disk->fd, biov, n, offset);
+	if (ret < 0)
+		ret = -errno;
+
+	if (ret >= 0 && type == DISK_IO_READ) {
+		for (i = 0; i < nr_runs; i++)
+			disk_bounce__copy(&runs[i], iov, false);
+	}
+
+out:
+	for (i = 0; i < nr_runs; i++)
+		disk_bounce__put(disk, runs[i].buf);
+	free(biov);
+
+	return ret;
+}
@@ -2,30 +2,61 @@
 #include "kvm/qcow.h"
 #include "kvm/virtio-blk.h"
 #include "kvm/kvm.h"
+#include "kvm/kvm-ipc.h"
 #include "kvm/iovec.h"
 
 #include <linux/err.h>
+#include <ctype.h>
 #include <poll.h>
 
 int debug_iodelay;
 
-static int disk_image__close(struct disk_image *disk);
+/* Polling a queue for any longer would only burn the CPU */
+#define DISK_POLL_MAX_US	1000000
+/* Longest an interrupt may be held back for */
+#define DISK_COALESCE_MAX_USECS	1000000
+
+/*
+ * Parse the value of a disk option: a plain number, which ends with the
+ * option, and lies within [@min, @max]. Returns -EINVAL otherwise.
+ */
+int disk_image__parse_value(const char *arg, u64 min, u64 max, u64 *value)
+{
+	char *end;
+
+	if (!isdigit(*arg))
+		return -EINVAL;
+
+	errno = 0;
+	*value = strtoull(arg, &end, 0);
+	if (errno || (*end && *end != ','))
+		return -EINVAL;
+
+	if (*value < min || *value > max)
+		return -EINVAL;
+
+	return 0;
+}
 
 int disk_img_name_parser(const struct option *opt, const char *arg, int unset)
 {
 	const char *cur;
 	char *sep;
 	struct kvm *kvm = opt->ptr;
+	struct disk_image_params *params;
+	u64 value;
+	int r;
 
 	if (kvm->nr_disks >= MAX_DISK_IMAGES)
-		die("Currently only 4 images are supported");
+		die("Currently only %d images are supported", MAX_DISK_IMAGES);
 
-	kvm->cfg.disk_image[kvm->nr_disks].filename = arg;
+	params = &kvm->cfg.disk_image[kvm->nr_disks];
+	params->filename = arg;
 	cur = arg;
 
 	if (strncmp(arg, "scsi:", 5) == 0) {
 		sep = strstr(arg, ":");
-		kvm->cfg.disk_image[kvm->nr_disks].wwpn = sep + 1;
+		params->wwpn = sep + 1;
 
 		/* Old invocation had two parameters. Ignore the second one. */
 		sep = strstr(sep + 1, ":");
@@ -38,10 +69,51 @@ int disk_img_name_parser(const struct option *opt, const char *arg, int unset)
 	do {
 		sep = strstr(cur, ",");
 		if (sep) {
+			r = 0;
 			if (strncmp(sep + 1, "ro", 2) == 0)
-				kvm->cfg.disk_image[kvm->nr_disks].readonly = true;
+				params->readonly = true;
 			else if (strncmp(sep + 1, "direct", 6) == 0)
-				kvm->cfg.disk_image[kvm->nr_disks].direct = true;
+				params->direct = true;
+			else if (strncmp(sep + 1, "sqpoll", 6) == 0)
+				params->sqpoll = true;
+			else if (strncmp(sep + 1, "merge", 5) == 0)
+				params->merge = true;
+			else if (strncmp(sep + 1, "queues=", 7) == 0) {
+				r = disk_image__parse_value(sep + 8, 1,
+						VIRTIO_BLK_MAX_QUEUES, &value);
+				params->nr_queues = value;
+			} else if (strncmp(sep + 1, "cache=", 6) == 0) {
+				r = disk_image__parse_value(sep + 7, 0, INT_MAX,
+							    &value);
+				params->cache_nodes = value;
+			} else if (strncmp(sep + 1, "poll=", 5) == 0) {
+				r = disk_image__parse_value(sep + 6, 0,
+						DISK_POLL_MAX_US, &value);
+				params->poll_us = value;
+			} else if (strncmp(sep + 1, "coalesce_usecs=", 15) == 0) {
+				r = disk_image__parse_value(sep + 16, 0,
+						DISK_COALESCE_MAX_USECS, &value);
+				params->coalesce_usecs = value;
+			} else if (strncmp(sep + 1, "coalesce_frames=", 16) == 0) {
+				r = disk_image__parse_value(sep + 17, 0, UINT_MAX,
+							    &value);
+				params->coalesce_frames = value;
+			} else if (strncmp(sep + 1, "cor", 3) == 0)
+				params->copy_on_read = true;
+			else if (strncmp(sep + 1, "overlay=", 8) == 0)
+				params->overlay = sep + 9;
+			else if (strncmp(sep + 1, "boot_trace_secs=", 16) == 0) {
+				r = disk_image__parse_value(sep + 17, 0, UINT_MAX,
+							    &value);
+				params->boot_trace_secs = value;
+			} else if (strncmp(sep + 1, "boot_trace=", 11) == 0)
+				params->boot_trace = sep + 12;
+			else
+				r = disk_throttle__parse_option(&params->throttle,
+								sep + 1);
+			if (r < 0)
+				die("Invalid disk option '%.*s'",
+				    (int)strcspn(sep + 1, ","), sep + 1);
 			*sep = 0;
 			cur = sep + 1;
 		}
@@ -69,6 +141,12 @@ struct disk_image *disk_image__new(int fd, u64 size,
 		.ops	= ops,
 	};
 
+#ifdef DISK_IMAGE_HAS_ASYNC
+	mutex_init(&disk->drain_lock);
+	pthread_cond_init(&disk->drain_cond, NULL);
+	mutex_init(&disk->reap_lock);
+#endif
+
 	if (use_mmap == DISK_IMAGE_MMAP) {
 		/*
 		 * The write to disk image will be discarded
@@ -80,22 +158,17 @@ struct disk_image *disk_image__new(int fd, u64 size,
 		}
 	}
 
-	r = disk_aio_setup(disk);
-	if (r)
-		goto err_unmap_disk;
-
 	return disk;
 
-err_unmap_disk:
-	if (disk->priv)
-		munmap(disk->priv, size);
 err_free_disk:
 	free(disk);
 	return ERR_PTR(r);
 }
 
-static struct disk_image *disk_image__open(const char *filename, bool readonly, bool direct)
+struct disk_image *disk_image__open(struct disk_image_params *params)
 {
+	const char *filename = params->filename;
+	bool readonly = params->readonly;
 	struct disk_image *disk;
 	struct stat st;
 	int fd, flags;
@@ -104,16 +177,20 @@ static struct disk_image *disk_image__open(const char *filename, bool readonly,
 		flags = O_RDONLY;
 	else
 		flags = O_RDWR;
-	if (direct)
+	if (params->direct)
 		flags |= O_DIRECT;
 
 	if (stat(filename, &st) < 0)
 		return ERR_PTR(-errno);
 
+	if (params->overlay)
+		return disk_overlay__open(params);
+
 	/* blk device ?*/
 	disk = blkdev__probe(filename, flags, &st);
 	if (!IS_ERR_OR_NULL(disk)) {
 		disk->readonly = readonly;
+		disk->flat = true;
 		return disk;
 	}
 
@@ -122,17 +199,15 @@ static struct disk_image *disk_image__open(const char *filename, bool readonly,
 		return ERR_PTR(fd);
 
 	/* qcow image ?*/
-	disk = qcow_probe(fd, true);
-	if (!IS_ERR_OR_NULL(disk)) {
-		pr_warning("Forcing read-only support for QCOW");
-		disk->readonly = true;
+	disk = qcow_probe(fd, params);
+	if (!IS_ERR_OR_NULL(disk))
 		return disk;
-	}
 
 	/* raw image ?*/
 	disk = raw_image__probe(fd, &st, readonly);
 	if (!IS_ERR_OR_NULL(disk)) {
 		disk->readonly = readonly;
+		disk->flat = true;
 		return disk;
 	}
 
@@ -142,15 +217,30 @@ static struct disk_image *disk_image__open(const char *filename, bool readonly,
 	return ERR_PTR(-ENOSYS);
 }
 
+/*
+ * Pick the asynchronous I/O engine once the image parameters are known:
+ * io_uring when the host supports it, libaio otherwise.
+ */
+static int disk_image__setup_async(struct disk_image *disk,
+				   struct disk_image_params *params)
+{
+	/* No need to setup AIO if the disk ops won't make use of it */
+	if (!disk->ops->async)
+		return 0;
+
+	if (!disk_uring_setup(disk, params->sqpoll))
+		return 0;
+
+	return disk_aio_setup(disk);
+}
+
 static struct disk_image **disk_image__open_all(struct kvm *kvm)
 {
 	struct disk_image **disks;
 	const char *filename;
 	const char *wwpn;
-	bool readonly;
-	bool direct;
 	void *err;
-	int i;
+	int i, r;
 	struct disk_image_params *params = (struct disk_image_params *)&kvm->cfg.disk_image;
 	int count = kvm->nr_disks;
 
@@ -165,8 +255,6 @@ static struct disk_image **disk_image__open_all(struct kvm *kvm)
 
 	for (i = 0; i < count; i++) {
 		filename = params[i].filename;
-		readonly = params[i].readonly;
-		direct = params[i].direct;
 		wwpn = params[i].wwpn;
 
 		if (wwpn) {
@@ -182,13 +270,52 @@ static struct disk_image **disk_image__open_all(struct kvm *kvm)
 		if (!filename)
 			continue;
 
-		disks[i] = disk_image__open(filename, readonly, direct);
+		disks[i] = disk_image__open(&params[i]);
 		if (IS_ERR_OR_NULL(disks[i])) {
 			pr_err("Loading disk image '%s' failed", filename);
 			err = disks[i];
 			goto error;
 		}
 		disks[i]->debug_iodelay = kvm->cfg.debug_iodelay;
+		disks[i]->nr_queues = params[i].nr_queues;
+		disks[i]->merge = params[i].merge;
+		disks[i]->poll_us = params[i].poll_us;
+		disks[i]->coalesce_usecs = params[i].coalesce_usecs;
+		disks[i]->coalesce_frames = params[i].coalesce_frames;
+
+		if (params[i].direct) {
+			r = disk_bounce__setup(disks[i]);
+			if (r) {
+				pr_err("Allocating bounce buffers for '%s' failed",
+				       filename);
+				err = ERR_PTR(r);
+				goto error;
+			}
+		}
+
+		r = disk_throttle__set(disks[i], &params[i].throttle);
+		if (r) {
+			pr_err("Setting up throttling for '%s' failed", filename);
+			err = ERR_PTR(r);
+			goto error;
+		}
+
+		if (params[i].boot_trace) {
+			r = disk_trace__setup(disks[i], &params[i]);
+			if (r) {
+				pr_err("Setting up boot trace '%s' failed",
+				       params[i].boot_trace);
+				err = ERR_PTR(r);
+				goto error;
+			}
+		}
+
+		r = disk_image__setup_async(disks[i], &params[i]);
+		if (r) {
+			pr_err("Setting up async I/O for '%s' failed", filename);
+			err = ERR_PTR(r);
+			goto error;
+		}
 	}
 
 	return disks;
@@ -206,6 +333,27 @@ error:
 	return err;
 }
 
+#ifdef DISK_IMAGE_HAS_ASYNC
+/*
+ * Called by the async engines after completing @nr requests. Wakes up anyone
+ * draining the disk once the last in-flight request is gone.
+ */
+void disk_image__io_done(struct disk_image *disk, int nr)
+{
+	if (__sync_sub_and_fetch(&disk->aio_inflight, nr))
+		return;
+
+	disk_image__drain_wake(disk);
+}
+
+void disk_image__drain_wake(struct disk_image *disk)
+{
+	mutex_lock(&disk->drain_lock);
+	pthread_cond_broadcast(&disk->drain_cond);
+	mutex_unlock(&disk->drain_lock);
+}
+#endif
+
 int disk_image__wait(struct disk_image *disk)
 {
 	if (disk->ops->wait)
@@ -214,21 +362,51 @@ int disk_image__wait(struct disk_image *disk)
 	return 0;
 }
 
+/*
+ * Wait for the in-flight requests of all disks when the guest is paused. The
+ * devices have stopped submitting by then.
+ */
+static int disk_image__pause(struct kvm *kvm)
+{
+	int i;
+
+	if (!kvm->disks)
+		return 0;
+
+	for (i = 0; i < kvm->nr_disks; i++) {
+		if (kvm->disks[i] && !kvm->disks[i]->wwpn)
+			disk_image__wait(kvm->disks[i]);
+	}
+
+	return 0;
+}
+dev_base_pause(disk_image__pause);
+
 int disk_image__flush(struct disk_image *disk)
 {
+	/* Requests that were already submitted must reach the image first */
+	if (disk->async)
+		disk_image__wait(disk);
+
 	if (disk->ops->flush)
 		return disk->ops->flush(disk);
 
 	return fsync(disk->fd);
 }
 
-static int disk_image__close(struct disk_image *disk)
+int disk_image__close(struct disk_image *disk)
 {
 	/* If there was no disk image then there's nothing to do: */
 	if (!disk)
 		return 0;
 
+	disk_uring_destroy(disk);
 	disk_aio_destroy(disk);
+	disk_bounce__destroy(disk);
+	disk_throttle__destroy(disk);
+	disk_extent__destroy(disk);
+	disk_overlay__destroy(disk);
+	disk_trace__destroy(disk);
 
 	if (disk->ops && disk->ops->close)
 		return disk->ops->close(disk);
@@ -263,10 +441,15 @@ ssize_t disk_image__read(struct disk_image *disk, u64 sector,
 	if (debug_iodelay)
 		msleep(debug_iodelay);
 
+	if (disk->trace)
+		disk_trace__read(disk, sector, iov_size(iov, iovcount));
+
 	if (disk->ops->read) {
 		total = disk->ops->read(disk, sector, iov, iovcount, param);
 		if (total < 0) {
 			pr_info("disk_image__read error: total=%ld\n", (long)total);
+			if (disk->disk_req_cb)
+				disk->disk_req_cb(param, total);
 			return total;
 		}
 	}
@@ -297,6 +480,8 @@ ssize_t disk_image__write(struct disk_image *disk, u64 sector,
 		total = disk->ops->write(disk, sector, iov, iovcount, param);
 		if (total < 0) {
 			pr_info("disk_image__write error: total=%ld\n", (long)total);
+			if (disk->disk_req_cb)
+				disk->disk_req_cb(param, total);
 			return total;
 		}
 	} else {
@@ -309,6 +494,103 @@ ssize_t disk_image__write(struct disk_image *disk, u64 sector,
 	return total;
 }
 
+/*
+ * Submit a set of reads, writes and flushes gathered by the caller. Every
+ * request is completed through the disk callback, whether or not the backend
+ * accepted it. Returns the number of requests handed to the backend.
+ */
+int disk_image__submit_batch(struct disk_image *disk, struct disk_io *ios, int nr)
+{
+	int i, done;
+
+	if (!disk->async || !disk->ops->submit_batch) {
+		for (i = 0; i < nr; i++) {
+			if (ios[i].type == DISK_IO_FLUSH)
+				disk->disk_req_cb(ios[i].param,
+						  disk_image__flush(disk));
+			else if (ios[i].type == DISK_IO_WRITE)
+				disk_image__write(disk, ios[i].sector, ios[i].iov,
+						  ios[i].iovcount, ios[i].param);
+			else
+				disk_image__read(disk, ios[i].sector, ios[i].iov,
+						 ios[i].iovcount, ios[i].param);
+		}
+		return nr;
+	}
+
+	if (debug_iodelay)
+		msleep(debug_iodelay);
+
+	if (disk->trace) {
+		for (i = 0; i < nr; i++) {
+			if (ios[i].type == DISK_IO_READ)
+				disk_trace__read(disk, ios[i].sector,
+						 iov_size(ios[i].iov, ios[i].iovcount));
+		}
+	}
+
+	done = disk->ops->submit_batch(disk, ios, nr);
+	if (done < 0) {
+		pr_info("disk_image__submit_batch error: %d\n", done);
+		done = 0;
+	}
+
+	/*
+	 * The backend won't ever complete those. Flushes may have been refused
+	 * because the engine can't do them asynchronously, do them here.
+	 */
+	for (i = done; i < nr; i++) {
+		if (ios[i].type == DISK_IO_FLUSH)
+			disk->disk_req_cb(ios[i].param, disk_image__flush(disk));
+		else
+			disk->disk_req_cb(ios[i].param, -EIO);
+	}
+
+	return done;
+}
+
+static int disk_image__check_range(struct disk_image *disk, u64 sector,
+				   u64 nr_sectors)
+{
+	if (disk->readonly)
+		return -EROFS;
+
+	if (sector + nr_sectors < sector ||
+	    (sector + nr_sectors) << SECTOR_SHIFT > disk->size)
+		return -EINVAL;
+
+	return 0;
+}
+
+int disk_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors)
+{
+	int r;
+
+	if (!disk->ops->discard)
+		return -EOPNOTSUPP;
+
+	r = disk_image__check_range(disk, sector, nr_sectors);
+	if (r)
+		return r;
+
+	return disk->ops->discard(disk, sector, nr_sectors);
+}
+
+int disk_image__write_zeroes(struct disk_image *disk, u64 sector, u64 nr_sectors,
+			     bool unmap)
+{
+	int r;
+
+	if (!disk->ops->write_zeroes)
+		return -EOPNOTSUPP;
+
+	r = disk_image__check_range(disk, sector, nr_sectors);
+	if (r)
+		return r;
+
+	return disk->ops->write_zeroes(disk, sector, nr_sectors, unmap);
+}
+
 ssize_t disk_image__get_serial(struct disk_image *disk, struct iovec *iov,
 			       int iovcount, ssize_t len)
 {
@@ -338,12 +620,116 @@ ssize_t disk_image__get_serial(struct disk_image *disk, struct iovec *iov,
 	return len;
 }
 
+/*
+ * Async backends have no completion thread of their own, they signal the
+ * returned fd when requests complete. The disk user is then expected to poll
+ * it and call disk_image__reap() from its I/O thread. Returns -1 if there is
+ * nothing to poll.
+ */
+int disk_image__completion_fd(struct disk_image *disk)
+{
+#ifdef CONFIG_HAS_IO_URING
+	if (disk->uring)
+		return disk->evt;
+#endif
+#ifdef CONFIG_HAS_AIO
+	if (disk->aio)
+		return disk->evt;
+#endif
+	return -1;
+}
+
+void disk_image__reap(struct disk_image *disk)
+{
+#ifdef CONFIG_HAS_IO_URING
+	if (disk->uring)
+		disk_uring_reap(disk);
+#endif
+#ifdef CONFIG_HAS_AIO
+	if (disk->aio)
+		disk_aio_reap(disk);
+#endif
+}
+
 void disk_image__set_callback(struct disk_image *disk,
 			      void (*disk_req_cb)(void *param, long len))
 {
 	disk->disk_req_cb = disk_req_cb;
 }
 
+static void handle_throttle(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg)
+{
+	struct disk_throttle_msg *tmsg = (void *)msg;
+	struct disk_image *disk;
+	int r = -ENODEV;
+
+	if (WARN_ON(type != KVM_IPC_DISK_THROTTLE || len != sizeof(*tmsg)))
+		return;
+
+	if (tmsg->disk < (u32)kvm->nr_disks) {
+		disk = kvm->disks[tmsg->disk];
+		if (disk && !disk->wwpn)
+			r = disk_throttle__set(disk, &tmsg->limits);
+	}
+
+	if (write(fd, &r, sizeof(r)) < 0)
+		pr_warning("Failed sending throttle status");
+}
+
+static void handle_overlay(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg)
+{
+	struct disk_overlay_msg *omsg = (void *)msg;
+	struct disk_image *disk = NULL;
+	int r = -ENODEV;
+
+	if (WARN_ON(type != KVM_IPC_DISK_OVERLAY || len != sizeof(*omsg)))
+		return;
+
+	if (omsg->disk < (u32)kvm->nr_disks)
+		disk = kvm->disks[omsg->disk];
+
+	if (disk && !disk->wwpn) {
+		switch (omsg->op) {
+		case DISK_OVERLAY_COMMIT:
+			r = disk_overlay__commit(disk);
+			break;
+		case DISK_OVERLAY_DISCARD:
+			r = disk_overlay__discard(disk);
+			break;
+		default:
+			r = -EINVAL;
+		}
+	}
+
+	if (write(fd, &r, sizeof(r)) < 0)
+		pr_warning("Failed sending overlay status");
+}
+
+static void handle_stat(struct kvm *kvm, int fd, u32 type, u32 len, u8 *msg)
+{
+	struct disk_stats none = {};
+	struct disk_image *disk;
+	u32 nr = kvm->nr_disks;
+	int i;
+
+	if (WARN_ON(type != KVM_IPC_DISK_STAT || len))
+		return;
+
+	if (write_in_full(fd, &nr, sizeof(nr)) < 0)
+		goto err;
+
+	for (i = 0; i < kvm->nr_disks; i++) {
+		disk = kvm->disks[i];
+		if (write_in_full(fd, disk && !disk->wwpn ? &disk->stats : &none,
+				  sizeof(none)) < 0)
+			goto err;
+	}
+
+	return;
+err:
+	pr_warning("Failed sending disk stats");
+}
+
 int disk_image__init(struct kvm *kvm)
 {
 	if (kvm->nr_disks) {
@@ -352,12 +738,21 @@ int disk_image__init(struct kvm *kvm)
 			return PTR_ERR(kvm->disks);
 	}
 
+	kvm_ipc__register_handler(KVM_IPC_DISK_THROTTLE, handle_throttle);
+	kvm_ipc__register_handler(KVM_IPC_DISK_STAT, handle_stat);
+	kvm_ipc__register_handler(KVM_IPC_DISK_OVERLAY, handle_overlay);
+
 	return 0;
 }
 dev_base_init(disk_image__init);
 
 int disk_image__exit(struct kvm *kvm)
 {
-	return disk_image__close_all(kvm->disks, kvm->nr_disks);
+	int r = disk_image__close_all(kvm->disks, kvm->nr_disks);
+
+	/* The vCPUs are paused once more after this, on their way out */
+	kvm->disks = NULL;
+
+	return r;
 }
 dev_base_exit(disk_image__exit);
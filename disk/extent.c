@@ -0,0 +1,182 @@
+#include "kvm/disk-image.h"
+
+#include <linux/bitops.h>
+#include <linux/kernel.h>
+
+/*
+ * Allocation map of a sparse raw image, built from SEEK_DATA/SEEK_HOLE when the
+ * image is opened. The image is cut into chunks, and a chunk's bit is set if
+ * any part of it may hold data. Writes set the bits of the chunks they touch
+ * before reaching the file, and ranges that were zeroed clear the bits of the
+ * chunks they fully cover, so a clear bit means the chunk reads back as
+ * zeroes, unless the guest zeroes and writes the same range concurrently.
+ * Reads of clear chunks don't have to go to the file.
+ *
+ * Requests are handled by several threads, hence the atomics.
+ */
+#define DISK_EXTENT_MIN_SHIFT	16
+/* Caps the map at 2MB */
+#define DISK_EXTENT_MAX_CHUNKS	(1ULL << 24)
+
+struct disk_extent_map {
+	unsigned int		shift;
+	u64			nr_chunks;
+	unsigned long		*data;
+};
+
+static void disk_extent__update(struct disk_extent_map *map, u64 first,
+				u64 last, bool set)
+{
+	unsigned long *word, mask;
+	u64 nr;
+
+	while (first <= last) {
+		word	= &map->data[BIT_WORD(first)];
+		nr	= min_t(u64, last - first + 1,
+				BITS_PER_LONG - first % BITS_PER_LONG);
+		mask	= (nr == BITS_PER_LONG ? ~0UL : (1UL << nr) - 1) <<
+			  (first % BITS_PER_LONG);
+
+		if (set)
+			__sync_fetch_and_or(word, mask);
+		else
+			__sync_fetch_and_and(word, ~mask);
+
+		first += nr;
+	}
+}
+
+/*
+ * Returns 0 with disk->extents left NULL if the file isn't sparse, or can't
+ * tell where its holes are.
+ */
+int disk_extent__setup(struct disk_image *disk)
+{
+	struct disk_extent_map *map;
+	off_t data, hole;
+	struct stat st;
+
+	if (fstat(disk->fd, &st) < 0 || !S_ISREG(st.st_mode) || !disk->size)
+		return 0;
+
+	data = lseek(disk->fd, 0, SEEK_DATA);
+	if (data < 0 && errno != ENXIO)
+		return 0;
+	if (data == 0 && lseek(disk->fd, 0, SEEK_HOLE) >= (off_t)disk->size)
+		return 0;
+
+	map = calloc(1, sizeof(*map));
+	if (!map)
+		return -ENOMEM;
+
+	map->shift = DISK_EXTENT_MIN_SHIFT;
+	while (DIV_ROUND_UP(disk->size, 1ULL << map->shift) > DISK_EXTENT_MAX_CHUNKS)
+		map->shift++;
+	map->nr_chunks = DIV_ROUND_UP(disk->size, 1ULL << map->shift);
+
+	map->data = calloc(BITS_TO_LONGS(map->nr_chunks), sizeof(unsigned long));
+	if (!map->data) {
+		free(map);
+		return -ENOMEM;
+	}
+
+	while (data >= 0 && (u64)data < disk->size) {
+		hole = lseek(disk->fd, data, SEEK_HOLE);
+		if (hole < 0 || (u64)hole > disk->size)
+			hole = disk->size;
+
+		disk_extent__update(map, data >> map->shift,
+				    (hole - 1) >> map->shift, true);
+
+		data = lseek(disk->fd, hole, SEEK_DATA);
+	}
+
+	if (data < 0 && errno != ENXIO) {
+		/* The holes we know of can't be trusted anymore */
+		pr_warning("SEEK_DATA failed, not tracking the holes of the disk");
+		free(map->data);
+		free(map);
+		return 0;
+	}
+
+	disk->extents = map;
+
+	return 0;
+}
+
+void disk_extent__destroy(struct disk_image *disk)
+{
+	struct disk_extent_map *map = disk->extents;
+
+	if (!map)
+		return;
+
+	free(map->data);
+	free(map);
+	disk->extents = NULL;
+}
+
+/* True if no byte of the range can hold data */
+bool disk_extent__is_hole(struct disk_image *disk, u64 offset, u64 len)
+{
+	struct disk_extent_map *map = disk->extents;
+	u64 chunk, last;
+
+	if (!len || offset + len > disk->size)
+		return false;
+
+	last = (offset + len - 1) >> map->shift;
+	for (chunk = offset >> map->shift; chunk <= last; chunk++) {
+		if (__atomic_load_n(&map->data[BIT_WORD(chunk)], __ATOMIC_ACQUIRE) &
+		    (1UL << (chunk % BITS_PER_LONG)))
+			return false;
+	}
+
+	return true;
+}
+
+/* Called before the range is written */
+void disk_extent__mark_data(struct disk_image *disk, u64 offset, u64 len)
+{
+	struct disk_extent_map *map = disk->extents;
+
+	if (!len)
+		return;
+
+	disk_extent__update(map, offset >> map->shift,
+			    min(offset + len - 1, disk->size - 1) >> map->shift,
+			    true);
+}
+
+/* Called once the range reads back as zeroes */
+void disk_extent__mark_zero(struct disk_image *disk, u64 offset, u64 len)
+{
+	struct disk_extent_map *map = disk->extents;
+	u64 chunk_size = 1ULL << map->shift;
+	u64 first, end;
+
+	first	= DIV_ROUND_UP(offset, chunk_size);
+	end	= offset + len;
+	/* The tail of the image counts as a whole chunk */
+	if (end >= disk->size)
+		end = map->nr_chunks;
+	else
+		end >>= map->shift;
+
+	if (first < end)
+		disk_extent__update(map, first, end - 1, false);
+}
+
+/* Serve a read of a hole */
+ssize_t disk_extent__read_hole(const struct iovec *iov, int iovcount)
+{
+	ssize_t total = 0;
+	int i;
+
+	for (i = 0; i < iovcount; i++) {
+		memset(iov[i].iov_base, 0, iov[i].iov_len);
+		total += iov[i].iov_len;
+	}
+
+	return total;
+}
@@ -0,0 +1,570 @@
+#include "kvm/disk-image.h"
+#include "kvm/mutex.h"
+#include "kvm/rwsem.h"
+
+#include <linux/bitops.h>
+#include <linux/byteorder.h>
+#include <linux/err.h>
+#include <linux/falloc.h>
+#include <linux/kernel.h>
+#include <sys/file.h>
+
+/*
+ * Copy-on-write overlay of a raw image. The base image is opened read-only
+ * and guest writes go to an overlay file instead, which keeps them across
+ * runs and lets any number of guests share the same base.
+ *
+ * The overlay file holds a header, a bitmap with one bit per block of the
+ * disk, and a sparse data area laid out like the disk itself. Blocks whose
+ * bit is set are read from the overlay, others from the base. The first write
+ * to a block copies whatever part of it the write doesn't cover from the base.
+ *
+ * The bitmap is kept in memory and written back on flushes, after the data it
+ * describes has reached the overlay, so a crash can at worst lose writes that
+ * the guest never flushed.
+ */
+#define DISK_OVERLAY_MAGIC		"LKVMOVL"
+#define DISK_OVERLAY_VERSION		1
+#define DISK_OVERLAY_BLOCK_SHIFT	16
+#define DISK_OVERLAY_HEADER_SIZE	4096
+/* Granularity at which the bitmap is written back */
+#define DISK_OVERLAY_PAGE_SIZE		4096
+
+/* On disk, little endian */
+struct disk_overlay_header {
+	char				magic[8];
+	u32				version;
+	u32				block_shift;
+	u64				size;
+	u64				bitmap_offset;
+	u64				data_offset;
+};
+
+struct disk_overlay {
+	int				fd;
+	const char			*base_name;
+	u32				block_shift;
+	u64				nr_blocks;
+	u64				bitmap_offset;
+	u64				data_offset;
+	u8				*bitmap;
+	size_t				bitmap_len;
+	/* Pages of the bitmap changed since the last flush */
+	unsigned long			*dirty;
+	u64				nr_pages;
+	bool				bitmap_dirty;
+	/* Serializes block copies, bitmap updates and flushes */
+	struct mutex			lock;
+	/* Taken for writing to commit or discard the overlay */
+	pthread_rwlock_t		rwsem;
+	/* One block, for copies */
+	void				*buf;
+};
+
+static bool disk_overlay__present(struct disk_overlay *ovl, u64 block)
+{
+	return __atomic_load_n(&ovl->bitmap[block / 8], __ATOMIC_ACQUIRE) &
+	       (1 << (block % 8));
+}
+
+/* Called with ovl->lock held */
+static void disk_overlay__set(struct disk_overlay *ovl, u64 first, u64 last)
+{
+	u64 block;
+
+	for (block = first; block <= last; block++) {
+		__atomic_fetch_or(&ovl->bitmap[block / 8], 1 << (block % 8),
+				  __ATOMIC_RELEASE);
+		set_bit(block / 8 / DISK_OVERLAY_PAGE_SIZE, ovl->dirty);
+	}
+	ovl->bitmap_dirty = true;
+}
+
+/* Called with ovl->lock held */
+static int disk_overlay__write_bitmap(struct disk_overlay *ovl)
+{
+	size_t offset, len;
+	u64 page;
+
+	for (page = 0; page < ovl->nr_pages; page++) {
+		if (!test_bit(page, ovl->dirty))
+			continue;
+
+		offset	= page * DISK_OVERLAY_PAGE_SIZE;
+		len	= min_t(size_t, ovl->bitmap_len - offset,
+				DISK_OVERLAY_PAGE_SIZE);
+		if (pwrite_in_full(ovl->fd, ovl->bitmap + offset, len,
+				   ovl->bitmap_offset + offset) < 0)
+			return -errno;
+
+		clear_bit(page, ovl->dirty);
+	}
+	ovl->bitmap_dirty = false;
+
+	return 0;
+}
+
+/* Copy a block from the base to the overlay. Called with ovl->lock held. */
+static int disk_overlay__copy_up(struct disk_image *disk, u64 block)
+{
+	struct disk_overlay *ovl = disk->overlay;
+	u64 start = block << ovl->block_shift;
+	size_t len;
+
+	len = min_t(u64, disk->size - start, 1ULL << ovl->block_shift);
+	if (pread_in_full(disk->fd, ovl->buf, len, start) < 0 ||
+	    pwrite_in_full(ovl->fd, ovl->buf, len, ovl->data_offset + start) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* The part of @iov that starts @skip bytes in, and is @len bytes long */
+static int disk_overlay__slice(const struct iovec *iov, int iovcount, u64 skip,
+			       u64 len, struct iovec *slice)
+{
+	int n = 0;
+
+	for (; iovcount && len; iov++, iovcount--) {
+		if (skip >= iov->iov_len) {
+			skip -= iov->iov_len;
+			continue;
+		}
+
+		slice[n].iov_base	= iov->iov_base + skip;
+		slice[n].iov_len	= min_t(u64, iov->iov_len - skip, len);
+		len -= slice[n++].iov_len;
+		skip = 0;
+	}
+
+	return n;
+}
+
+static ssize_t disk_overlay__read(struct disk_image *disk, u64 sector,
+				  const struct iovec *iov, int iovcount,
+				  void *param)
+{
+	struct disk_overlay *ovl = disk->overlay;
+	u64 block_size = 1ULL << ovl->block_shift;
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 len = 0, pos, end;
+	struct iovec *slice;
+	ssize_t ret;
+	bool in;
+	int i, n;
+
+	for (i = 0; i < iovcount; i++)
+		len += iov[i].iov_len;
+
+	slice = malloc(iovcount * sizeof(*slice));
+	if (!slice)
+		return -ENOMEM;
+
+	down_read(&ovl->rwsem);
+
+	/* Read runs of blocks that come from the same file in one go */
+	for (pos = 0; pos < len; pos = end) {
+		in	= disk_overlay__present(ovl, (offset + pos) >> ovl->block_shift);
+		end	= min(len, ALIGN(offset + pos + 1, block_size) - offset);
+		while (end < len &&
+		       disk_overlay__present(ovl, (offset + end) >> ovl->block_shift) == in)
+			end = min(len, end + block_size);
+
+		n = disk_overlay__slice(iov, iovcount, pos, end - pos, slice);
+		if (in)
+			ret = preadv_in_full(ovl->fd, slice, n,
+					     ovl->data_offset + offset + pos);
+		else
+			ret = preadv_in_full(disk->fd, slice, n, offset + pos);
+		if (ret < 0) {
+			ret = -errno;
+			goto out;
+		}
+	}
+
+	ret = len;
+out:
+	up_read(&ovl->rwsem);
+	free(slice);
+
+	return ret;
+}
+
+static ssize_t disk_overlay__write(struct disk_image *disk, u64 sector,
+				   const struct iovec *iov, int iovcount,
+				   void *param)
+{
+	struct disk_overlay *ovl = disk->overlay;
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 len = 0, first, last, block, start, end;
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < iovcount; i++)
+		len += iov[i].iov_len;
+	if (!len)
+		return 0;
+
+	first	= offset >> ovl->block_shift;
+	last	= (offset + len - 1) >> ovl->block_shift;
+
+	down_read(&ovl->rwsem);
+
+	for (block = first; block <= last; block++) {
+		if (!disk_overlay__present(ovl, block))
+			break;
+	}
+	if (block > last) {
+		ret = pwritev_in_full(ovl->fd, iov, iovcount,
+				      ovl->data_offset + offset);
+		if (ret < 0)
+			ret = -errno;
+		up_read(&ovl->rwsem);
+		return ret;
+	}
+
+	mutex_lock(&ovl->lock);
+
+	/* Only the first and last blocks can be partly written */
+	for (block = first; block <= last; block = max(block + 1, last)) {
+		start	= block << ovl->block_shift;
+		end	= min(start + (1ULL << ovl->block_shift), disk->size);
+		if (disk_overlay__present(ovl, block) ||
+		    (offset <= start && offset + len >= end))
+			continue;
+
+		ret = disk_overlay__copy_up(disk, block);
+		if (ret < 0)
+			goto out;
+	}
+
+	ret = pwritev_in_full(ovl->fd, iov, iovcount, ovl->data_offset + offset);
+	if (ret < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	disk_overlay__set(ovl, first, last);
+out:
+	mutex_unlock(&ovl->lock);
+	up_read(&ovl->rwsem);
+
+	return ret;
+}
+
+static int disk_overlay__flush(struct disk_image *disk)
+{
+	struct disk_overlay *ovl = disk->overlay;
+	int r = 0;
+
+	mutex_lock(&ovl->lock);
+
+	if (fdatasync(ovl->fd) < 0) {
+		r = -errno;
+		goto out;
+	}
+
+	if (!ovl->bitmap_dirty)
+		goto out;
+
+	r = disk_overlay__write_bitmap(ovl);
+	if (!r && fdatasync(ovl->fd) < 0)
+		r = -errno;
+out:
+	mutex_unlock(&ovl->lock);
+
+	return r;
+}
+
+static struct disk_image_operations disk_overlay_ops = {
+	.read		= disk_overlay__read,
+	.write		= disk_overlay__write,
+	.flush		= disk_overlay__flush,
+};
+
+/* Empty the overlay. Called with ovl->rwsem held for writing. */
+static int disk_overlay__reset(struct disk_overlay *ovl)
+{
+	int r;
+
+	mutex_lock(&ovl->lock);
+
+	memset(ovl->bitmap, 0, ovl->bitmap_len);
+	memset(ovl->dirty, 0xff, BITS_TO_LONGS(ovl->nr_pages) * sizeof(long));
+	r = disk_overlay__write_bitmap(ovl);
+	if (!r && fdatasync(ovl->fd) < 0)
+		r = -errno;
+
+	mutex_unlock(&ovl->lock);
+
+	if (r)
+		return r;
+
+	/* Only reclaims space, the bitmap says the data is gone already */
+	if (fallocate(ovl->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      ovl->data_offset, ovl->nr_blocks << ovl->block_shift) < 0)
+		pr_warning("Failed to free the space of overlay of '%s'",
+			   ovl->base_name);
+
+	return 0;
+}
+
+/*
+ * Write the blocks of the overlay to the base image and empty the overlay.
+ * Guest I/O to the disk waits meanwhile.
+ */
+int disk_overlay__commit(struct disk_image *disk)
+{
+	struct disk_overlay *ovl = disk->overlay;
+	u64 block, start;
+	size_t len;
+	int fd, r = 0;
+
+	if (!ovl)
+		return -EINVAL;
+
+	down_write(&ovl->rwsem);
+
+	fd = open(ovl->base_name, O_WRONLY);
+	if (fd < 0) {
+		r = -errno;
+		goto out;
+	}
+
+	for (block = 0; block < ovl->nr_blocks; block++) {
+		if (!disk_overlay__present(ovl, block))
+			continue;
+
+		start	= block << ovl->block_shift;
+		len	= min_t(u64, disk->size - start,
+				1ULL << ovl->block_shift);
+		if (pread_in_full(ovl->fd, ovl->buf, len,
+				  ovl->data_offset + start) < 0 ||
+		    pwrite_in_full(fd, ovl->buf, len, start) < 0) {
+			r = -errno;
+			goto out_close;
+		}
+	}
+
+	if (fdatasync(fd) < 0) {
+		r = -errno;
+		goto out_close;
+	}
+
+	r = disk_overlay__reset(ovl);
+out_close:
+	close(fd);
+out:
+	up_write(&ovl->rwsem);
+
+	return r;
+}
+
+/* Drop the blocks of the overlay, the disk reverts to the base image */
+int disk_overlay__discard(struct disk_image *disk)
+{
+	struct disk_overlay *ovl = disk->overlay;
+	int r;
+
+	if (!ovl)
+		return -EINVAL;
+
+	down_write(&ovl->rwsem);
+	r = disk_overlay__reset(ovl);
+	up_write(&ovl->rwsem);
+
+	return r;
+}
+
+static int disk_overlay__create(struct disk_overlay *ovl, u64 size)
+{
+	struct disk_overlay_header hdr = {
+		.magic		= DISK_OVERLAY_MAGIC,
+		.version	= cpu_to_le32(DISK_OVERLAY_VERSION),
+		.block_shift	= cpu_to_le32(ovl->block_shift),
+		.size		= cpu_to_le64(size),
+		.bitmap_offset	= cpu_to_le64(ovl->bitmap_offset),
+		.data_offset	= cpu_to_le64(ovl->data_offset),
+	};
+
+	if (ftruncate(ovl->fd, ovl->data_offset + size) < 0 ||
+	    pwrite_in_full(ovl->fd, &hdr, sizeof(hdr), 0) < 0 ||
+	    fsync(ovl->fd) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int disk_overlay__load(struct disk_overlay *ovl, u64 size)
+{
+	struct disk_overlay_header hdr;
+
+	if (pread_in_full(ovl->fd, &hdr, sizeof(hdr), 0) < 0)
+		return -errno;
+
+	if (memcmp(hdr.magic, DISK_OVERLAY_MAGIC, sizeof(hdr.magic)) ||
+	    le32_to_cpu(hdr.version) != DISK_OVERLAY_VERSION ||
+	    le32_to_cpu(hdr.block_shift) != ovl->block_shift ||
+	    le64_to_cpu(hdr.bitmap_offset) != ovl->bitmap_offset ||
+	    le64_to_cpu(hdr.data_offset) != ovl->data_offset) {
+		pr_err("'%s' isn't an overlay made by this version of lkvm",
+		       ovl->base_name);
+		return -EINVAL;
+	}
+
+	if (le64_to_cpu(hdr.size) != size) {
+		pr_err("The overlay of '%s' was made for a base image of %llu bytes",
+		       ovl->base_name, (unsigned long long)le64_to_cpu(hdr.size));
+		return -EINVAL;
+	}
+
+	if (pread_in_full(ovl->fd, ovl->bitmap, ovl->bitmap_len,
+			  ovl->bitmap_offset) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static struct disk_overlay *disk_overlay__setup(const char *base_name,
+						const char *filename, u64 size)
+{
+	struct disk_overlay *ovl;
+	struct stat st;
+	int r;
+
+	ovl = calloc(1, sizeof(*ovl));
+	if (!ovl)
+		return ERR_PTR(-ENOMEM);
+
+	ovl->base_name		= base_name;
+	ovl->block_shift	= DISK_OVERLAY_BLOCK_SHIFT;
+	ovl->nr_blocks		= DIV_ROUND_UP(size, 1ULL << ovl->block_shift);
+	ovl->bitmap_len		= DIV_ROUND_UP(ovl->nr_blocks, 8);
+	ovl->bitmap_offset	= DISK_OVERLAY_HEADER_SIZE;
+	ovl->data_offset	= ALIGN(ovl->bitmap_offset + ovl->bitmap_len,
+					1ULL << ovl->block_shift);
+	ovl->nr_pages		= DIV_ROUND_UP(ovl->bitmap_len,
+					       DISK_OVERLAY_PAGE_SIZE);
+	mutex_init(&ovl->lock);
+	pthread_rwlock_init(&ovl->rwsem, NULL);
+
+	ovl->bitmap	= calloc(1, ovl->bitmap_len);
+	ovl->dirty	= calloc(BITS_TO_LONGS(ovl->nr_pages), sizeof(long));
+	ovl->buf	= malloc(1ULL << ovl->block_shift);
+	if (!ovl->bitmap || !ovl->dirty || !ovl->buf) {
+		r = -ENOMEM;
+		goto err_free;
+	}
+
+	ovl->fd = open(filename, O_RDWR | O_CREAT, 0600);
+	if (ovl->fd < 0) {
+		r = -errno;
+		goto err_free;
+	}
+
+	/* Two guests writing to the same overlay would corrupt it */
+	if (flock(ovl->fd, LOCK_EX | LOCK_NB) < 0) {
+		pr_err("Overlay '%s' is in use", filename);
+		r = -EBUSY;
+		goto err_close;
+	}
+
+	if (fstat(ovl->fd, &st) < 0) {
+		r = -errno;
+		goto err_close;
+	}
+
+	if (st.st_size)
+		r = disk_overlay__load(ovl, size);
+	else
+		r = disk_overlay__create(ovl, size);
+	if (r)
+		goto err_close;
+
+	return ovl;
+
+err_close:
+	close(ovl->fd);
+err_free:
+	free(ovl->buf);
+	free(ovl->dirty);
+	free(ovl->bitmap);
+	free(ovl);
+	return ERR_PTR(r);
+}
+
+static void disk_overlay__free(struct disk_overlay *ovl)
+{
+	close(ovl->fd);
+	free(ovl->buf);
+	free(ovl->dirty);
+	free(ovl->bitmap);
+	free(ovl);
+}
+
+/* Open the image of @params read-only, with its writes going to the overlay */
+struct disk_image *disk_overlay__open(struct disk_image_params *params)
+{
+	struct disk_overlay *ovl;
+	struct disk_image *disk;
+	struct stat st;
+	u64 size;
+	int fd, r;
+
+	if (params->direct) {
+		pr_err("Overlays can't be used with direct I/O");
+		return ERR_PTR(-EINVAL);
+	}
+
+	fd = open(params->filename, O_RDONLY);
+	if (fd < 0)
+		return ERR_PTR(-errno);
+
+	if (fstat(fd, &st) < 0) {
+		r = -errno;
+		goto err_close;
+	}
+
+	size = st.st_size;
+	if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &size) < 0) {
+		r = -errno;
+		goto err_close;
+	}
+
+	ovl = disk_overlay__setup(params->filename, params->overlay, size);
+	if (IS_ERR(ovl)) {
+		r = PTR_ERR(ovl);
+		goto err_close;
+	}
+
+	disk = disk_image__new(fd, size, &disk_overlay_ops, DISK_IMAGE_REGULAR);
+	if (IS_ERR(disk)) {
+		disk_overlay__free(ovl);
+		r = PTR_ERR(disk);
+		goto err_close;
+	}
+
+	disk->overlay	= ovl;
+	disk->readonly	= params->readonly;
+
+	return disk;
+
+err_close:
+	close(fd);
+	return ERR_PTR(r);
+}
+
+/* Write the bitmap back, so that nothing written before exit is lost */
+void disk_overlay__destroy(struct disk_image *disk)
+{
+	struct disk_overlay *ovl = disk->overlay;
+
+	if (!ovl)
+		return;
+
+	if (disk_overlay__flush(disk) < 0)
+		pr_warning("Failed to flush the overlay of '%s'", ovl->base_name);
+
+	disk_overlay__free(ovl);
+	disk->overlay = NULL;
+}
@@ -1,8 +1,10 @@
 #include "kvm/qcow.h"
 
 #include "kvm/disk-image.h"
+#include "kvm/iovec.h"
 #include "kvm/read-write.h"
 #include "kvm/mutex.h"
+#include "kvm/rwsem.h"
 #include "kvm/util.h"
 
 #include <sys/types.h>
@@ -13,6 +15,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdio.h>
 #ifdef CONFIG_HAS_ZLIB
 #include <zlib.h>
 #endif
@@ -26,6 +30,11 @@ static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append);
 static int qcow_write_refcount_table(struct qcow *q);
 static u64 qcow_alloc_clusters(struct qcow *q, u64 size, int update_ref);
 static void  qcow_free_clusters(struct qcow *q, u64 clust_start, u64 size);
+static int qcow_writeback(struct qcow *q);
+static int qcow_writeback_if_needed(struct qcow *q);
+static u64 qcow_alloc_data_cluster(struct qcow *q);
+static int get_cluster_table(struct qcow *q, u64 offset,
+	struct qcow_l2_table **result_l2t, u64 *result_l2_index);
 
 static inline int qcow_pwrite_sync(int fd,
 	void *buf, size_t count, off_t offset)
@@ -36,75 +45,70 @@ static inline int qcow_pwrite_sync(int fd,
 	return fdatasync(fd);
 }
 
-static int l2_table_insert(struct rb_root *root, struct qcow_l2_table *new)
+/*
+ * Metadata tables are cached in a hash table keyed by their offset in the
+ * image, and evicted in LRU order once the cache holds q->cache_nodes tables.
+ */
+static inline u32 qcow_cache_hash(struct qcow *q, u64 offset)
 {
-	struct rb_node **link = &(root->rb_node), *parent = NULL;
-	u64 offset = new->offset;
+	return ((offset >> q->header->cluster_bits) * 0x9E3779B97F4A7C15ULL)
+		>> (64 - q->cache_hash_bits);
+}
 
-	/* search the tree */
-	while (*link) {
-		struct qcow_l2_table *t;
+static int qcow_cache_init(struct qcow *q, int nr_nodes)
+{
+	struct qcow_refcount_table *rft = &q->refcount_table;
+	struct qcow_l1_table *l1t = &q->table;
+	u32 nr_buckets;
 
-		t = rb_entry(*link, struct qcow_l2_table, node);
-		if (!t)
-			goto error;
+	q->cache_nodes = nr_nodes > 0 ? nr_nodes : QCOW_DEFAULT_CACHE_NODES;
 
-		parent = *link;
+	q->cache_hash_bits = 1;
+	while ((1U << q->cache_hash_bits) < (u32)q->cache_nodes)
+		q->cache_hash_bits++;
+	nr_buckets = 1U << q->cache_hash_bits;
 
-		if (t->offset > offset)
-			link = &(*link)->rb_left;
-		else if (t->offset < offset)
-			link = &(*link)->rb_right;
-		else
-			goto out;
-	}
+	/* Freed by the caller on failure */
+	l1t->hash = calloc(nr_buckets, sizeof(struct hlist_head));
+	rft->hash = calloc(nr_buckets, sizeof(struct hlist_head));
+	if (!l1t->hash || !rft->hash)
+		return -1;
+
+	INIT_LIST_HEAD(&l1t->lru_list);
+	INIT_LIST_HEAD(&rft->lru_list);
 
-	/* add new node */
-	rb_link_node(&new->node, parent, link);
-	rb_insert_color(&new->node, root);
-out:
 	return 0;
-error:
-	return -1;
 }
 
-static struct qcow_l2_table *l2_table_lookup(struct rb_root *root, u64 offset)
+static struct qcow_l2_table *l2_table_lookup(struct qcow *q, u64 offset)
 {
-	struct rb_node *link = root->rb_node;
-
-	while (link) {
-		struct qcow_l2_table *t;
-
-		t = rb_entry(link, struct qcow_l2_table, node);
-		if (!t)
-			goto out;
+	struct hlist_head *head = &q->table.hash[qcow_cache_hash(q, offset)];
+	struct qcow_l2_table *t;
 
-		if (t->offset > offset)
-			link = link->rb_left;
-		else if (t->offset < offset)
-			link = link->rb_right;
-		else
+	hlist_for_each_entry(t, head, node) {
+		if (t->offset == offset)
 			return t;
 	}
-out:
+
 	return NULL;
 }
 
 static void l1_table_free_cache(struct qcow_l1_table *l1t)
 {
-	struct rb_root *r = &l1t->root;
 	struct list_head *pos, *n;
 	struct qcow_l2_table *t;
 
 	list_for_each_safe(pos, n, &l1t->lru_list) {
-		/* Remove cache table from the list and RB tree */
+		/* Remove cache table from the list and hash table */
 		list_del(pos);
 		t = list_entry(pos, struct qcow_l2_table, list);
-		rb_erase(&t->node, r);
+		hlist_del(&t->node);
 
 		/* Free the cached node */
 		free(t);
 	}
+
+	free(l1t->hash);
 }
 
 static int qcow_l2_cache_write(struct qcow *q, struct qcow_l2_table *c)
@@ -117,48 +121,59 @@ static int qcow_l2_cache_write(struct qcow *q, struct qcow_l2_table *c)
 
 	size = 1 << header->l2_bits;
 
-	if (qcow_pwrite_sync(q->fd, c->table,
-		size * sizeof(u64), c->offset) < 0)
+	if (pwrite_in_full(q->fd, c->table, size * sizeof(u64), c->offset) < 0)
 		return -1;
 
 	c->dirty = 0;
+	q->nr_dirty--;
 
 	return 0;
 }
 
+/* Modified tables are written back by qcow_writeback() */
+static void qcow_l2_set_dirty(struct qcow *q, struct qcow_l2_table *c)
+{
+	if (c->dirty)
+		return;
+
+	c->dirty = 1;
+	q->nr_dirty++;
+}
+
 static int cache_table(struct qcow *q, struct qcow_l2_table *c)
 {
 	struct qcow_l1_table *l1t = &q->table;
-	struct rb_root *r = &l1t->root;
 	struct qcow_l2_table *lru;
 
-	if (l1t->nr_cached == MAX_CACHE_NODES) {
+	if (l1t->nr_cached >= q->cache_nodes) {
 		/*
-		 * The node at the head of the list is least recently used
-		 * node. Remove it from the list and replaced with a new node.
+		 * The nodes at the head of the list are least recently used.
+		 * Replace the first clean one with the new node: dirty tables
+		 * stay cached until the next writeback.
 		 */
-		lru = list_first_entry(&l1t->lru_list, struct qcow_l2_table, list);
-
-		/* Remove the node from the cache */
-		rb_erase(&lru->node, r);
-		list_del_init(&lru->list);
-		l1t->nr_cached--;
-
-		/* Free the LRUed node */
-		free(lru);
+		list_for_each_entry(lru, &l1t->lru_list, list) {
+			if (lru->dirty)
+				continue;
+
+			/* Remove the node from the cache */
+			hlist_del(&lru->node);
+			list_del_init(&lru->list);
+			l1t->nr_cached--;
+
+			/* Free the LRUed node */
+			free(lru);
+			break;
+		}
 	}
 
-	/* Add new node in RB Tree: Helps in searching faster */
-	if (l2_table_insert(r, c) < 0)
-		goto error;
+	/* Add new node in the hash table: Helps in searching faster */
+	hlist_add_head(&c->node, &l1t->hash[qcow_cache_hash(q, c->offset)]);
 
 	/* Add in LRU replacement list */
 	list_add_tail(&c->list, &l1t->lru_list);
 	l1t->nr_cached++;
 
 	return 0;
-error:
-	return -1;
 }
 
 static struct qcow_l2_table *l2_table_search(struct qcow *q, u64 offset)
@@ -166,7 +181,7 @@ static struct qcow_l2_table *l2_table_search(struct qcow *q, u64 offset)
 	struct qcow_l1_table *l1t = &q->table;
 	struct qcow_l2_table *l2t;
 
-	l2t = l2_table_lookup(&l1t->root, offset);
+	l2t = l2_table_lookup(q, offset);
 	if (!l2t)
 		return NULL;
 
@@ -191,7 +206,7 @@ static struct qcow_l2_table *new_cache_table(struct qcow *q, u64 offset)
 		goto out;
 
 	c->offset = offset;
-	RB_CLEAR_NODE(&c->node);
+	INIT_HLIST_NODE(&c->node);
 	INIT_LIST_HEAD(&c->list);
 out:
 	return c;
@@ -218,6 +233,10 @@ static inline u64 get_cluster_offset(struct qcow *q, u64 offset)
 	return offset & ((1 << header->cluster_bits)-1);
 }
 
+/*
+ * Return the cached L2 table at @offset, reading it from the image if needed.
+ * Called with q->lock held for writing, so nothing else uses the cache.
+ */
 static struct qcow_l2_table *qcow_read_l2_table(struct qcow *q, u64 offset)
 {
 	struct qcow_header *header = q->header;
@@ -250,6 +269,51 @@ error:
 	return NULL;
 }
 
+/*
+ * Read entry @l2_idx of the L2 table at @l2t_offset. This is the lookup used by
+ * readers, which only hold q->lock for reading: the cache itself is protected
+ * by q->cache_lock, and tables missing from it are read with that lock dropped
+ * so that a miss doesn't stall the hits of other threads.
+ */
+static int qcow_read_l2_entry(struct qcow *q, u64 l2t_offset, u64 l2_idx,
+			      u64 *entry)
+{
+	struct qcow_header *header = q->header;
+	struct qcow_l2_table *l2t, *new;
+
+	mutex_lock(&q->cache_lock);
+	l2t = l2_table_search(q, l2t_offset);
+	if (l2t)
+		goto found;
+	mutex_unlock(&q->cache_lock);
+
+	new = new_cache_table(q, l2t_offset);
+	if (!new)
+		return -1;
+
+	if (pread_in_full(q->fd, new->table,
+			  (1 << header->l2_bits) * sizeof(u64), l2t_offset) < 0) {
+		free(new);
+		return -1;
+	}
+
+	mutex_lock(&q->cache_lock);
+	/* Another reader may have cached the same table in the meantime */
+	l2t = l2_table_search(q, l2t_offset);
+	if (l2t) {
+		free(new);
+	} else {
+		cache_table(q, new);
+		l2t = new;
+	}
+
+found:
+	*entry = be64_to_cpu(l2t->table[l2_idx]);
+	mutex_unlock(&q->cache_lock);
+
+	return 0;
+}
+
 static int qcow_decompress_buffer(u8 *out_buf, int out_buf_size,
 	const u8 *buf, int buf_size)
 {
@@ -283,12 +347,169 @@ static int qcow_decompress_buffer(u8 *out_buf, int out_buf_size,
 #endif
 }
 
+/*
+ * Decompressed clusters are cached by the offset of their compressed data, so
+ * that reading a compressed cluster piecewise inflates it only once.
+ */
+static inline u32 qcow_zcache_hash(u64 offset)
+{
+	return (offset * 0x9E3779B97F4A7C15ULL) >> (64 - QCOW_ZCACHE_HASH_BITS);
+}
+
+static void qcow_zcache_init(struct qcow *q)
+{
+	mutex_init(&q->zcache.lock);
+	INIT_LIST_HEAD(&q->zcache.lru_list);
+}
+
+/* Called with zcache.lock held */
+static struct qcow_zcluster *qcow_zcache_lookup(struct qcow_zcache *zc,
+						u64 offset)
+{
+	struct qcow_zcluster *z;
+
+	hlist_for_each_entry(z, &zc->hash[qcow_zcache_hash(offset)], node) {
+		if (z->offset == offset)
+			return z;
+	}
+
+	return NULL;
+}
+
+/* Called with zcache.lock held */
+static void qcow_zcache_remove(struct qcow_zcache *zc, struct qcow_zcluster *z)
+{
+	hlist_del(&z->node);
+	list_del(&z->list);
+	zc->nr_cached--;
+	free(z);
+}
+
+/* Forget the compressed cluster at @offset, once it is freed */
+static void qcow_zcache_drop(struct qcow *q, u64 offset)
+{
+	struct qcow_zcache *zc = &q->zcache;
+	struct qcow_zcluster *z;
+
+	mutex_lock(&zc->lock);
+	z = qcow_zcache_lookup(zc, offset);
+	if (z)
+		qcow_zcache_remove(zc, z);
+	mutex_unlock(&zc->lock);
+}
+
+static void qcow_zcache_free(struct qcow *q)
+{
+	struct qcow_zcache *zc = &q->zcache;
+	struct qcow_zcluster *z, *n;
+
+	list_for_each_entry_safe(z, n, &zc->lru_list, list)
+		qcow_zcache_remove(zc, z);
+}
+
+/*
+ * Copy @len bytes at @clust_offset of the compressed cluster whose data
+ * starts at @offset. On a cache miss, @size bytes are read at @pos and
+ * inflated from @skip onwards. Decompression runs without any lock held, so
+ * that readers of different clusters, on different I/O threads, inflate them
+ * in parallel. Two readers of the same cluster may both inflate it, the first
+ * one to finish caches it.
+ */
+static int qcow_read_compressed(struct qcow *q, u64 offset, u64 pos, u32 size,
+				u32 skip, void *dst, u64 clust_offset, u32 len)
+{
+	struct qcow_zcache *zc = &q->zcache;
+	struct qcow_zcluster *z;
+	void *cdata = NULL;
+
+	mutex_lock(&zc->lock);
+	z = qcow_zcache_lookup(zc, offset);
+	if (z) {
+		list_move_tail(&z->list, &zc->lru_list);
+		memcpy(dst, z->data + clust_offset, len);
+		mutex_unlock(&zc->lock);
+		return 0;
+	}
+	mutex_unlock(&zc->lock);
+
+	z = malloc(sizeof(*z) + q->cluster_size);
+	cdata = malloc(size);
+	if (!z || !cdata)
+		goto error;
+
+	if (pread_in_full(q->fd, cdata, size, pos) < 0)
+		goto error;
+
+	if (qcow_decompress_buffer(z->data, q->cluster_size, cdata + skip,
+				   size - skip) < 0)
+		goto error;
+
+	free(cdata);
+
+	memcpy(dst, z->data + clust_offset, len);
+	z->offset = offset;
+
+	mutex_lock(&zc->lock);
+	if (qcow_zcache_lookup(zc, offset)) {
+		mutex_unlock(&zc->lock);
+		free(z);
+		return 0;
+	}
+
+	if (zc->nr_cached >= QCOW_ZCACHE_CLUSTERS)
+		qcow_zcache_remove(zc, list_first_entry(&zc->lru_list,
+				   struct qcow_zcluster, list));
+
+	hlist_add_head(&z->node, &zc->hash[qcow_zcache_hash(offset)]);
+	list_add_tail(&z->list, &zc->lru_list);
+	zc->nr_cached++;
+	mutex_unlock(&zc->lock);
+
+	return 0;
+
+error:
+	free(cdata);
+	free(z);
+	return -1;
+}
+
+/*
+ * Read what lies under an unallocated cluster: the backing image if there is
+ * one, zeroes past its end or without it.
+ */
+static ssize_t qcow_read_backing(struct qcow *q, u64 offset, void *dst,
+				 u32 dst_len)
+{
+	struct disk_image *backing = q->backing;
+	struct iovec iov;
+	u64 len = 0;
+
+	if (backing && offset < backing->size) {
+		len = min_t(u64, dst_len, backing->size - offset);
+		iov = (struct iovec) {
+			.iov_base	= dst,
+			.iov_len	= len,
+		};
+
+		if (backing->ops->read(backing, offset >> SECTOR_SHIFT,
+				       &iov, 1, NULL) != (ssize_t)len)
+			return -1;
+	}
+
+	memset(dst + len, 0, dst_len - len);
+
+	return dst_len;
+}
+
+/*
+ * The cluster readers below are called with q->lock held, for reading or for
+ * writing.
+ */
 static ssize_t qcow1_read_cluster(struct qcow *q, u64 offset,
 	void *dst, u32 dst_len)
 {
 	struct qcow_header *header = q->header;
 	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_l2_table *l2t;
 	u64 clust_offset;
 	u64 clust_start;
 	u64 l2t_offset;
@@ -296,7 +517,7 @@ static ssize_t qcow1_read_cluster(struct qcow *q, u64 offset,
 	u64 l2t_size;
 	u64 l1_idx;
 	u64 l2_idx;
-	int coffset;
+	u64 coffset;
 	int csize;
 
 	l1_idx = get_l1_index(q, offset);
@@ -311,45 +532,32 @@ static ssize_t qcow1_read_cluster(struct qcow *q, u64 offset,
 	if (length > dst_len)
 		length = dst_len;
 
-	mutex_lock(&q->mutex);
-
 	l2t_offset = be64_to_cpu(l1t->l1_table[l1_idx]);
 	if (!l2t_offset)
 		goto zero_cluster;
 
 	l2t_size = 1 << header->l2_bits;
 
-	/* read and cache level 2 table */
-	l2t = qcow_read_l2_table(q, l2t_offset);
-	if (!l2t)
-		goto out_error;
-
 	l2_idx = get_l2_index(q, offset);
 	if (l2_idx >= l2t_size)
-		goto out_error;
+		return -1;
+
+	/* read and cache level 2 table */
+	if (qcow_read_l2_entry(q, l2t_offset, l2_idx, &clust_start) < 0)
+		return -1;
 
-	clust_start = be64_to_cpu(l2t->table[l2_idx]);
 	if (clust_start & QCOW1_OFLAG_COMPRESSED) {
 		coffset	= clust_start & q->cluster_offset_mask;
 		csize	= clust_start >> (63 - q->header->cluster_bits);
 		csize	&= (q->cluster_size - 1);
 
-		if (pread_in_full(q->fd, q->cluster_data, csize,
-				  coffset) < 0)
-			goto out_error;
-
-		if (qcow_decompress_buffer(q->cluster_cache, q->cluster_size,
-					q->cluster_data, csize) < 0)
-			goto out_error;
-
-		memcpy(dst, q->cluster_cache + clust_offset, length);
-		mutex_unlock(&q->mutex);
+		if (qcow_read_compressed(q, coffset, coffset, csize, 0,
+					 dst, clust_offset, length) < 0)
+			return -1;
 	} else {
 		if (!clust_start)
 			goto zero_cluster;
 
-		mutex_unlock(&q->mutex);
-
 		if (pread_in_full(q->fd, dst, length,
 				  clust_start + clust_offset) < 0)
 			return -1;
@@ -358,22 +566,15 @@ static ssize_t qcow1_read_cluster(struct qcow *q, u64 offset,
 	return length;
 
 zero_cluster:
-	mutex_unlock(&q->mutex);
-	memset(dst, 0, length);
-	return length;
-
-out_error:
-	mutex_unlock(&q->mutex);
-	length = -1;
-	return -1;
+	return qcow_read_backing(q, offset, dst, length);
 }
 
+/* @from_backing, if not NULL, tells whether the data came from the backing image */
 static ssize_t qcow2_read_cluster(struct qcow *q, u64 offset,
-	void *dst, u32 dst_len)
+	void *dst, u32 dst_len, bool *from_backing)
 {
 	struct qcow_header *header = q->header;
 	struct qcow_l1_table *l1t = &q->table;
-	struct qcow_l2_table *l2t;
 	u64 clust_offset;
 	u64 clust_start;
 	u64 l2t_offset;
@@ -381,10 +582,9 @@ static ssize_t qcow2_read_cluster(struct qcow *q, u64 offset,
 	u64 l2t_size;
 	u64 l1_idx;
 	u64 l2_idx;
-	int coffset;
+	u64 coffset;
 	int sector_offset;
 	int nb_csectors;
-	int csize;
 
 	l1_idx = get_l1_index(q, offset);
 	if (l1_idx >= l1t->table_size)
@@ -398,8 +598,6 @@ static ssize_t qcow2_read_cluster(struct qcow *q, u64 offset,
 	if (length > dst_len)
 		length = dst_len;
 
-	mutex_lock(&q->mutex);
-
 	l2t_offset = be64_to_cpu(l1t->l1_table[l1_idx]);
 
 	l2t_offset &= ~QCOW2_OFLAG_COPIED;
@@ -408,44 +606,31 @@ static ssize_t qcow2_read_cluster(struct qcow *q, u64 offset,
 
 	l2t_size = 1 << header->l2_bits;
 
-	/* read and cache level 2 table */
-	l2t = qcow_read_l2_table(q, l2t_offset);
-	if (!l2t)
-		goto out_error;
-
 	l2_idx = get_l2_index(q, offset);
 	if (l2_idx >= l2t_size)
-		goto out_error;
+		return -1;
+
+	/* read and cache level 2 table */
+	if (qcow_read_l2_entry(q, l2t_offset, l2_idx, &clust_start) < 0)
+		return -1;
 
-	clust_start = be64_to_cpu(l2t->table[l2_idx]);
 	if (clust_start & QCOW2_OFLAG_COMPRESSED) {
 		coffset = clust_start & q->cluster_offset_mask;
 		nb_csectors = ((clust_start >> q->csize_shift)
 			& q->csize_mask) + 1;
 		sector_offset = coffset & (SECTOR_SIZE - 1);
-		csize = nb_csectors * SECTOR_SIZE - sector_offset;
-
-		if (pread_in_full(q->fd, q->cluster_data,
-				  nb_csectors * SECTOR_SIZE,
-				  coffset & ~(SECTOR_SIZE - 1)) < 0) {
-			goto out_error;
-		}
 
-		if (qcow_decompress_buffer(q->cluster_cache, q->cluster_size,
-					q->cluster_data + sector_offset,
-					csize) < 0) {
-			goto out_error;
-		}
-
-		memcpy(dst, q->cluster_cache + clust_offset, length);
-		mutex_unlock(&q->mutex);
+		if (qcow_read_compressed(q, coffset,
+					 coffset & ~(SECTOR_SIZE - 1),
+					 nb_csectors * SECTOR_SIZE,
+					 sector_offset, dst, clust_offset,
+					 length) < 0)
+			return -1;
 	} else {
 		clust_start &= QCOW2_OFFSET_MASK;
 		if (!clust_start)
 			goto zero_cluster;
 
-		mutex_unlock(&q->mutex);
-
 		if (pread_in_full(q->fd, dst, length,
 				  clust_start + clust_offset) < 0)
 			return -1;
@@ -454,14 +639,61 @@ static ssize_t qcow2_read_cluster(struct qcow *q, u64 offset,
 	return length;
 
 zero_cluster:
-	mutex_unlock(&q->mutex);
-	memset(dst, 0, length);
-	return length;
+	if (from_backing)
+		*from_backing = q->backing != NULL;
+	return qcow_read_backing(q, offset, dst, length);
+}
 
-out_error:
-	mutex_unlock(&q->mutex);
-	length = -1;
-	return -1;
+/*
+ * Copy the cluster containing @offset from the backing image into the image,
+ * so that the next reads are served locally. This is best effort: on failure
+ * the cluster simply stays in the backing image.
+ *
+ * The data is copied without q->lock, which is only held for writing to
+ * allocate the new cluster and to link it into the L2 table: until then,
+ * nothing else can reach it.
+ */
+static void qcow_copy_on_read(struct qcow *q, u64 offset)
+{
+	struct qcow_l2_table *l2t;
+	u64 clust_start;
+	u64 l2t_idx;
+	void *copy;
+	int r;
+
+	offset &= ~(q->cluster_size - 1);
+
+	copy = malloc(q->cluster_size);
+	if (!copy)
+		return;
+
+	/* The backing image is never written through this one */
+	if (qcow_read_backing(q, offset, copy, q->cluster_size) < 0)
+		goto out;
+
+	down_write(&q->lock);
+	clust_start = qcow_alloc_data_cluster(q);
+	up_write(&q->lock);
+	if (clust_start == (u64)-1)
+		goto out;
+
+	r = pwrite_in_full(q->fd, copy, q->cluster_size, clust_start);
+
+	down_write(&q->lock);
+	/* Written, or copied by another reader, in the meantime */
+	if (r < 0 || get_cluster_table(q, offset, &l2t, &l2t_idx) ||
+	    l2t->table[l2t_idx]) {
+		qcow_free_clusters(q, clust_start, q->cluster_size);
+	} else {
+		l2t->table[l2t_idx] = cpu_to_be64(clust_start |
+						  QCOW2_OFLAG_COPIED);
+		qcow_l2_set_dirty(q, l2t);
+
+		qcow_writeback_if_needed(q);
+	}
+	up_write(&q->lock);
+out:
+	free(copy);
 }
 
 static ssize_t qcow_read_sector_single(struct disk_image *disk, u64 sector,
@@ -469,10 +701,11 @@ static ssize_t qcow_read_sector_single(struct disk_image *disk, u64 sector,
 {
 	struct qcow *q = disk->priv;
 	struct qcow_header *header = q->header;
+	bool from_backing;
 	u32 nr_read;
 	u64 offset;
 	char *buf;
-	u32 nr;
+	ssize_t nr;
 
 	buf = dst;
 	nr_read = 0;
@@ -482,16 +715,24 @@ static ssize_t qcow_read_sector_single(struct disk_image *disk, u64 sector,
 		if (offset >= header->size)
 			return -1;
 
+		from_backing = false;
+
+		/* Readers only exclude cluster allocation, not each other */
+		down_read(&q->lock);
 		if (q->version == QCOW1_VERSION)
 			nr = qcow1_read_cluster(q, offset, buf,
 				dst_len - nr_read);
 		else
 			nr = qcow2_read_cluster(q, offset, buf,
-				dst_len - nr_read);
+				dst_len - nr_read, &from_backing);
+		up_read(&q->lock);
 
 		if (nr <= 0)
 			return -1;
 
+		if (from_backing && q->copy_on_read)
+			qcow_copy_on_read(q, offset);
+
 		nr_read	+= nr;
 		buf	+= nr;
 		sector	+= (nr >> SECTOR_SHIFT);
@@ -522,49 +763,18 @@ static ssize_t qcow_read_sector(struct disk_image *disk, u64 sector,
 
 static void refcount_table_free_cache(struct qcow_refcount_table *rft)
 {
-	struct rb_root *r = &rft->root;
 	struct list_head *pos, *n;
 	struct qcow_refcount_block *t;
 
 	list_for_each_safe(pos, n, &rft->lru_list) {
 		list_del(pos);
 		t = list_entry(pos, struct qcow_refcount_block, list);
-		rb_erase(&t->node, r);
+		hlist_del(&t->node);
 
 		free(t);
 	}
-}
-
-static int refcount_block_insert(struct rb_root *root, struct qcow_refcount_block *new)
-{
-	struct rb_node **link = &(root->rb_node), *parent = NULL;
-	u64 offset = new->offset;
-
-	/* search the tree */
-	while (*link) {
-		struct qcow_refcount_block *t;
-
-		t = rb_entry(*link, struct qcow_refcount_block, node);
-		if (!t)
-			goto error;
-
-		parent = *link;
-
-		if (t->offset > offset)
-			link = &(*link)->rb_left;
-		else if (t->offset < offset)
-			link = &(*link)->rb_right;
-		else
-			goto out;
-	}
 
-	/* add new node */
-	rb_link_node(&new->node, parent, link);
-	rb_insert_color(&new->node, root);
-out:
-	return 0;
-error:
-	return -1;
+	free(rft->hash);
 }
 
 static int write_refcount_block(struct qcow *q, struct qcow_refcount_block *rfb)
@@ -572,40 +782,50 @@ static int write_refcount_block(struct qcow *q, struct qcow_refcount_block *rfb)
 	if (!rfb->dirty)
 		return 0;
 
-	if (qcow_pwrite_sync(q->fd, rfb->entries,
+	if (pwrite_in_full(q->fd, rfb->entries,
 		rfb->size * sizeof(u16), rfb->offset) < 0)
 		return -1;
 
 	rfb->dirty = 0;
+	q->nr_dirty--;
 
 	return 0;
 }
 
+static void refcount_block_set_dirty(struct qcow *q, struct qcow_refcount_block *rfb)
+{
+	if (rfb->dirty)
+		return;
+
+	rfb->dirty = 1;
+	q->nr_dirty++;
+}
+
 static int cache_refcount_block(struct qcow *q, struct qcow_refcount_block *c)
 {
 	struct qcow_refcount_table *rft = &q->refcount_table;
-	struct rb_root *r = &rft->root;
 	struct qcow_refcount_block *lru;
 
-	if (rft->nr_cached == MAX_CACHE_NODES) {
-		lru = list_first_entry(&rft->lru_list, struct qcow_refcount_block, list);
+	if (rft->nr_cached >= q->cache_nodes) {
+		list_for_each_entry(lru, &rft->lru_list, list) {
+			if (lru->dirty)
+				continue;
 
-		rb_erase(&lru->node, r);
-		list_del_init(&lru->list);
-		rft->nr_cached--;
+			hlist_del(&lru->node);
+			list_del_init(&lru->list);
+			rft->nr_cached--;
 
-		free(lru);
+			free(lru);
+			break;
+		}
 	}
 
-	if (refcount_block_insert(r, c) < 0)
-		goto error;
+	hlist_add_head(&c->node, &rft->hash[qcow_cache_hash(q, c->offset)]);
 
 	list_add_tail(&c->list, &rft->lru_list);
 	rft->nr_cached++;
 
 	return 0;
-error:
-	return -1;
 }
 
 static struct qcow_refcount_block *new_refcount_block(struct qcow *q, u64 rfb_offset)
@@ -618,31 +838,23 @@ static struct qcow_refcount_block *new_refcount_block(struct qcow *q, u64 rfb_of
 
 	rfb->offset = rfb_offset;
 	rfb->size = q->cluster_size / sizeof(u16);
-	RB_CLEAR_NODE(&rfb->node);
+	rfb->dirty = 0;
+	INIT_HLIST_NODE(&rfb->node);
 	INIT_LIST_HEAD(&rfb->list);
 
 	return rfb;
 }
 
-static struct qcow_refcount_block *refcount_block_lookup(struct rb_root *root, u64 offset)
+static struct qcow_refcount_block *refcount_block_lookup(struct qcow *q, u64 offset)
 {
-	struct rb_node *link = root->rb_node;
-
-	while (link) {
-		struct qcow_refcount_block *t;
-
-		t = rb_entry(link, struct qcow_refcount_block, node);
-		if (!t)
-			goto out;
+	struct hlist_head *head = &q->refcount_table.hash[qcow_cache_hash(q, offset)];
+	struct qcow_refcount_block *t;
 
-		if (t->offset > offset)
-			link = link->rb_left;
-		else if (t->offset < offset)
-			link = link->rb_right;
-		else
+	hlist_for_each_entry(t, head, node) {
+		if (t->offset == offset)
 			return t;
 	}
-out:
+
 	return NULL;
 }
 
@@ -651,7 +863,7 @@ static struct qcow_refcount_block *refcount_block_search(struct qcow *q, u64 off
 	struct qcow_refcount_table *rft = &q->refcount_table;
 	struct qcow_refcount_block *rfb;
 
-	rfb = refcount_block_lookup(&rft->root, offset);
+	rfb = refcount_block_lookup(q, offset);
 	if (!rfb)
 		return NULL;
 
@@ -687,10 +899,10 @@ static struct qcow_refcount_block *qcow_grow_refcount_block(struct qcow *q,
 		return NULL;
 
 	memset(rfb->entries, 0x00, q->cluster_size);
-	rfb->dirty = 1;
+	refcount_block_set_dirty(q, rfb);
 
-	/* write refcount block */
-	if (write_refcount_block(q, rfb) < 0)
+	/* The block must be on disk before the refcount table points to it */
+	if (write_refcount_block(q, rfb) < 0 || fdatasync(q->fd) < 0)
 		goto free_rfb;
 
 	if (cache_refcount_block(q, rfb) < 0)
@@ -708,6 +920,11 @@ static struct qcow_refcount_block *qcow_grow_refcount_block(struct qcow *q,
 
 recover_rft:
 	rft->rf_table[rft_idx] = 0;
+	hlist_del(&rfb->node);
+	list_del(&rfb->list);
+	rft->nr_cached--;
+	if (rfb->dirty)
+		q->nr_dirty--;
 free_rfb:
 	free(rfb);
 	return NULL;
@@ -804,13 +1021,7 @@ static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append)
 
 	refcount = be16_to_cpu(rfb->entries[rfb_idx]) + append;
 	rfb->entries[rfb_idx] = cpu_to_be16(refcount);
-	rfb->dirty = 1;
-
-	/* write refcount block */
-	if (write_refcount_block(q, rfb) < 0) {
-		pr_warning("refcount block index out of bounds");
-		return -1;
-	}
+	refcount_block_set_dirty(q, rfb);
 
 	/* update free_clust_idx since refcount becomes zero */
 	if (!refcount && clust_idx < q->free_clust_idx)
@@ -819,7 +1030,7 @@ static int update_cluster_refcount(struct qcow *q, u64 clust_idx, u16 append)
 	return 0;
 }
 
-static void  qcow_free_clusters(struct qcow *q, u64 clust_start, u64 size)
+static void qcow_release_clusters(struct qcow *q, u64 clust_start, u64 size)
 {
 	struct qcow_header *header = q->header;
 	u64 start, end, offset;
@@ -830,6 +1041,37 @@ static void  qcow_free_clusters(struct qcow *q, u64 clust_start, u64 size)
 		update_cluster_refcount(q, offset >> header->cluster_bits, -1);
 }
 
+/*
+ * Until the metadata that no longer references them is on disk, freed clusters
+ * must keep their refcount: otherwise they could be reallocated while a stale
+ * L2 entry on disk still points to them. Queue them for qcow_writeback().
+ */
+static void qcow_free_clusters(struct qcow *q, u64 clust_start, u64 size)
+{
+	struct qcow_free_range *frees;
+	int nr;
+
+	if (q->nr_pending_frees == q->max_pending_frees) {
+		nr = q->max_pending_frees ? q->max_pending_frees * 2 : 64;
+		frees = realloc(q->pending_frees, nr * sizeof(*frees));
+		if (!frees) {
+			/* Leaking the clusters is safe, reusing them isn't */
+			pr_warning("qcow: leaking %llu bytes at %llu",
+				   (unsigned long long)size,
+				   (unsigned long long)clust_start);
+			return;
+		}
+
+		q->pending_frees	= frees;
+		q->max_pending_frees	= nr;
+	}
+
+	q->pending_frees[q->nr_pending_frees++] = (struct qcow_free_range) {
+		.offset	= clust_start,
+		.size	= size,
+	};
+}
+
 /*
  * Allocate clusters according to the size. Find a postion that
  * can satisfy the size. free_clust_idx is initialized to zero and
@@ -865,41 +1107,148 @@ again:
 	return (clust_idx - clust_num) << header->cluster_bits;
 }
 
+/*
+ * Data clusters are reserved QCOW_PREALLOC_CLUSTERS at a time, which costs a
+ * single search of the refcounts and keeps sequentially written data
+ * contiguous in the image. Reserved clusters that are never used are released
+ * on close, or leaked if we crash, which is harmless.
+ */
+static u64 qcow_alloc_data_cluster(struct qcow *q)
+{
+	u64 offset;
+
+	if (!q->prealloc_nr) {
+		offset = qcow_alloc_clusters(q, QCOW_PREALLOC_CLUSTERS *
+					     q->cluster_size, 1);
+		if (offset == (u64)-1)
+			return -1;
+
+		q->prealloc_offset	= offset;
+		q->prealloc_nr		= QCOW_PREALLOC_CLUSTERS;
+	}
+
+	offset = q->prealloc_offset;
+	q->prealloc_offset += q->cluster_size;
+	q->prealloc_nr--;
+
+	return offset;
+}
+
 static int qcow_write_l1_table(struct qcow *q)
 {
 	struct qcow_l1_table *l1t = &q->table;
 	struct qcow_header *header = q->header;
 
-	if (qcow_pwrite_sync(q->fd, l1t->l1_table,
+	if (pwrite_in_full(q->fd, l1t->l1_table,
 		l1t->table_size * sizeof(u64),
 		header->l1_table_offset) < 0)
 		return -1;
 
+	q->l1_dirty = false;
+
 	return 0;
 }
 
 /*
- * Get l2 table. If the table has been copied, read table directly.
- * If the table exists, allocate a new cluster and copy the table
- * to the new cluster.
+ * Write all modified metadata back to the image, in an order that keeps the
+ * image consistent if we crash at any point:
+ *
+ *  1. refcount blocks, so that new clusters are accounted for, along with the
+ *     data already written to them,
+ *  2. L2 tables, which may point to new data clusters,
+ *  3. the L1 table, which may point to new L2 tables,
+ *  4. finally, the references dropped by the new tables are released.
+ *
+ * A crash in between may leak clusters, but no cluster ever ends up in use
+ * without being referenced. Called with q->lock held for writing.
  */
-static int get_cluster_table(struct qcow *q, u64 offset,
-	struct qcow_l2_table **result_l2t, u64 *result_l2_index)
+static int qcow_writeback(struct qcow *q)
 {
-	struct qcow_header *header = q->header;
+	struct qcow_refcount_table *rft = &q->refcount_table;
 	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_refcount_block *rfb;
 	struct qcow_l2_table *l2t;
-	u64 l1t_idx;
-	u64 l2t_offset;
-	u64 l2t_idx;
-	u64 l2t_size;
-	u64 l2t_new_offset;
+	bool l2_dirty = false;
+	int i;
 
-	l2t_size = 1 << header->l2_bits;
+	if (!q->nr_dirty && !q->l1_dirty && !q->nr_pending_frees)
+		return 0;
 
-	l1t_idx = get_l1_index(q, offset);
-	if (l1t_idx >= l1t->table_size)
-		return -1;
+	list_for_each_entry(rfb, &rft->lru_list, list) {
+		if (write_refcount_block(q, rfb) < 0)
+			return -1;
+	}
+
+	if (fdatasync(q->fd) < 0)
+		return -1;
+
+	list_for_each_entry(l2t, &l1t->lru_list, list) {
+		l2_dirty |= l2t->dirty;
+		if (qcow_l2_cache_write(q, l2t) < 0)
+			return -1;
+	}
+
+	if (q->l1_dirty) {
+		if (l2_dirty && fdatasync(q->fd) < 0)
+			return -1;
+
+		if (qcow_write_l1_table(q) < 0)
+			return -1;
+	}
+
+	if (fdatasync(q->fd) < 0)
+		return -1;
+
+	/*
+	 * Async I/O mapped onto the freed clusters before they were unmapped
+	 * may still be in flight. Let it land before the clusters can be
+	 * handed out again, possibly for metadata.
+	 */
+	if (q->nr_pending_frees && q->disk && q->disk->async)
+		disk_image__wait(q->disk);
+
+	for (i = 0; i < q->nr_pending_frees; i++)
+		qcow_release_clusters(q, q->pending_frees[i].offset,
+				      q->pending_frees[i].size);
+	q->nr_pending_frees = 0;
+
+	return 0;
+}
+
+/*
+ * Keep the amount of dirty metadata bounded, so that the cache doesn't grow
+ * past its size. Called with q->lock held for writing.
+ */
+static int qcow_writeback_if_needed(struct qcow *q)
+{
+	if (q->nr_dirty < max(q->cache_nodes / 2, 1))
+		return 0;
+
+	return qcow_writeback(q);
+}
+
+/*
+ * Get l2 table. If the table has been copied, read table directly.
+ * If the table exists, allocate a new cluster and copy the table
+ * to the new cluster.
+ */
+static int get_cluster_table(struct qcow *q, u64 offset,
+	struct qcow_l2_table **result_l2t, u64 *result_l2_index)
+{
+	struct qcow_header *header = q->header;
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_l2_table *l2t;
+	u64 l1t_idx;
+	u64 l2t_offset;
+	u64 l2t_idx;
+	u64 l2t_size;
+	u64 l2t_new_offset;
+
+	l2t_size = 1 << header->l2_bits;
+
+	l1t_idx = get_l1_index(q, offset);
+	if (l1t_idx >= l1t->table_size)
+		return -1;
 
 	l2t_idx = get_l2_index(q, offset);
 	if (l2t_idx >= l2t_size)
@@ -912,10 +1261,12 @@ static int get_cluster_table(struct qcow *q, u64 offset,
 		if (!l2t)
 			goto error;
 	} else {
+		struct qcow_l2_table *old;
+
 		l2t_new_offset = qcow_alloc_clusters(q,
 			l2t_size*sizeof(u64), 1);
 
-		if (l2t_new_offset != (u64)-1)
+		if (l2t_new_offset == (u64)-1)
 			goto error;
 
 		l2t = new_cache_table(q, l2t_new_offset);
@@ -923,31 +1274,25 @@ static int get_cluster_table(struct qcow *q, u64 offset,
 			goto free_cluster;
 
 		if (l2t_offset) {
-			l2t = qcow_read_l2_table(q, l2t_offset);
-			if (!l2t)
+			old = qcow_read_l2_table(q, l2t_offset);
+			if (!old)
 				goto free_cache;
-		} else
-			memset(l2t->table, 0x00, l2t_size * sizeof(u64));
-
-		/* write l2 table */
-		l2t->dirty = 1;
-		if (qcow_l2_cache_write(q, l2t) < 0)
-			goto free_cache;
+			memcpy(l2t->table, old->table, l2t_size * sizeof(u64));
+		}
 
-		/* cache l2 table */
+		/* cache l2 table, it is written back with the L1 table */
 		if (cache_table(q, l2t))
 			goto free_cache;
+		qcow_l2_set_dirty(q, l2t);
 
 		/* update the l1 talble */
 		l1t->l1_table[l1t_idx] = cpu_to_be64(l2t_new_offset
 			| QCOW2_OFLAG_COPIED);
-		if (qcow_write_l1_table(q)) {
-			pr_warning("Update l1 table error");
-			goto free_cache;
-		}
+		q->l1_dirty = true;
 
 		/* free old cluster */
-		qcow_free_clusters(q, l2t_offset, q->cluster_size);
+		if (l2t_offset)
+			qcow_free_clusters(q, l2t_offset, q->cluster_size);
 	}
 
 	*result_l2t = l2t;
@@ -965,24 +1310,108 @@ error:
 	return -1;
 }
 
+/* Drop the reference held by an L2 entry on its data cluster */
+static void qcow_free_l2_entry(struct qcow *q, u64 entry)
+{
+	u64 clust_start = entry & QCOW2_OFFSET_MASK;
+	int size;
+
+	if (entry & QCOW2_OFLAG_COMPRESSED) {
+		size = ((clust_start >> q->csize_shift) &
+			q->csize_mask) + 1;
+		size *= 512;
+		clust_start &= q->cluster_offset_mask;
+		qcow_zcache_drop(q, clust_start);
+		clust_start &= ~511;
+
+		qcow_free_clusters(q, clust_start, size);
+	} else if (clust_start)
+		qcow_free_clusters(q, clust_start, q->cluster_size);
+}
+
+/*
+ * Look up the L2 entry mapping @offset, which is 0 if there is no L2 table for
+ * it. Called with q->lock held for reading.
+ */
+static int qcow2_get_l2_entry(struct qcow *q, u64 offset, u64 *entry)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	u64 l2t_offset;
+	u64 l1t_idx;
+
+	l1t_idx = get_l1_index(q, offset);
+	if (l1t_idx >= l1t->table_size)
+		return -1;
+
+	l2t_offset = be64_to_cpu(l1t->l1_table[l1t_idx]) & ~QCOW2_OFLAG_COPIED;
+	if (!l2t_offset) {
+		*entry = 0;
+		return 0;
+	}
+
+	return qcow_read_l2_entry(q, l2t_offset, get_l2_index(q, offset), entry);
+}
+
+/*
+ * Overwrite part of a cluster that is already allocated and not shared, which
+ * leaves the metadata alone. Called with q->lock held for reading, so that such
+ * writes run concurrently. Returns -EAGAIN if the cluster must be allocated.
+ */
+static ssize_t qcow_write_allocated(struct qcow *q, u64 offset, void *buf,
+				    u32 len)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	u64 clust_start;
+	u64 l2t_offset;
+	u64 l1t_idx;
+
+	l1t_idx = get_l1_index(q, offset);
+	if (l1t_idx >= l1t->table_size)
+		return -1;
+
+	l2t_offset = be64_to_cpu(l1t->l1_table[l1t_idx]);
+	if (!(l2t_offset & QCOW2_OFLAG_COPIED))
+		return -EAGAIN;
+
+	l2t_offset &= ~QCOW2_OFLAG_COPIED;
+	if (qcow_read_l2_entry(q, l2t_offset, get_l2_index(q, offset),
+			       &clust_start) < 0)
+		return -1;
+
+	if (!(clust_start & QCOW2_OFLAG_COPIED))
+		return -EAGAIN;
+
+	clust_start &= QCOW2_OFFSET_MASK;
+	if (pwrite_in_full(q->fd, buf, len,
+			   clust_start + get_cluster_offset(q, offset)) < 0)
+		return -1;
+
+	return len;
+}
+
 /*
- * If the cluster has been copied, write data directly. If not,
- * read the original data and write it to the new cluster with
- * modification.
+ * If the cluster has been copied, write data directly. If not, read the
+ * original data and write it to a new cluster with the modification.
+ *
+ * Only the allocation of the new cluster and its linking into the L2 table
+ * hold q->lock for writing. The data is read and written with the lock held
+ * for reading, or not at all, so that allocating writes don't stall readers
+ * for the duration of their I/O. If the L2 entry changed meanwhile, the new
+ * cluster is dropped and the write starts over.
  */
 static ssize_t qcow_write_cluster(struct qcow *q, u64 offset,
 		void *buf, u32 src_len)
 {
 	struct qcow_l2_table *l2t;
+	ssize_t ret;
 	u64 clust_new_start;
 	u64 clust_start;
-	u64 clust_flags;
 	u64 clust_off;
 	u64 l2t_idx;
+	u64 entry;
+	void *copy;
 	u64 len;
 
-	l2t = NULL;
-
 	clust_off = get_cluster_offset(q, offset);
 	if (clust_off >= q->cluster_size)
 		return -1;
@@ -991,83 +1420,99 @@ static ssize_t qcow_write_cluster(struct qcow *q, u64 offset,
 	if (len > src_len)
 		len = src_len;
 
-	mutex_lock(&q->mutex);
+again:
+	down_read(&q->lock);
+	ret = qcow_write_allocated(q, offset, buf, len);
+	if (ret == -EAGAIN)
+		ret = qcow2_get_l2_entry(q, offset, &entry) < 0 ? -1 : -EAGAIN;
+	up_read(&q->lock);
+	if (ret != -EAGAIN)
+		return ret;
 
-	if (get_cluster_table(q, offset, &l2t, &l2t_idx)) {
-		pr_warning("Get l2 table error");
-		goto error;
+	/*
+	 * The cluster is not shared, only its L2 table is: unshare the table
+	 * and write in place.
+	 */
+	if (entry & QCOW2_OFLAG_COPIED) {
+		down_write(&q->lock);
+		ret = get_cluster_table(q, offset, &l2t, &l2t_idx);
+		up_write(&q->lock);
+		if (ret) {
+			pr_warning("Get l2 table error");
+			return -1;
+		}
+		goto again;
 	}
 
-	clust_start = be64_to_cpu(l2t->table[l2t_idx]);
-	clust_flags = clust_start & QCOW2_OFLAGS_MASK;
+	copy = malloc(q->cluster_size);
+	if (!copy)
+		return -1;
 
-	clust_start &= QCOW2_OFFSET_MASK;
-	if (!(clust_flags & QCOW2_OFLAG_COPIED)) {
-		clust_new_start	= qcow_alloc_clusters(q, q->cluster_size, 1);
-		if (clust_new_start != (u64)-1) {
-			pr_warning("Cluster alloc error");
-			goto error;
+	/* read the original data, which may be in the backing image */
+	clust_start = entry & QCOW2_OFFSET_MASK;
+	if ((clust_start || q->backing) && len < q->cluster_size) {
+		down_read(&q->lock);
+		ret = qcow2_read_cluster(q, offset & ~(q->cluster_size - 1),
+					 copy, q->cluster_size, NULL);
+		up_read(&q->lock);
+		if (ret < 0) {
+			pr_warning("Read copy cluster error");
+			goto out;
 		}
+	} else {
+		memset(copy, 0x00, q->cluster_size);
+	}
 
-		offset &= ~(q->cluster_size - 1);
+	memcpy(copy + clust_off, buf, len);
 
-		/* if clust_start is not zero, read the original data*/
-		if (clust_start) {
-			mutex_unlock(&q->mutex);
-			if (qcow2_read_cluster(q, offset, q->copy_buff,
-				q->cluster_size) < 0) {
-				pr_warning("Read copy cluster error");
-				qcow_free_clusters(q, clust_new_start,
-					q->cluster_size);
-				return -1;
-			}
-			mutex_lock(&q->mutex);
-		} else
-			memset(q->copy_buff, 0x00, q->cluster_size);
+	ret = -1;
+	down_write(&q->lock);
+	clust_new_start = qcow_alloc_data_cluster(q);
+	up_write(&q->lock);
+	if (clust_new_start == (u64)-1) {
+		pr_warning("Cluster alloc error");
+		goto out;
+	}
 
-		memcpy(q->copy_buff + clust_off, buf, len);
+	/* Write actual data, to a cluster nothing references yet */
+	if (pwrite_in_full(q->fd, copy, q->cluster_size, clust_new_start) < 0) {
+		down_write(&q->lock);
+		goto free_cluster;
+	}
 
-		 /* Write actual data */
-		if (pwrite_in_full(q->fd, q->copy_buff, q->cluster_size,
-			clust_new_start) < 0)
-			goto free_cluster;
+	down_write(&q->lock);
 
-		/* update l2 table*/
-		l2t->table[l2t_idx] = cpu_to_be64(clust_new_start
-			| QCOW2_OFLAG_COPIED);
-		l2t->dirty = 1;
+	if (get_cluster_table(q, offset, &l2t, &l2t_idx)) {
+		pr_warning("Get l2 table error");
+		goto free_cluster;
+	}
 
-		if (qcow_l2_cache_write(q, l2t))
-			goto free_cluster;
+	/* Written, discarded or copied in the meantime */
+	if (be64_to_cpu(l2t->table[l2t_idx]) != entry) {
+		qcow_free_clusters(q, clust_new_start, q->cluster_size);
+		up_write(&q->lock);
+		free(copy);
+		goto again;
+	}
 
-		/* free old cluster*/
-		if (clust_flags & QCOW2_OFLAG_COMPRESSED) {
-			int size;
-			size = ((clust_start >> q->csize_shift) &
-				q->csize_mask) + 1;
-			size *= 512;
-			clust_start &= q->cluster_offset_mask;
-			clust_start &= ~511;
+	/* update l2 table*/
+	l2t->table[l2t_idx] = cpu_to_be64(clust_new_start | QCOW2_OFLAG_COPIED);
+	qcow_l2_set_dirty(q, l2t);
 
-			qcow_free_clusters(q, clust_start, size);
-		} else if (clust_start)
-			qcow_free_clusters(q, clust_start, q->cluster_size);
+	/* free old cluster*/
+	qcow_free_l2_entry(q, entry);
 
-	} else {
-		/* Write actual data */
-		if (pwrite_in_full(q->fd, buf, len,
-			clust_start + clust_off) < 0)
-			goto error;
-	}
-	mutex_unlock(&q->mutex);
-	return len;
+	if (qcow_writeback_if_needed(q) == 0)
+		ret = len;
+	up_write(&q->lock);
+	goto out;
 
 free_cluster:
 	qcow_free_clusters(q, clust_new_start, q->cluster_size);
-
-error:
-	mutex_unlock(&q->mutex);
-	return -1;
+	up_write(&q->lock);
+out:
+	free(copy);
+	return ret;
 }
 
 static ssize_t qcow_write_sector_single(struct disk_image *disk, u64 sector, void *src, u32 src_len)
@@ -1119,42 +1564,312 @@ static ssize_t qcow_write_sector(struct disk_image *disk, u64 sector,
 	return total;
 }
 
-static int qcow_disk_flush(struct disk_image *disk)
+#ifdef DISK_IMAGE_HAS_ASYNC
+/*
+ * Translate a guest range into the image offset backing it. This only succeeds
+ * when the range is a single contiguous run of allocated, uncompressed
+ * clusters, which moreover must not be shared when @write is set. Called with
+ * q->lock held for reading.
+ */
+static int qcow_map_range(struct qcow *q, u64 offset, u64 len, bool write,
+			  u64 *host_offset)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	u64 end = offset + len;
+	u64 clust_start;
+	u64 l2t_offset;
+	u64 host, next;
+	u64 l1t_idx;
+	u64 clust_off;
+	u64 n;
+
+	if (q->version != QCOW2_VERSION || end > q->header->size)
+		return -1;
+
+	next = 0;
+	while (offset < end) {
+		l1t_idx = get_l1_index(q, offset);
+		if (l1t_idx >= l1t->table_size)
+			return -1;
+
+		l2t_offset = be64_to_cpu(l1t->l1_table[l1t_idx]);
+		if (write && !(l2t_offset & QCOW2_OFLAG_COPIED))
+			return -1;
+
+		l2t_offset &= ~QCOW2_OFLAG_COPIED;
+		if (!l2t_offset)
+			return -1;
+
+		if (qcow_read_l2_entry(q, l2t_offset, get_l2_index(q, offset),
+				       &clust_start) < 0)
+			return -1;
+
+		if (clust_start & QCOW2_OFLAG_COMPRESSED)
+			return -1;
+		if (write && !(clust_start & QCOW2_OFLAG_COPIED))
+			return -1;
+
+		clust_start &= QCOW2_OFFSET_MASK;
+		if (!clust_start)
+			return -1;
+
+		clust_off = get_cluster_offset(q, offset);
+		host = clust_start + clust_off;
+		if (!next)
+			*host_offset = host;
+		else if (host != next)
+			return -1;
+
+		n = min(q->cluster_size - clust_off, end - offset);
+		next	= host + n;
+		offset	+= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Requests that map onto one contiguous run of allocated clusters are handed
+ * to the async engine with their image offset, and complete through the disk
+ * callback. Anything else (holes, compressed or shared clusters, crossing a
+ * discontinuity) goes through the synchronous path and is completed here.
+ * Failed requests are only reported by the return value, and completed by
+ * disk_image__read() and disk_image__write().
+ */
+static ssize_t qcow_rw_async(struct disk_image *disk, u64 sector,
+			     const struct iovec *iov, int iovcount, void *param,
+			     bool write)
 {
 	struct qcow *q = disk->priv;
-	struct qcow_refcount_table *rft;
-	struct list_head *pos, *n;
-	struct qcow_l1_table *l1t;
+	u64 host_offset;
+	ssize_t ret;
+	int r;
 
-	l1t = &q->table;
-	rft = &q->refcount_table;
+	if (!disk->async)
+		goto sync;
 
-	mutex_lock(&q->mutex);
+	/*
+	 * The lock is held until the request is accounted as in flight, which
+	 * qcow_writeback() waits for before reusing freed clusters.
+	 */
+	down_read(&q->lock);
+	r = qcow_map_range(q, sector << SECTOR_SHIFT, iov_size(iov, iovcount),
+			   write, &host_offset);
+	if (r < 0) {
+		up_read(&q->lock);
+		goto sync;
+	}
 
-	list_for_each_safe(pos, n, &rft->lru_list) {
-		struct qcow_refcount_block *c = list_entry(pos, struct qcow_refcount_block, list);
+	if (write)
+		ret = raw_image__write_async(disk, host_offset >> SECTOR_SHIFT,
+					     iov, iovcount, param);
+	else
+		ret = raw_image__read_async(disk, host_offset >> SECTOR_SHIFT,
+					    iov, iovcount, param);
+	up_read(&q->lock);
+
+	return ret;
+
+sync:
+	if (write)
+		ret = qcow_write_sector(disk, sector, iov, iovcount, param);
+	else
+		ret = qcow_read_sector(disk, sector, iov, iovcount, param);
+
+	if (disk->async && ret >= 0)
+		disk->disk_req_cb(param, ret);
+
+	return ret;
+}
+
+static ssize_t qcow_read_sector_async(struct disk_image *disk, u64 sector,
+				      const struct iovec *iov, int iovcount,
+				      void *param)
+{
+	return qcow_rw_async(disk, sector, iov, iovcount, param, false);
+}
+
+static ssize_t qcow_write_sector_async(struct disk_image *disk, u64 sector,
+				       const struct iovec *iov, int iovcount,
+				       void *param)
+{
+	return qcow_rw_async(disk, sector, iov, iovcount, param, true);
+}
+
+#define qcow_disk_read		qcow_read_sector_async
+#define qcow_disk_write		qcow_write_sector_async
+#else
+#define qcow_disk_read		qcow_read_sector
+#define qcow_disk_write		qcow_write_sector
+#endif /* DISK_IMAGE_HAS_ASYNC */
+
+/*
+ * Unmap the cluster containing @offset so that it reads back as zeroes.
+ * Called with q->lock held for writing.
+ */
+static int qcow_discard_cluster(struct qcow *q, u64 offset)
+{
+	struct qcow_l1_table *l1t = &q->table;
+	struct qcow_l2_table *l2t;
+	u64 clust_start;
+	u64 l1t_idx;
+	u64 l2t_idx;
+
+	l1t_idx = get_l1_index(q, offset);
+	if (l1t_idx >= l1t->table_size)
+		return -1;
+
+	/* Nothing is allocated below an empty L1 entry */
+	if (!(be64_to_cpu(l1t->l1_table[l1t_idx]) & ~QCOW2_OFLAG_COPIED))
+		return 0;
+
+	if (get_cluster_table(q, offset, &l2t, &l2t_idx))
+		return -1;
+
+	clust_start = be64_to_cpu(l2t->table[l2t_idx]);
+	if (!clust_start)
+		return 0;
+
+	l2t->table[l2t_idx] = 0;
+	qcow_l2_set_dirty(q, l2t);
+
+	qcow_free_l2_entry(q, clust_start);
+
+	return qcow_writeback_if_needed(q);
+}
+
+/* Round a range inwards to whole clusters. The last cluster may be partial. */
+static bool qcow_cluster_range(struct qcow *q, u64 *start, u64 *end)
+{
+	u64 s = ALIGN(*start, q->cluster_size);
+	u64 e = *end;
+
+	if (e != q->header->size)
+		e &= ~(q->cluster_size - 1);
 
-		if (write_refcount_block(q, c) < 0)
-			goto error_unlock;
+	if (s >= e)
+		return false;
+
+	*start	= s;
+	*end	= e;
+	return true;
+}
+
+static int qcow_unmap_range(struct qcow *q, u64 start, u64 end)
+{
+	u64 offset;
+	int r = 0;
+
+	down_write(&q->lock);
+	for (offset = start; offset < end; offset += q->cluster_size) {
+		if (qcow_discard_cluster(q, offset) < 0) {
+			pr_warning("qcow: failed to discard cluster at %llu",
+				   (unsigned long long)offset);
+			r = -EIO;
+			break;
+		}
 	}
+	up_write(&q->lock);
 
-	list_for_each_safe(pos, n, &l1t->lru_list) {
-		struct qcow_l2_table *c = list_entry(pos, struct qcow_l2_table, list);
+	return r;
+}
 
-		if (qcow_l2_cache_write(q, c) < 0)
-			goto error_unlock;
+/* Only whole clusters are unmapped, partial ones are left untouched */
+static int qcow_disk_discard(struct disk_image *disk, u64 sector, u64 nr_sectors)
+{
+	struct qcow *q = disk->priv;
+	u64 start = sector << SECTOR_SHIFT;
+	u64 end = start + (nr_sectors << SECTOR_SHIFT);
+
+	if (q->version != QCOW2_VERSION)
+		return -EOPNOTSUPP;
+
+	/* Unmapped clusters would expose the backing image again */
+	if (q->backing)
+		return 0;
+
+	if (!qcow_cluster_range(q, &start, &end))
+		return 0;
+
+	return qcow_unmap_range(q, start, end);
+}
+
+static int qcow_write_zeroes_buf(struct disk_image *disk, u64 start, u64 end)
+{
+	struct qcow *q = disk->priv;
+	ssize_t nr;
+	void *buf;
+	u32 len;
+
+	if (start >= end)
+		return 0;
+
+	buf = calloc(1, q->cluster_size);
+	if (!buf)
+		return -ENOMEM;
+
+	while (start < end) {
+		len = min_t(u64, end - start, q->cluster_size);
+		nr = qcow_write_sector_single(disk, start >> SECTOR_SHIFT, buf, len);
+		if (nr != len)
+			break;
+
+		start += len;
 	}
 
-	if (qcow_write_l1_table < 0)
-		goto error_unlock;
+	free(buf);
 
-	mutex_unlock(&q->mutex);
+	return start < end ? -EIO : 0;
+}
+
+/*
+ * Whole clusters are unmapped, since qcow2 version 2 has no other way of
+ * marking them as zero. Unaligned head and tail are written out, and so is
+ * everything when there is a backing image to hide.
+ */
+static int qcow_disk_write_zeroes(struct disk_image *disk, u64 sector,
+				  u64 nr_sectors, bool unmap)
+{
+	struct qcow *q = disk->priv;
+	u64 start = sector << SECTOR_SHIFT;
+	u64 end = start + (nr_sectors << SECTOR_SHIFT);
+	u64 clust_start = start, clust_end = end;
+	int r;
+
+	if (q->version != QCOW2_VERSION)
+		return -EOPNOTSUPP;
+
+	if (q->backing || !qcow_cluster_range(q, &clust_start, &clust_end))
+		return qcow_write_zeroes_buf(disk, start, end);
+
+	r = qcow_write_zeroes_buf(disk, start, clust_start);
+	if (!r)
+		r = qcow_unmap_range(q, clust_start, clust_end);
+	if (!r)
+		r = qcow_write_zeroes_buf(disk, clust_end, end);
+
+	return r;
+}
+
+static int qcow_disk_flush(struct disk_image *disk)
+{
+	struct qcow *q = disk->priv;
+	int r;
+
+	down_write(&q->lock);
+	r = qcow_writeback(q);
+	up_write(&q->lock);
+	if (r < 0)
+		return r;
 
 	return fsync(disk->fd);
+}
 
-error_unlock:
-	mutex_unlock(&q->mutex);
-	return -1;
+static void qcow_close_backing(struct qcow *q)
+{
+	if (q->backing)
+		disk_image__close(q->backing);
+	free(q->backing_path);
 }
 
 static int qcow_disk_close(struct disk_image *disk)
@@ -1166,11 +1881,23 @@ static int qcow_disk_close(struct disk_image *disk)
 
 	q = disk->priv;
 
+	if (!disk->readonly) {
+		/* The reserved clusters were never referenced */
+		if (q->prealloc_nr)
+			qcow_release_clusters(q, q->prealloc_offset,
+					      q->prealloc_nr * q->cluster_size);
+		q->prealloc_nr = 0;
+
+		if (qcow_writeback(q) < 0)
+			pr_warning("qcow: failed to write back metadata");
+	}
+
+	qcow_close_backing(q);
+
+	free(q->pending_frees);
 	refcount_table_free_cache(&q->refcount_table);
 	l1_table_free_cache(&q->table);
-	free(q->copy_buff);
-	free(q->cluster_data);
-	free(q->cluster_cache);
+	qcow_zcache_free(q);
 	free(q->refcount_table.rf_table);
 	free(q->table.l1_table);
 	free(q->header);
@@ -1180,15 +1907,21 @@ static int qcow_disk_close(struct disk_image *disk)
 }
 
 static struct disk_image_operations qcow_disk_readonly_ops = {
-	.read	= qcow_read_sector,
-	.close	= qcow_disk_close,
+	.read		= qcow_disk_read,
+	.wait		= raw_image__wait,
+	.close		= qcow_disk_close,
+	.async		= true,
 };
 
 static struct disk_image_operations qcow_disk_ops = {
-	.read	= qcow_read_sector,
-	.write	= qcow_write_sector,
-	.flush	= qcow_disk_flush,
-	.close	= qcow_disk_close,
+	.read		= qcow_disk_read,
+	.write		= qcow_disk_write,
+	.flush		= qcow_disk_flush,
+	.discard	= qcow_disk_discard,
+	.write_zeroes	= qcow_disk_write_zeroes,
+	.wait		= raw_image__wait,
+	.close		= qcow_disk_close,
+	.async		= true,
 };
 
 static int qcow_read_refcount_table(struct qcow *q)
@@ -1203,9 +1936,6 @@ static int qcow_read_refcount_table(struct qcow *q)
 	if (!rft->rf_table)
 		return -1;
 
-	rft->root = (struct rb_root) RB_ROOT;
-	INIT_LIST_HEAD(&rft->lru_list);
-
 	return pread_in_full(q->fd, rft->rf_table, sizeof(u64) * rft->rf_size, header->refcount_table_offset);
 }
 
@@ -1268,15 +1998,80 @@ static void *qcow2_read_header(int fd)
 		.l2_bits		= f_header.cluster_bits - 3,
 		.refcount_table_offset	= f_header.refcount_table_offset,
 		.refcount_table_size	= f_header.refcount_table_clusters,
+		.backing_file_offset	= f_header.backing_file_offset,
+		.backing_file_size	= f_header.backing_file_size,
 	};
 
 	return header;
 }
 
-static struct disk_image *qcow2_probe(int fd, bool readonly)
+/*
+ * Open the backing file named in the header, if any. Relative names are
+ * relative to the directory of the image. The backing file is never written
+ * to, so the same base can be shared by any number of images.
+ */
+static int qcow_open_backing(struct qcow *q, struct disk_image_params *params)
 {
+	struct qcow_header *header = q->header;
+	struct disk_image_params backing_params;
+	u32 len = header->backing_file_size;
+	struct disk_image *backing;
+	char name[PATH_MAX];
+	const char *slash;
+	char *path;
+	int r;
+
+	if (!header->backing_file_offset || !len)
+		return 0;
+
+	if (len >= sizeof(name)) {
+		pr_warning("qcow: backing file name too long");
+		return -1;
+	}
+
+	if (params->depth >= QCOW_MAX_BACKING_DEPTH) {
+		pr_warning("qcow: more than %d backing files in the chain",
+			   QCOW_MAX_BACKING_DEPTH);
+		return -1;
+	}
+
+	if (pread_in_full(q->fd, name, len, header->backing_file_offset) < 0)
+		return -1;
+	name[len] = '\0';
+
+	slash = strrchr(params->filename, '/');
+	if (name[0] != '/' && slash)
+		r = asprintf(&path, "%.*s/%s", (int)(slash - params->filename),
+			     params->filename, name);
+	else
+		r = asprintf(&path, "%s", name);
+	if (r < 0)
+		return -1;
+
+	backing_params = (struct disk_image_params) {
+		.filename	= path,
+		.readonly	= true,
+		.cache_nodes	= params->cache_nodes,
+		.depth		= params->depth + 1,
+	};
+
+	backing = disk_image__open(&backing_params);
+	if (IS_ERR_OR_NULL(backing)) {
+		pr_warning("qcow: unable to open backing file '%s'", path);
+		free(path);
+		return -1;
+	}
+
+	q->backing	= backing;
+	q->backing_path	= path;
+
+	return 0;
+}
+
+static struct disk_image *qcow2_probe(int fd, struct disk_image_params *params)
+{
+	bool readonly = params->readonly;
 	struct disk_image *disk_image;
-	struct qcow_l1_table *l1t;
 	struct qcow_header *h;
 	struct qcow *q;
 
@@ -1284,48 +2079,36 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 	if (!q)
 		return NULL;
 
-	mutex_init(&q->mutex);
+	pthread_rwlock_init(&q->lock, NULL);
+	mutex_init(&q->cache_lock);
+	qcow_zcache_init(q);
 	q->fd = fd;
 
-	l1t = &q->table;
-
-	l1t->root = (struct rb_root) RB_ROOT;
-	INIT_LIST_HEAD(&l1t->lru_list);
-
 	h = q->header = qcow2_read_header(fd);
 	if (!h)
 		goto free_qcow;
 
+	if (qcow_cache_init(q, params->cache_nodes) < 0)
+		goto free_header;
+
 	q->version = QCOW2_VERSION;
 	q->csize_shift = (62 - (q->header->cluster_bits - 8));
 	q->csize_mask = (1 << (q->header->cluster_bits - 8)) - 1;
 	q->cluster_offset_mask = (1LL << q->csize_shift) - 1;
 	q->cluster_size = 1 << q->header->cluster_bits;
 
-	q->copy_buff = malloc(q->cluster_size);
-	if (!q->copy_buff) {
-		pr_warning("copy buff malloc error");
-		goto free_header;
-	}
-
-	q->cluster_data = malloc(q->cluster_size);
-	if (!q->cluster_data) {
-		pr_warning("cluster data malloc error");
-		goto free_copy_buff;
-	}
-
-	q->cluster_cache = malloc(q->cluster_size);
-	if (!q->cluster_cache) {
-		pr_warning("cluster cache malloc error");
-		goto free_cluster_data;
-	}
-
 	if (qcow_read_l1_table(q) < 0)
-		goto free_cluster_cache;
+		goto free_header;
 
 	if (qcow_read_refcount_table(q) < 0)
 		goto free_l1_table;
 
+	if (qcow_open_backing(q, params) < 0)
+		goto free_refcount_table;
+
+	/* Copying clusters from the backing image needs a writable image */
+	q->copy_on_read = params->copy_on_read && q->backing && !readonly;
+
 	/*
 	 * Do not use mmap use read/write instead
 	 */
@@ -1335,28 +2118,26 @@ static struct disk_image *qcow2_probe(int fd, bool readonly)
 		disk_image = disk_image__new(fd, h->size, &qcow_disk_ops, DISK_IMAGE_REGULAR);
 
 	if (IS_ERR_OR_NULL(disk_image))
-		goto free_refcount_table;
+		goto close_backing;
 
 	disk_image->priv = q;
+	disk_image->readonly = readonly;
+	disk_image->discard_align = q->cluster_size >> SECTOR_SHIFT;
+	q->disk = disk_image;
 
 	return disk_image;
 
+close_backing:
+	qcow_close_backing(q);
 free_refcount_table:
 	if (q->refcount_table.rf_table)
 		free(q->refcount_table.rf_table);
 free_l1_table:
 	if (q->table.l1_table)
 		free(q->table.l1_table);
-free_cluster_cache:
-	if (q->cluster_cache)
-		free(q->cluster_cache);
-free_cluster_data:
-	if (q->cluster_data)
-		free(q->cluster_data);
-free_copy_buff:
-	if (q->copy_buff)
-		free(q->copy_buff);
 free_header:
+	free(q->refcount_table.hash);
+	free(q->table.hash);
 	if (q->header)
 		free(q->header);
 free_qcow:
@@ -1413,15 +2194,16 @@ static void *qcow1_read_header(int fd)
 		.l1_size		= f_header.size / ((1 << f_header.l2_bits) * (1 << f_header.cluster_bits)),
 		.cluster_bits		= f_header.cluster_bits,
 		.l2_bits		= f_header.l2_bits,
+		.backing_file_offset	= f_header.backing_file_offset,
+		.backing_file_size	= f_header.backing_file_size,
 	};
 
 	return header;
 }
 
-static struct disk_image *qcow1_probe(int fd, bool readonly)
+static struct disk_image *qcow1_probe(int fd, struct disk_image_params *params)
 {
 	struct disk_image *disk_image;
-	struct qcow_l1_table *l1t;
 	struct qcow_header *h;
 	struct qcow *q;
 
@@ -1429,64 +2211,53 @@ static struct disk_image *qcow1_probe(int fd, bool readonly)
 	if (!q)
 		return NULL;
 
-	mutex_init(&q->mutex);
+	pthread_rwlock_init(&q->lock, NULL);
+	mutex_init(&q->cache_lock);
+	qcow_zcache_init(q);
 	q->fd = fd;
 
-	l1t = &q->table;
-
-	l1t->root = (struct rb_root)RB_ROOT;
-	INIT_LIST_HEAD(&l1t->lru_list);
-	INIT_LIST_HEAD(&q->refcount_table.lru_list);
-
 	h = q->header = qcow1_read_header(fd);
 	if (!h)
 		goto free_qcow;
 
+	if (qcow_cache_init(q, params->cache_nodes) < 0)
+		goto free_header;
+
 	q->version = QCOW1_VERSION;
 	q->cluster_size = 1 << q->header->cluster_bits;
 	q->cluster_offset_mask = (1LL << (63 - q->header->cluster_bits)) - 1;
 	q->free_clust_idx = 0;
 
-	q->cluster_data = malloc(q->cluster_size);
-	if (!q->cluster_data) {
-		pr_warning("cluster data malloc error");
+	if (qcow_read_l1_table(q) < 0)
 		goto free_header;
-	}
-
-	q->cluster_cache = malloc(q->cluster_size);
-	if (!q->cluster_cache) {
-		pr_warning("cluster cache malloc error");
-		goto free_cluster_data;
-	}
 
-	if (qcow_read_l1_table(q) < 0)
-		goto free_cluster_cache;
+	if (qcow_open_backing(q, params) < 0)
+		goto free_l1_table;
 
 	/*
-	 * Do not use mmap use read/write instead
+	 * Do not use mmap use read/write instead. The write path only knows
+	 * about the QCOW2 format.
 	 */
-	if (readonly)
-		disk_image = disk_image__new(fd, h->size, &qcow_disk_readonly_ops, DISK_IMAGE_REGULAR);
-	else
-		disk_image = disk_image__new(fd, h->size, &qcow_disk_ops, DISK_IMAGE_REGULAR);
+	if (!params->readonly)
+		pr_warning("Forcing read-only support for QCOW version 1");
+	disk_image = disk_image__new(fd, h->size, &qcow_disk_readonly_ops, DISK_IMAGE_REGULAR);
 
-	if (!disk_image)
-		goto free_l1_table;
+	if (IS_ERR_OR_NULL(disk_image))
+		goto close_backing;
 
 	disk_image->priv = q;
+	disk_image->readonly = true;
 
 	return disk_image;
 
+close_backing:
+	qcow_close_backing(q);
 free_l1_table:
 	if (q->table.l1_table)
 		free(q->table.l1_table);
-free_cluster_cache:
-	if (q->cluster_cache)
-		free(q->cluster_cache);
-free_cluster_data:
-	if (q->cluster_data)
-		free(q->cluster_data);
 free_header:
+	free(q->refcount_table.hash);
+	free(q->table.hash);
 	if (q->header)
 		free(q->header);
 free_qcow:
@@ -1514,13 +2285,13 @@ static bool qcow1_check_image(int fd)
 	return true;
 }
 
-struct disk_image *qcow_probe(int fd, bool readonly)
+struct disk_image *qcow_probe(int fd, struct disk_image_params *params)
 {
 	if (qcow1_check_image(fd))
-		return qcow1_probe(fd, readonly);
+		return qcow1_probe(fd, params);
 
 	if (qcow2_check_image(fd))
-		return qcow2_probe(fd, readonly);
+		return qcow2_probe(fd, params);
 
 	return NULL;
 }
@@ -1,10 +1,19 @@
 #include "kvm/disk-image.h"
 
 #include <linux/err.h>
+#include <linux/falloc.h>
+#include <linux/kernel.h>
 
 ssize_t raw_image__read_sync(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param)
 {
+	if (disk_extent__read_is_hole(disk, sector, iov, iovcount))
+		return disk_extent__read_hole(iov, iovcount);
+
+	if (disk_bounce__needed(disk, sector, iov, iovcount))
+		return disk_bounce__rw(disk, DISK_IO_READ, sector << SECTOR_SHIFT,
+				       iov, iovcount);
+
 	return preadv_in_full(disk->fd, iov, iovcount, sector << SECTOR_SHIFT);
 }
 
@@ -12,9 +21,239 @@ ssize_t raw_image__write_sync(struct disk_image *disk, u64 sector,
 			      const struct iovec *iov, int iovcount,
 			      void *param)
 {
+	disk_extent__write(disk, sector, iov, iovcount);
+
+	if (disk_bounce__needed(disk, sector, iov, iovcount))
+		return disk_bounce__rw(disk, DISK_IO_WRITE, sector << SECTOR_SHIFT,
+				       iov, iovcount);
+
 	return pwritev_in_full(disk->fd, iov, iovcount, sector << SECTOR_SHIFT);
 }
 
+#ifdef DISK_IMAGE_HAS_ASYNC
+/*
+ * Requests that need bounce buffers are rare enough to be done synchronously,
+ * and completed right away. Like a failed submission to the engine, a failed
+ * request is only reported by the return value, and the caller completes it.
+ */
+static ssize_t raw_image__bounce_async(struct disk_image *disk, int type,
+				       u64 sector, const struct iovec *iov,
+				       int iovcount, void *param)
+{
+	ssize_t ret;
+
+	ret = disk_bounce__rw(disk, type, sector << SECTOR_SHIFT, iov, iovcount);
+	if (ret >= 0)
+		disk->disk_req_cb(param, ret);
+
+	return ret;
+}
+
+static ssize_t raw_image__read_hole_async(struct disk_image *disk,
+					  const struct iovec *iov, int iovcount,
+					  void *param)
+{
+	ssize_t ret;
+
+	ret = disk_extent__read_hole(iov, iovcount);
+	if (ret >= 0)
+		disk->disk_req_cb(param, ret);
+
+	return ret;
+}
+
+ssize_t raw_image__read_async(struct disk_image *disk, u64 sector,
+			      const struct iovec *iov, int iovcount, void *param)
+{
+	u64 offset = sector << SECTOR_SHIFT;
+
+	if (disk->async && disk_extent__read_is_hole(disk, sector, iov, iovcount))
+		return raw_image__read_hole_async(disk, iov, iovcount, param);
+
+	if (disk->async && disk_bounce__needed(disk, sector, iov, iovcount))
+		return raw_image__bounce_async(disk, DISK_IO_READ, sector, iov,
+					       iovcount, param);
+
+#ifdef CONFIG_HAS_IO_URING
+	if (disk->uring)
+		return disk_uring_read(disk, offset, iov, iovcount, param);
+#endif
+#ifdef CONFIG_HAS_AIO
+	if (disk->async)
+		return disk_aio_read(disk, offset, iov, iovcount, param);
+#endif
+	return raw_image__read_sync(disk, sector, iov, iovcount, param);
+}
+
+ssize_t raw_image__write_async(struct disk_image *disk, u64 sector,
+			       const struct iovec *iov, int iovcount, void *param)
+{
+	u64 offset = sector << SECTOR_SHIFT;
+
+	if (disk->async)
+		disk_extent__write(disk, sector, iov, iovcount);
+
+	if (disk->async && disk_bounce__needed(disk, sector, iov, iovcount))
+		return raw_image__bounce_async(disk, DISK_IO_WRITE, sector, iov,
+					       iovcount, param);
+
+#ifdef CONFIG_HAS_IO_URING
+	if (disk->uring)
+		return disk_uring_write(disk, offset, iov, iovcount, param);
+#endif
+#ifdef CONFIG_HAS_AIO
+	if (disk->async)
+		return disk_aio_write(disk, offset, iov, iovcount, param);
+#endif
+	return raw_image__write_sync(disk, sector, iov, iovcount, param);
+}
+
+static int raw_image__submit_engine(struct disk_image *disk,
+				    struct disk_io *ios, int nr)
+{
+#ifdef CONFIG_HAS_IO_URING
+	if (disk->uring)
+		return disk_uring_submit_batch(disk, ios, nr);
+#endif
+#ifdef CONFIG_HAS_AIO
+	if (disk->async)
+		return disk_aio_submit_batch(disk, ios, nr);
+#endif
+	return -ENOSYS;
+}
+
+int raw_image__submit_batch(struct disk_image *disk, struct disk_io *ios, int nr)
+{
+	struct disk_io *io, tmp;
+	int i, done = 0;
+	ssize_t ret;
+	int r;
+
+	/*
+	 * Complete the reads of holes and the requests that need bouncing, and
+	 * move them to the front.
+	 */
+	if (disk->bounce || disk->extents) {
+		for (i = 0; i < nr; i++) {
+			io = &ios[i];
+
+			if (io->type == DISK_IO_WRITE)
+				disk_extent__write(disk, io->sector, io->iov,
+						   io->iovcount);
+
+			if (io->type == DISK_IO_READ &&
+			    disk_extent__read_is_hole(disk, io->sector, io->iov,
+						      io->iovcount))
+				ret = raw_image__read_hole_async(disk, io->iov,
+								 io->iovcount,
+								 io->param);
+			else if (disk_bounce__needed(disk, io->sector, io->iov,
+						     io->iovcount))
+				ret = raw_image__bounce_async(disk, io->type,
+							      io->sector, io->iov,
+							      io->iovcount,
+							      io->param);
+			else
+				continue;
+
+			if (ret < 0)
+				disk->disk_req_cb(io->param, ret);
+
+			tmp		= ios[done];
+			ios[done]	= *io;
+			*io		= tmp;
+			done++;
+		}
+
+		if (done == nr)
+			return nr;
+	}
+
+	r = raw_image__submit_engine(disk, ios + done, nr - done);
+	if (r < 0)
+		return done ? done : r;
+
+	return done + r;
+}
+
+int raw_image__wait(struct disk_image *disk)
+{
+#ifdef CONFIG_HAS_IO_URING
+	if (disk->uring)
+		return disk_uring_wait(disk);
+#endif
+#ifdef CONFIG_HAS_AIO
+	if (disk->async)
+		return disk_aio_wait(disk);
+#endif
+	return 0;
+}
+#endif /* DISK_IMAGE_HAS_ASYNC */
+
+int raw_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors)
+{
+	if (fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      sector << SECTOR_SHIFT, nr_sectors << SECTOR_SHIFT) < 0)
+		return -errno;
+
+	if (disk->extents)
+		disk_extent__mark_zero(disk, sector << SECTOR_SHIFT,
+				       nr_sectors << SECTOR_SHIFT);
+
+	return 0;
+}
+
+/* Last resort for file systems that can't zero a range by themselves */
+static int raw_image__write_zeroes_sync(struct disk_image *disk, u64 offset,
+					u64 len)
+{
+	/* Aligned for disks opened with O_DIRECT */
+	static const u8 zeroes[64 * 1024] __attribute__((aligned(4096)));
+	struct iovec iov = { .iov_base = (void *)zeroes };
+
+	while (len) {
+		iov.iov_len = min_t(u64, len, sizeof(zeroes));
+		if (pwritev_in_full(disk->fd, &iov, 1, offset) < 0)
+			return -errno;
+
+		offset	+= iov.iov_len;
+		len	-= iov.iov_len;
+	}
+
+	return 0;
+}
+
+int raw_image__write_zeroes(struct disk_image *disk, u64 sector, u64 nr_sectors,
+			    bool unmap)
+{
+	u64 offset = sector << SECTOR_SHIFT;
+	u64 len = nr_sectors << SECTOR_SHIFT;
+	int r;
+
+	/* A hole reads back as zeroes */
+	if (unmap && !fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE |
+				FALLOC_FL_KEEP_SIZE, offset, len)) {
+		r = 0;
+		goto out;
+	}
+
+	if (!fallocate(disk->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+		       offset, len)) {
+		r = 0;
+		goto out;
+	}
+
+	if (errno != EOPNOTSUPP)
+		return -errno;
+
+	r = raw_image__write_zeroes_sync(disk, offset, len);
+out:
+	if (!r && disk->extents)
+		disk_extent__mark_zero(disk, offset, len);
+
+	return r;
+}
+
 ssize_t raw_image__read_mmap(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param)
 {
@@ -65,24 +304,37 @@ int raw_image__close(struct disk_image *disk)
  * multiple buffer based disk image operations
  */
 static struct disk_image_operations raw_image_regular_ops = {
-	.read	= raw_image__read,
-	.write	= raw_image__write,
-	.wait	= raw_image__wait,
-	.async	= true,
+	.read		= raw_image__read,
+	.write		= raw_image__write,
+	.submit_batch	= raw_image__batch,
+	.discard	= raw_image__discard,
+	.write_zeroes	= raw_image__write_zeroes,
+	.wait		= raw_image__wait,
+	.async		= true,
 };
 
 struct disk_image_operations ro_ops = {
-	.read	= raw_image__read_mmap,
-	.write	= raw_image__write_mmap,
-	.close	= raw_image__close,
+	.read		= raw_image__read_mmap,
+	.write		= raw_image__write_mmap,
+	.close		= raw_image__close,
 };
 
 struct disk_image_operations ro_ops_nowrite = {
-	.read	= raw_image__read,
-	.wait	= raw_image__wait,
-	.async	= true,
+	.read		= raw_image__read,
+	.wait		= raw_image__wait,
+	.async		= true,
 };
 
+/* Not being able to skip holes only costs time */
+static void raw_image__setup_extents(struct disk_image *disk)
+{
+	if (IS_ERR_OR_NULL(disk))
+		return;
+
+	if (disk_extent__setup(disk) < 0)
+		pr_warning("Not tracking the holes of the disk image");
+}
+
 struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly)
 {
 	if (readonly) {
@@ -95,6 +347,7 @@ struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly)
 		disk = disk_image__new(fd, st->st_size, &ro_ops, DISK_IMAGE_MMAP);
 		if (IS_ERR_OR_NULL(disk)) {
 			disk = disk_image__new(fd, st->st_size, &ro_ops_nowrite, DISK_IMAGE_REGULAR);
+			raw_image__setup_extents(disk);
 		}
 
 		return disk;
@@ -102,6 +355,11 @@ struct disk_image *raw_image__probe(int fd, struct stat *st, bool readonly)
 		/*
 		 * Use read/write instead of mmap
 		 */
-		return disk_image__new(fd, st->st_size, &raw_image_regular_ops, DISK_IMAGE_REGULAR);
+		struct disk_image *disk;
+
+		disk = disk_image__new(fd, st->st_size, &raw_image_regular_ops, DISK_IMAGE_REGULAR);
+		raw_image__setup_extents(disk);
+
+		return disk;
 	}
 }
@@ -0,0 +1,56 @@
+#include "kvm/disk-image.h"
+
+#include <linux/kernel.h>
+#include <time.h>
+
+/*
+ * Request counters of a disk, updated by the disk user as requests start and
+ * complete. Completions may be reported by several threads, hence the atomics.
+ */
+
+u64 disk_stats__now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Returns the start time to pass to disk_stats__end() */
+u64 disk_stats__start(struct disk_image *disk)
+{
+	__sync_fetch_and_add(&disk->stats.inflight, 1);
+
+	return disk_stats__now();
+}
+
+/*
+ * Account a request of type @op, one of DISK_STAT_*, or a negative value for
+ * requests that only count as in flight.
+ */
+void disk_stats__end(struct disk_image *disk, int op, size_t bytes,
+		     u64 start, u64 now, bool error)
+{
+	struct disk_stat_op *s;
+	u64 lat = now - start;
+	int bucket;
+
+	__sync_fetch_and_sub(&disk->stats.inflight, 1);
+
+	if (op < 0)
+		return;
+
+	s = &disk->stats.ops[op];
+	if (error) {
+		__sync_fetch_and_add(&s->errors, 1);
+		return;
+	}
+
+	bucket = min_t(int, fls_long(lat / 1000), DISK_STAT_LAT_BUCKETS - 1);
+
+	__sync_fetch_and_add(&s->count, 1);
+	__sync_fetch_and_add(&s->bytes, bytes);
+	__sync_fetch_and_add(&s->lat_total, lat);
+	__sync_fetch_and_add(&s->lat_hist[bucket], 1);
+}
@@ -0,0 +1,230 @@
+#include "kvm/disk-image.h"
+#include "kvm/mutex.h"
+
+#include <linux/kernel.h>
+#include <limits.h>
+
+/*
+ * Token buckets limiting the rate of reads and writes of a disk. A request
+ * takes one token from the IOPS bucket of its direction and as many tokens as
+ * it has bytes from the bandwidth bucket. Requests are only admitted when
+ * every bucket they draw from holds at least one token, so a large request can
+ * leave a bandwidth bucket in debt, which later requests then have to wait
+ * out. Callers delay the requests that are turned down rather than failing
+ * them.
+ */
+#define NSEC_PER_SEC			1000000000ULL
+
+/* Longest delay handed out, so that new limits are picked up quickly */
+#define DISK_THROTTLE_MAX_DELAY		NSEC_PER_SEC
+
+struct disk_throttle_bucket {
+	u64			rate;
+	u64			burst;
+	/* Tokens available, negative while in debt */
+	s64			level;
+	/* Time up to which tokens have been credited */
+	u64			last;
+};
+
+struct disk_throttle {
+	struct mutex		lock;
+	struct disk_throttle_bucket buckets[DISK_THROTTLE_NR];
+};
+
+static const char * const disk_throttle_names[DISK_THROTTLE_NR] = {
+	[DISK_THROTTLE_IOPS_RD]	= "iops_rd",
+	[DISK_THROTTLE_IOPS_WR]	= "iops_wr",
+	[DISK_THROTTLE_BPS_RD]	= "bps_rd",
+	[DISK_THROTTLE_BPS_WR]	= "bps_wr",
+};
+
+/*
+ * Whole tokens earned at @rate per second over @elapsed nanoseconds, saturated
+ * instead of overflowing. The fraction of a second is split along @rate, so
+ * that no product can exceed 64 bits.
+ */
+static u64 disk_throttle__tokens(u64 elapsed, u64 rate)
+{
+	u64 ns = elapsed % NSEC_PER_SEC;
+	u64 tokens, part;
+
+	if (__builtin_mul_overflow(elapsed / NSEC_PER_SEC, rate, &tokens))
+		return ULLONG_MAX;
+
+	part = ns * (rate / NSEC_PER_SEC) +
+	       ns * (rate % NSEC_PER_SEC) / NSEC_PER_SEC;
+	if (__builtin_add_overflow(tokens, part, &tokens))
+		return ULLONG_MAX;
+
+	return tokens;
+}
+
+static void disk_throttle__refill(struct disk_throttle_bucket *b, u64 now)
+{
+	u64 elapsed = now - b->last;
+	u64 credit, elapsed_remainder;
+
+	credit = disk_throttle__tokens(elapsed, b->rate);
+	if (credit >= b->burst - b->level) {
+		b->level = b->burst;
+		b->last = now;
+		return;
+	}
+
+	/*
+	 * Keep the fraction of a token earned since the last one: the time it
+	 * took is (elapsed * rate) % NSEC_PER_SEC / rate.
+	 */
+	elapsed_remainder = elapsed % NSEC_PER_SEC * (b->rate % NSEC_PER_SEC) %
+			    NSEC_PER_SEC / b->rate;
+
+	b->level += credit;
+	b->last += elapsed - elapsed_remainder;
+}
+
+/* Time until the bucket holds a token again */
+static u64 disk_throttle__wait(struct disk_throttle_bucket *b)
+{
+	u64 missing = 1 - b->level;
+
+	return DIV_ROUND_UP(missing * NSEC_PER_SEC, b->rate);
+}
+
+/*
+ * Charge a read or write of @len bytes to the buckets of @disk. Returns 0 if
+ * the request may go ahead, or else the number of nanoseconds to wait before
+ * trying again, in which case nothing was charged.
+ */
+u64 disk_throttle__admit(struct disk_image *disk, int type, size_t len)
+{
+	struct disk_throttle *t;
+	struct disk_throttle_bucket *iops, *bps;
+	u64 now, delay = 0;
+
+	t = __atomic_load_n(&disk->throttle, __ATOMIC_ACQUIRE);
+	if (!t)
+		return 0;
+
+	if (type == DISK_IO_WRITE) {
+		iops	= &t->buckets[DISK_THROTTLE_IOPS_WR];
+		bps	= &t->buckets[DISK_THROTTLE_BPS_WR];
+	} else {
+		iops	= &t->buckets[DISK_THROTTLE_IOPS_RD];
+		bps	= &t->buckets[DISK_THROTTLE_BPS_RD];
+	}
+
+	mutex_lock(&t->lock);
+
+	now = disk_stats__now();
+	if (iops->rate) {
+		disk_throttle__refill(iops, now);
+		if (iops->level < 1)
+			delay = disk_throttle__wait(iops);
+	}
+	if (bps->rate) {
+		disk_throttle__refill(bps, now);
+		if (bps->level < 1)
+			delay = max(delay, disk_throttle__wait(bps));
+	}
+
+	if (!delay) {
+		if (iops->rate)
+			iops->level -= 1;
+		if (bps->rate)
+			bps->level -= len;
+	}
+
+	mutex_unlock(&t->lock);
+
+	return min_t(u64, delay, DISK_THROTTLE_MAX_DELAY);
+}
+
+/*
+ * Replace the limits of @disk. Buckets whose limits change start out full.
+ * Can be called while the disk is in use.
+ */
+int disk_throttle__set(struct disk_image *disk,
+		       const struct disk_throttle_limits *limits)
+{
+	struct disk_throttle *t = disk->throttle;
+	struct disk_throttle_bucket *b;
+	u64 now, burst;
+	int i;
+
+	if (!t) {
+		for (i = 0; i < DISK_THROTTLE_NR; i++) {
+			if (limits->rate[i])
+				break;
+		}
+		if (i == DISK_THROTTLE_NR)
+			return 0;
+
+		t = calloc(1, sizeof(*t));
+		if (!t)
+			return -ENOMEM;
+		mutex_init(&t->lock);
+		/* The workers may be admitting requests already */
+		__atomic_store_n(&disk->throttle, t, __ATOMIC_RELEASE);
+	}
+
+	mutex_lock(&t->lock);
+
+	now = disk_stats__now();
+	for (i = 0; i < DISK_THROTTLE_NR; i++) {
+		b = &t->buckets[i];
+		burst = limits->burst[i] ?: limits->rate[i];
+
+		if (b->rate == limits->rate[i] && b->burst == burst)
+			continue;
+
+		*b = (struct disk_throttle_bucket) {
+			.rate	= limits->rate[i],
+			.burst	= burst,
+			.level	= burst,
+			.last	= now,
+		};
+	}
+
+	mutex_unlock(&t->lock);
+
+	return 0;
+}
+
+void disk_throttle__destroy(struct disk_image *disk)
+{
+	free(disk->throttle);
+	disk->throttle = NULL;
+}
+
+/*
+ * Parse one "<bucket>=<rate>" or "<bucket>_burst=<tokens>" disk option, which
+ * ends at the next comma. Returns -ENOENT if @arg isn't a throttling option,
+ * or -EINVAL if its value isn't a number.
+ */
+int disk_throttle__parse_option(struct disk_throttle_limits *limits,
+				const char *arg)
+{
+	const char *name;
+	size_t len;
+	int i;
+
+	for (i = 0; i < DISK_THROTTLE_NR; i++) {
+		name = disk_throttle_names[i];
+		len = strlen(name);
+
+		if (strncmp(arg, name, len))
+			continue;
+
+		if (arg[len] == '=')
+			return disk_image__parse_value(arg + len + 1, 0,
+						       ULLONG_MAX,
+						       &limits->rate[i]);
+		if (strncmp(arg + len, "_burst=", 7) == 0)
+			return disk_image__parse_value(arg + len + 7, 0,
+						       ULLONG_MAX,
+						       &limits->burst[i]);
+	}
+
+	return -ENOENT;
+}
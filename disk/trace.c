@@ -0,0 +1,326 @@
+#include "kvm/disk-image.h"
+#include "kvm/kvm.h"
+#include "kvm/mutex.h"
+
+#include <linux/byteorder.h>
+#include <linux/kernel.h>
+#include <pthread.h>
+
+/*
+ * Boot traces. The first boot with a trace file records the ranges read from
+ * the disk during the first seconds, and saves them sorted and merged. Later
+ * boots read the file back and prefetch those ranges into the page cache from
+ * a background thread, turning the scattered small reads of the guest into a
+ * few large sequential ones. Delete the file to record a new trace.
+ *
+ * Only images whose sectors map directly to offsets in their file can be
+ * prefetched, and the page cache is of no use to direct I/O.
+ */
+#define DISK_TRACE_MAGIC		"LKVMTRC"
+#define DISK_TRACE_VERSION		1
+#define DISK_TRACE_MAX_EXTENTS		65536
+#define DISK_TRACE_DEFAULT_SECS		10
+/* Ranges closer than this are prefetched as one */
+#define DISK_TRACE_GAP			(256 * 1024)
+
+#define NSEC_PER_SEC			1000000000ULL
+
+/* On disk, little endian */
+struct disk_trace_header {
+	char				magic[8];
+	u32				version;
+	u32				nr_extents;
+};
+
+struct disk_trace_extent {
+	u64				sector;
+	u32				nr_sectors;
+	u32				pad;
+};
+
+struct disk_trace {
+	const char			*filename;
+	struct mutex			lock;
+	struct disk_trace_extent	*extents;
+	u32				nr_extents;
+	/* Recording until then, if set */
+	u64				deadline;
+	bool				recording;
+	pthread_t			replay_thread;
+	bool				replaying;
+	bool				stop;
+};
+
+static int disk_trace__cmp(const void *a, const void *b)
+{
+	const struct disk_trace_extent *ea = a, *eb = b;
+
+	if (ea->sector != eb->sector)
+		return ea->sector < eb->sector ? -1 : 1;
+
+	return 0;
+}
+
+/* Sort and merge the extents in place, returns how many are left */
+static u32 disk_trace__merge(struct disk_trace_extent *extents, u32 nr)
+{
+	struct disk_trace_extent *last;
+	u64 end;
+	u32 i, n;
+
+	if (!nr)
+		return 0;
+
+	qsort(extents, nr, sizeof(*extents), disk_trace__cmp);
+
+	for (i = 1, n = 1; i < nr; i++) {
+		last = &extents[n - 1];
+		if (extents[i].sector > last->sector + last->nr_sectors) {
+			extents[n++] = extents[i];
+			continue;
+		}
+
+		end = max(last->sector + last->nr_sectors,
+			  extents[i].sector + extents[i].nr_sectors);
+		last->nr_sectors = end - last->sector;
+	}
+
+	return n;
+}
+
+/* Written to a temporary file first, so that a crash leaves no partial trace */
+static int disk_trace__save(const char *filename,
+			    struct disk_trace_extent *extents, u32 nr)
+{
+	struct disk_trace_header hdr = {
+		.magic		= DISK_TRACE_MAGIC,
+		.version	= cpu_to_le32(DISK_TRACE_VERSION),
+	};
+	char tmp[PATH_MAX];
+	int fd, r = 0;
+	u32 i;
+
+	nr = disk_trace__merge(extents, nr);
+	hdr.nr_extents = cpu_to_le32(nr);
+	for (i = 0; i < nr; i++) {
+		extents[i].sector	= cpu_to_le64(extents[i].sector);
+		extents[i].nr_sectors	= cpu_to_le32(extents[i].nr_sectors);
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	if (write_in_full(fd, &hdr, sizeof(hdr)) < 0 ||
+	    write_in_full(fd, extents, nr * sizeof(*extents)) < 0 ||
+	    fsync(fd) < 0)
+		r = -errno;
+	close(fd);
+
+	if (!r && rename(tmp, filename) < 0)
+		r = -errno;
+	if (r)
+		unlink(tmp);
+	else
+		pr_info("Recorded %u ranges in boot trace '%s'", nr, filename);
+
+	return r;
+}
+
+/* Stop recording and save the trace. Called with t->lock held. */
+static void disk_trace__finish(struct disk_trace *t)
+{
+	t->recording = false;
+
+	if (disk_trace__save(t->filename, t->extents, t->nr_extents) < 0)
+		pr_warning("Failed to save boot trace '%s'", t->filename);
+
+	free(t->extents);
+	t->extents = NULL;
+	t->nr_extents = 0;
+}
+
+/* Note a read of @len bytes at @sector, done before it reaches the image */
+void disk_trace__read(struct disk_image *disk, u64 sector, size_t len)
+{
+	struct disk_trace *t = disk->trace;
+	struct disk_trace_extent *last;
+	u32 nr_sectors = DIV_ROUND_UP(len, SECTOR_SIZE);
+
+	if (!t->recording || !len)
+		return;
+
+	mutex_lock(&t->lock);
+
+	if (!t->recording)
+		goto out;
+
+	if (disk_stats__now() >= t->deadline ||
+	    t->nr_extents == DISK_TRACE_MAX_EXTENTS) {
+		disk_trace__finish(t);
+		goto out;
+	}
+
+	/* Sequential reads are common enough to be worth folding right away */
+	last = t->nr_extents ? &t->extents[t->nr_extents - 1] : NULL;
+	if (last && last->sector + last->nr_sectors == sector &&
+	    last->nr_sectors + nr_sectors > last->nr_sectors) {
+		last->nr_sectors += nr_sectors;
+		goto out;
+	}
+
+	t->extents[t->nr_extents++] = (struct disk_trace_extent) {
+		.sector		= sector,
+		.nr_sectors	= nr_sectors,
+	};
+out:
+	mutex_unlock(&t->lock);
+}
+
+static void *disk_trace__replay(void *arg)
+{
+	struct disk_image *disk = arg;
+	struct disk_trace *t = disk->trace;
+	u64 start, end, next;
+	u32 i = 0;
+
+	kvm__set_thread_name("disk-prefetch");
+
+	while (i < t->nr_extents && !t->stop) {
+		start	= t->extents[i].sector << SECTOR_SHIFT;
+		end	= (t->extents[i].sector + t->extents[i].nr_sectors) <<
+			  SECTOR_SHIFT;
+
+		for (i++; i < t->nr_extents; i++) {
+			next = t->extents[i].sector << SECTOR_SHIFT;
+			if (next > end + DISK_TRACE_GAP)
+				break;
+			end = max(end, (t->extents[i].sector +
+					t->extents[i].nr_sectors) << SECTOR_SHIFT);
+		}
+
+		if (start >= disk->size)
+			break;
+		end = min(end, disk->size);
+
+		if (readahead(disk->fd, start, end - start) < 0) {
+			pr_warning("Prefetching '%s' failed", t->filename);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int disk_trace__load(struct disk_trace *t, int fd)
+{
+	struct disk_trace_header hdr;
+	u32 i;
+
+	if (read_in_full(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    memcmp(hdr.magic, DISK_TRACE_MAGIC, sizeof(hdr.magic)) ||
+	    le32_to_cpu(hdr.version) != DISK_TRACE_VERSION ||
+	    le32_to_cpu(hdr.nr_extents) > DISK_TRACE_MAX_EXTENTS)
+		return -EINVAL;
+
+	t->nr_extents = le32_to_cpu(hdr.nr_extents);
+	t->extents = calloc(t->nr_extents, sizeof(*t->extents));
+	if (!t->extents)
+		return -ENOMEM;
+
+	if (read_in_full(fd, t->extents, t->nr_extents * sizeof(*t->extents)) !=
+	    (ssize_t)(t->nr_extents * sizeof(*t->extents)))
+		return -EINVAL;
+
+	for (i = 0; i < t->nr_extents; i++) {
+		t->extents[i].sector	= le64_to_cpu(t->extents[i].sector);
+		t->extents[i].nr_sectors = le32_to_cpu(t->extents[i].nr_sectors);
+	}
+
+	return 0;
+}
+
+int disk_trace__setup(struct disk_image *disk, struct disk_image_params *params)
+{
+	struct disk_trace *t;
+	int fd, r;
+
+	if (!disk->flat || params->direct) {
+		pr_warning("Boot traces are only used with raw images, without direct I/O");
+		return 0;
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return -ENOMEM;
+
+	t->filename = params->boot_trace;
+	mutex_init(&t->lock);
+
+	fd = open(t->filename, O_RDONLY);
+	if (fd < 0 && errno != ENOENT) {
+		r = -errno;
+		goto err_free;
+	}
+
+	if (fd < 0) {
+		t->extents = calloc(DISK_TRACE_MAX_EXTENTS, sizeof(*t->extents));
+		if (!t->extents) {
+			r = -ENOMEM;
+			goto err_free;
+		}
+		t->deadline = disk_stats__now() + NSEC_PER_SEC *
+			      (params->boot_trace_secs ?: DISK_TRACE_DEFAULT_SECS);
+		t->recording = true;
+		disk->trace = t;
+		return 0;
+	}
+
+	r = disk_trace__load(t, fd);
+	close(fd);
+	if (r) {
+		pr_err("'%s' isn't a boot trace", t->filename);
+		goto err_free;
+	}
+
+	disk->trace = t;
+
+	r = pthread_create(&t->replay_thread, NULL, disk_trace__replay, disk);
+	if (r) {
+		disk->trace = NULL;
+		r = -r;
+		goto err_free;
+	}
+	t->replaying = true;
+
+	return 0;
+
+err_free:
+	free(t->extents);
+	free(t);
+	return r;
+}
+
+/* Saves what was recorded so far if the guest exits early */
+void disk_trace__destroy(struct disk_image *disk)
+{
+	struct disk_trace *t = disk->trace;
+
+	if (!t)
+		return;
+
+	if (t->replaying) {
+		t->stop = true;
+		pthread_join(t->replay_thread, NULL);
+	}
+
+	mutex_lock(&t->lock);
+	if (t->recording)
+		disk_trace__finish(t);
+	mutex_unlock(&t->lock);
+
+	free(t->extents);
+	free(t);
+	disk->trace = NULL;
+}
@@ -0,0 +1,270 @@
+#include <liburing.h>
+#include <sys/eventfd.h>
+
+#include "kvm/disk-image.h"
+#include "kvm/mutex.h"
+#include "kvm/kvm.h"
+
+#define URING_ENTRIES		256
+#define URING_MAX_CQES		256
+/* How long the SQPOLL kernel thread spins before going to sleep */
+#define URING_SQ_IDLE_MS	1000
+
+/*
+ * The image fd is registered as fixed file 0, which saves the kernel an fget()
+ * and fput() per request and is required for SQPOLL on older kernels.
+ */
+#define URING_FIXED_FD		0
+
+/* Called with reap_lock held */
+static void uring_reap_locked(struct disk_image *disk)
+{
+	struct io_uring_cqe *cqes[URING_MAX_CQES];
+	unsigned int nr, i;
+
+	do {
+		nr = io_uring_peek_batch_cqe(&disk->ring, cqes, ARRAY_SIZE(cqes));
+		for (i = 0; i < nr; i++)
+			disk->disk_req_cb(io_uring_cqe_get_data(cqes[i]),
+					  cqes[i]->res);
+
+		io_uring_cq_advance(&disk->ring, nr);
+		if (nr)
+			disk_image__io_done(disk, nr);
+	} while (nr > 0);
+}
+
+/*
+ * Reap unless someone else is. That is a drain, which kicks disk->evt once it
+ * is done.
+ */
+static void uring_try_reap(struct disk_image *disk)
+{
+	if (!mutex_trylock(&disk->reap_lock))
+		return;
+
+	uring_reap_locked(disk);
+	mutex_unlock(&disk->reap_lock);
+
+	/* The drain may have been waiting for us to let go of the CQ */
+	disk_image__drain_wake(disk);
+}
+
+/*
+ * Push the queued SQEs to the kernel, until it has consumed all of them: they
+ * can't be taken back, and their callers expect them to complete. The only
+ * transient failures are a full completion ring or a lack of kernel resources:
+ * make room by reaping what has completed so far and try again. Anything else
+ * means the ring itself is broken. With SQPOLL, the kernel thread consumes the
+ * SQEs by itself. Called with ring_lock held.
+ */
+static void uring_submit_locked(struct disk_image *disk)
+{
+	int ret;
+
+	do {
+		ret = io_uring_submit(&disk->ring);
+		if (ret == -EBUSY || ret == -EAGAIN)
+			uring_try_reap(disk);
+		else if (ret < 0 && ret != -EINTR)
+			die("io_uring submission failed: %s", strerror(-ret));
+	} while (!(disk->ring.flags & IORING_SETUP_SQPOLL) &&
+		 io_uring_sq_ready(&disk->ring));
+}
+
+static struct io_uring_sqe *uring_get_sqe_locked(struct disk_image *disk)
+{
+	struct io_uring_sqe *sqe;
+
+	while (!(sqe = io_uring_get_sqe(&disk->ring)))
+		uring_submit_locked(disk);
+
+	return sqe;
+}
+
+/* Called with ring_lock held */
+static void uring_queue_locked(struct disk_image *disk, int type, u64 offset,
+			       const struct iovec *iov, int iovcount,
+			       void *param)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe_locked(disk);
+
+	if (type == DISK_IO_FLUSH)
+		io_uring_prep_fsync(sqe, URING_FIXED_FD, IORING_FSYNC_DATASYNC);
+	else if (type == DISK_IO_WRITE)
+		io_uring_prep_writev(sqe, URING_FIXED_FD, iov, iovcount, offset);
+	else
+		io_uring_prep_readv(sqe, URING_FIXED_FD, iov, iovcount, offset);
+	io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	io_uring_sqe_set_data(sqe, param);
+
+	/*
+	 * Account the request before the kernel can see it, so that a
+	 * concurrent reaper never observes the counter going below zero.
+	 */
+	__sync_fetch_and_add(&disk->aio_inflight, 1);
+}
+
+static ssize_t uring_rw(struct disk_image *disk, int type, u64 offset,
+			const struct iovec *iov, int iovcount, void *param)
+{
+	mutex_lock(&disk->ring_lock);
+	uring_queue_locked(disk, type, offset, iov, iovcount, param);
+	uring_submit_locked(disk);
+	mutex_unlock(&disk->ring_lock);
+
+	return 0;
+}
+
+ssize_t disk_uring_read(struct disk_image *disk, u64 offset,
+			const struct iovec *iov, int iovcount, void *param)
+{
+	return uring_rw(disk, DISK_IO_READ, offset, iov, iovcount, param);
+}
+
+ssize_t disk_uring_write(struct disk_image *disk, u64 offset,
+			 const struct iovec *iov, int iovcount, void *param)
+{
+	return uring_rw(disk, DISK_IO_WRITE, offset, iov, iovcount, param);
+}
+
+/*
+ * Fill one SQE per request and publish them all with a single submission. If
+ * the SQ ring fills up on the way, what is queued so far is pushed first. The
+ * kernel takes all the requests.
+ */
+int disk_uring_submit_batch(struct disk_image *disk, struct disk_io *ios, int nr)
+{
+	int i;
+
+	mutex_lock(&disk->ring_lock);
+
+	for (i = 0; i < nr; i++)
+		uring_queue_locked(disk, ios[i].type,
+				   ios[i].sector << SECTOR_SHIFT,
+				   ios[i].iov, ios[i].iovcount, ios[i].param);
+
+	if (nr)
+		uring_submit_locked(disk);
+
+	mutex_unlock(&disk->ring_lock);
+
+	return nr;
+}
+
+/*
+ * Called by the disk user when disk->evt fires. Completions are processed on
+ * the calling thread instead of a dedicated one, so the request callback runs
+ * right where the next requests are going to be submitted from.
+ */
+void disk_uring_reap(struct disk_image *disk)
+{
+	u64 dummy;
+
+	if (read(disk->evt, &dummy, sizeof(dummy)) < 0 && errno != EAGAIN)
+		return;
+
+	uring_try_reap(disk);
+}
+
+/*
+ * When this function returns there are no in-flight I/O. As with libaio, the
+ * disk user normally reaps the completions and wakes us up as it goes, and we
+ * block for them ourselves whenever it isn't reaping. Only the CQ is touched,
+ * so submissions don't stall meanwhile.
+ *
+ * Returns the number of I/O that were in-flight when the function was called.
+ */
+int disk_uring_wait(struct disk_image *disk)
+{
+	struct io_uring_cqe *cqe;
+	u64 inflight = disk->aio_inflight;
+	u64 data = 1;
+	int r = 0;
+
+	mutex_lock(&disk->drain_lock);
+	while (disk->aio_inflight && r >= 0) {
+		if (!mutex_trylock(&disk->reap_lock)) {
+			pthread_cond_wait(&disk->drain_cond, &disk->drain_lock.mutex);
+			continue;
+		}
+		mutex_unlock(&disk->drain_lock);
+
+		while (disk->aio_inflight) {
+			r = io_uring_wait_cqe(&disk->ring, &cqe);
+			if (r < 0 && r != -EINTR)
+				break;
+			uring_reap_locked(disk);
+		}
+
+		mutex_unlock(&disk->reap_lock);
+
+		/* Completions the disk user skipped while we held the CQ */
+		if (disk->aio_inflight &&
+		    write(disk->evt, &data, sizeof(data)) < 0)
+			pr_warning("Failed to kick the disk completions");
+
+		mutex_lock(&disk->drain_lock);
+	}
+	mutex_unlock(&disk->drain_lock);
+
+	return inflight;
+}
+
+int disk_uring_setup(struct disk_image *disk, bool sqpoll)
+{
+	struct io_uring_params params = { };
+	int r;
+
+	if (sqpoll) {
+		params.flags		|= IORING_SETUP_SQPOLL;
+		params.sq_thread_idle	= URING_SQ_IDLE_MS;
+	}
+
+	r = io_uring_queue_init_params(URING_ENTRIES, &disk->ring, &params);
+	if (r < 0 && sqpoll) {
+		pr_warning("io_uring SQPOLL unavailable (%d), using regular submission", r);
+		params = (struct io_uring_params) { };
+		r = io_uring_queue_init_params(URING_ENTRIES, &disk->ring, &params);
+	}
+	if (r < 0)
+		return r;
+
+	r = io_uring_register_files(&disk->ring, &disk->fd, 1);
+	if (r < 0)
+		goto err_exit_ring;
+
+	disk->evt = eventfd(0, EFD_NONBLOCK);
+	if (disk->evt < 0) {
+		r = -errno;
+		goto err_exit_ring;
+	}
+
+	r = io_uring_register_eventfd(&disk->ring, disk->evt);
+	if (r < 0)
+		goto err_close_evt;
+
+	mutex_init(&disk->ring_lock);
+	disk->uring = true;
+	disk->async = true;
+
+	return 0;
+
+err_close_evt:
+	close(disk->evt);
+err_exit_ring:
+	io_uring_queue_exit(&disk->ring);
+	return r;
+}
+
+void disk_uring_destroy(struct disk_image *disk)
+{
+	if (!disk->uring)
+		return;
+
+	io_uring_queue_exit(&disk->ring);
+	close(disk->evt);
+	/* The image may still be written back synchronously when closed */
+	disk->uring = false;
+	disk->async = false;
+}
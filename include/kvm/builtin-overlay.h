@@ -0,0 +1,9 @@
+#ifndef KVM__OVERLAY_H
+#define KVM__OVERLAY_H
+
+#include <kvm/util.h>
+
+int kvm_cmd_overlay(int argc, const char **argv, const char *prefix);
+void kvm_overlay_help(void) NORETURN;
+
+#endif
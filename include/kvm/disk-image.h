@@ -22,6 +22,15 @@
 #ifdef CONFIG_HAS_AIO
 #include <libaio.h>
 #endif
+#ifdef CONFIG_HAS_IO_URING
+#include <liburing.h>
+#endif
+
+#if defined(CONFIG_HAS_AIO) || defined(CONFIG_HAS_IO_URING)
+#define DISK_IMAGE_HAS_ASYNC
+#include <pthread.h>
+#include "kvm/mutex.h"
+#endif
 
 #define SECTOR_SHIFT		9
 #define SECTOR_SIZE		(1UL << SECTOR_SHIFT)
@@ -31,16 +40,126 @@ enum {
 	DISK_IMAGE_MMAP,
 };
 
-#define MAX_DISK_IMAGES         4
+#define MAX_DISK_IMAGES         64
+
+enum {
+	DISK_IO_READ,
+	DISK_IO_WRITE,
+	DISK_IO_FLUSH,
+};
+
+/*
+ * One read, write or flush request, as handed to disk_image__submit_batch().
+ * Completion is reported through the disk callback with 'param'. A flush has
+ * no sector or iovec, and doesn't wait for the requests still in flight.
+ */
+struct disk_io {
+	int				type;
+	u64				sector;
+	const struct iovec		*iov;
+	int				iovcount;
+	void				*param;
+};
 
 struct disk_image;
+struct disk_bounce_pool;
+struct disk_throttle;
+struct disk_extent_map;
+struct disk_overlay;
+struct disk_trace;
+
+enum {
+	DISK_STAT_READ,
+	DISK_STAT_WRITE,
+	DISK_STAT_FLUSH,
+	DISK_STAT_NR,
+};
+
+/*
+ * Bucket 0 counts requests that took under a microsecond, bucket i > 0 those
+ * that took [2^(i-1), 2^i) microseconds, and the last one everything longer.
+ */
+#define DISK_STAT_LAT_BUCKETS	25
+
+struct disk_stat_op {
+	u64				count;
+	u64				bytes;
+	u64				errors;
+	/* Nanoseconds, summed over the successful requests */
+	u64				lat_total;
+	u64				lat_hist[DISK_STAT_LAT_BUCKETS];
+};
+
+/*
+ * Counters of a disk. KVM_IPC_DISK_STAT is answered with a u32 number of
+ * disks, followed by as many of these.
+ */
+struct disk_stats {
+	u64				inflight;
+	struct disk_stat_op		ops[DISK_STAT_NR];
+};
+
+/* Token buckets that a disk may be throttled with */
+enum {
+	DISK_THROTTLE_IOPS_RD,
+	DISK_THROTTLE_IOPS_WR,
+	DISK_THROTTLE_BPS_RD,
+	DISK_THROTTLE_BPS_WR,
+	DISK_THROTTLE_NR,
+};
+
+/*
+ * Requests or bytes per second allowed by each bucket, 0 meaning unlimited.
+ * The burst is the most a bucket can hold after idling, one second worth of
+ * rate when left to 0.
+ */
+struct disk_throttle_limits {
+	u64 rate[DISK_THROTTLE_NR];
+	u64 burst[DISK_THROTTLE_NR];
+};
+
+enum {
+	DISK_OVERLAY_COMMIT,
+	DISK_OVERLAY_DISCARD,
+};
+
+/* Payload of KVM_IPC_DISK_OVERLAY, answered with an int status */
+struct disk_overlay_msg {
+	u32				disk;
+	u32				op;
+};
+
+/* Payload of KVM_IPC_DISK_THROTTLE, answered with an int status */
+struct disk_throttle_msg {
+	u32				disk;
+	u32				pad;
+	struct disk_throttle_limits	limits;
+};
 
 struct disk_image_operations {
+	/*
+	 * On an async disk, a request that read or write accepts is completed
+	 * through disk_req_cb. A failed one is only reported by the negative
+	 * return value, and completed by the caller.
+	 */
 	ssize_t (*read)(struct disk_image *disk, u64 sector, const struct iovec *iov,
 			int iovcount, void *param);
 	ssize_t (*write)(struct disk_image *disk, u64 sector, const struct iovec *iov,
 			int iovcount, void *param);
+	/*
+	 * Queue several reads and writes with a single submission. Returns the
+	 * number of requests that were accepted, or a negative error if none
+	 * were. Only used when the disk is async.
+	 */
+	int (*submit_batch)(struct disk_image *disk, struct disk_io *ios, int nr);
 	int (*flush)(struct disk_image *disk);
+	/*
+	 * Deallocate, or zero, a range of sectors. Synchronous; return 0 or a
+	 * negative error.
+	 */
+	int (*discard)(struct disk_image *disk, u64 sector, u64 nr_sectors);
+	int (*write_zeroes)(struct disk_image *disk, u64 sector, u64 nr_sectors,
+			    bool unmap);
 	int (*wait)(struct disk_image *disk);
 	int (*close)(struct disk_image *disk);
 	bool async;
@@ -52,6 +171,26 @@ struct disk_image_params {
 	const char *wwpn;
 	bool readonly;
 	bool direct;
+	bool sqpoll;
+	bool merge;
+	int nr_queues;
+	/* Longest time to busy-poll the virtqueues for, 0 to wait for kicks */
+	u32 poll_us;
+	/* Interrupt coalescing of the virtqueues, see virtio_coalesce__init() */
+	u32 coalesce_usecs;
+	u32 coalesce_frames;
+	/* Number of qcow metadata tables to cache, 0 for the default */
+	int cache_nodes;
+	/* Copy clusters read from a backing file into the qcow image */
+	bool copy_on_read;
+	/* Position in a backing file chain, 0 for the image given by the user */
+	int depth;
+	struct disk_throttle_limits throttle;
+	/* File receiving the writes to a raw image, which is left untouched */
+	const char *overlay;
+	/* Boot trace to replay, or to record if it doesn't exist */
+	const char *boot_trace;
+	u32 boot_trace_secs;
 };
 
 struct disk_image {
@@ -63,26 +202,70 @@ struct disk_image {
 	void				(*disk_req_cb)(void *param, long len);
 	bool				readonly;
 	bool				async;
-#ifdef CONFIG_HAS_AIO
-	io_context_t			ctx;
+	/* Aligned buffers for O_DIRECT requests that need them */
+	struct disk_bounce_pool		*bounce;
+	u32				dio_align;
+	/* Rate limits, NULL until some are set */
+	struct disk_throttle		*throttle;
+	/* Holes of a sparse raw image, NULL if not tracked */
+	struct disk_extent_map		*extents;
+	/* Copy-on-write overlay, if the image was opened with one */
+	struct disk_overlay		*overlay;
+	/* Sector n is at byte n * SECTOR_SIZE of fd, as for raw images */
+	bool				flat;
+	struct disk_trace		*trace;
+	struct disk_stats		stats;
+#ifdef DISK_IMAGE_HAS_ASYNC
 	int				evt;
-	pthread_t			thread;
 	u64				aio_inflight;
+	/* Signalled when aio_inflight drops to zero */
+	struct mutex			drain_lock;
+	pthread_cond_t			drain_cond;
+	/* Held by whoever takes completions out of the async engine */
+	struct mutex			reap_lock;
+#endif
+#ifdef CONFIG_HAS_AIO
+	io_context_t			ctx;
+	bool				aio;
 #endif /* CONFIG_HAS_AIO */
+#ifdef CONFIG_HAS_IO_URING
+	struct io_uring			ring;
+	struct mutex			ring_lock;
+	bool				uring;
+#endif /* CONFIG_HAS_IO_URING */
 	const char			*wwpn;
 	int				debug_iodelay;
+	int				nr_queues;
+	/* Let the device combine contiguous requests into one disk I/O */
+	bool				merge;
+	u32				poll_us;
+	u32				coalesce_usecs;
+	u32				coalesce_frames;
+	/* Discard granularity in sectors, 0 if any sector can be discarded */
+	u32				discard_align;
 };
 
 int disk_img_name_parser(const struct option *opt, const char *arg, int unset);
+int disk_image__parse_value(const char *arg, u64 min, u64 max, u64 *value);
 int disk_image__init(struct kvm *kvm);
 int disk_image__exit(struct kvm *kvm);
 struct disk_image *disk_image__new(int fd, u64 size, struct disk_image_operations *ops, int mmap);
+struct disk_image *disk_image__open(struct disk_image_params *params);
+int disk_image__close(struct disk_image *disk);
 int disk_image__flush(struct disk_image *disk);
 int disk_image__wait(struct disk_image *disk);
 ssize_t disk_image__read(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param);
 ssize_t disk_image__write(struct disk_image *disk, u64 sector, const struct iovec *iov,
 				int iovcount, void *param);
+int disk_image__submit_batch(struct disk_image *disk, struct disk_io *ios, int nr);
+int disk_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors);
+int disk_image__write_zeroes(struct disk_image *disk, u64 sector, u64 nr_sectors,
+			     bool unmap);
+#ifdef DISK_IMAGE_HAS_ASYNC
+void disk_image__io_done(struct disk_image *disk, int nr);
+void disk_image__drain_wake(struct disk_image *disk);
+#endif
 ssize_t disk_image__get_serial(struct disk_image *disk, struct iovec *iov,
 			       int iovcount, ssize_t len);
 
@@ -95,23 +278,100 @@ ssize_t raw_image__write_sync(struct disk_image *disk, u64 sector,
 			      const struct iovec *iov, int iovcount, void *param);
 ssize_t raw_image__read_mmap(struct disk_image *disk, u64 sector,
 				const struct iovec *iov, int iovcount, void *param);
+int raw_image__discard(struct disk_image *disk, u64 sector, u64 nr_sectors);
+int raw_image__write_zeroes(struct disk_image *disk, u64 sector, u64 nr_sectors,
+			    bool unmap);
 ssize_t raw_image__write_mmap(struct disk_image *disk, u64 sector,
 				const struct iovec *iov, int iovcount, void *param);
 int raw_image__close(struct disk_image *disk);
 void disk_image__set_callback(struct disk_image *disk, void (*disk_req_cb)(void *param, long len));
 
+int disk_bounce__setup(struct disk_image *disk);
+void disk_bounce__destroy(struct disk_image *disk);
+bool disk_bounce__misaligned(struct disk_image *disk, u64 sector,
+			     const struct iovec *iov, int iovcount);
+ssize_t disk_bounce__rw(struct disk_image *disk, int type, u64 offset,
+			const struct iovec *iov, int iovcount);
+
+static inline bool disk_bounce__needed(struct disk_image *disk, u64 sector,
+				       const struct iovec *iov, int iovcount)
+{
+	return disk->bounce && disk_bounce__misaligned(disk, sector, iov, iovcount);
+}
+
+int disk_extent__setup(struct disk_image *disk);
+void disk_extent__destroy(struct disk_image *disk);
+bool disk_extent__is_hole(struct disk_image *disk, u64 offset, u64 len);
+void disk_extent__mark_data(struct disk_image *disk, u64 offset, u64 len);
+void disk_extent__mark_zero(struct disk_image *disk, u64 offset, u64 len);
+ssize_t disk_extent__read_hole(const struct iovec *iov, int iovcount);
+
+static inline bool disk_extent__read_is_hole(struct disk_image *disk,
+					     u64 sector,
+					     const struct iovec *iov,
+					     int iovcount)
+{
+	u64 len = 0;
+	int i;
+
+	if (!disk->extents)
+		return false;
+
+	for (i = 0; i < iovcount; i++)
+		len += iov[i].iov_len;
+
+	return disk_extent__is_hole(disk, sector << SECTOR_SHIFT, len);
+}
+
+static inline void disk_extent__write(struct disk_image *disk, u64 sector,
+				      const struct iovec *iov, int iovcount)
+{
+	u64 len = 0;
+	int i;
+
+	if (!disk->extents)
+		return;
+
+	for (i = 0; i < iovcount; i++)
+		len += iov[i].iov_len;
+
+	disk_extent__mark_data(disk, sector << SECTOR_SHIFT, len);
+}
+
+struct disk_image *disk_overlay__open(struct disk_image_params *params);
+void disk_overlay__destroy(struct disk_image *disk);
+int disk_overlay__commit(struct disk_image *disk);
+int disk_overlay__discard(struct disk_image *disk);
+
+int disk_trace__setup(struct disk_image *disk, struct disk_image_params *params);
+void disk_trace__destroy(struct disk_image *disk);
+void disk_trace__read(struct disk_image *disk, u64 sector, size_t len);
+
+int disk_throttle__set(struct disk_image *disk,
+		       const struct disk_throttle_limits *limits);
+void disk_throttle__destroy(struct disk_image *disk);
+u64 disk_throttle__admit(struct disk_image *disk, int type, size_t len);
+int disk_throttle__parse_option(struct disk_throttle_limits *limits,
+				const char *arg);
+
+u64 disk_stats__now(void);
+u64 disk_stats__start(struct disk_image *disk);
+void disk_stats__end(struct disk_image *disk, int op, size_t bytes,
+		     u64 start, u64 now, bool error);
+
+int disk_image__completion_fd(struct disk_image *disk);
+void disk_image__reap(struct disk_image *disk);
+
 #ifdef CONFIG_HAS_AIO
 int disk_aio_setup(struct disk_image *disk);
 void disk_aio_destroy(struct disk_image *disk);
-ssize_t raw_image__read_async(struct disk_image *disk, u64 sector,
-			      const struct iovec *iov, int iovcount, void *param);
-ssize_t raw_image__write_async(struct disk_image *disk, u64 sector,
-			       const struct iovec *iov, int iovcount, void *param);
-int raw_image__wait(struct disk_image *disk);
-
-#define raw_image__read		raw_image__read_async
-#define raw_image__write	raw_image__write_async
-
+ssize_t disk_aio_read(struct disk_image *disk, u64 offset,
+		      const struct iovec *iov, int iovcount, void *param);
+ssize_t disk_aio_write(struct disk_image *disk, u64 offset,
+		       const struct iovec *iov, int iovcount, void *param);
+int disk_aio_submit_batch(struct disk_image *disk, struct disk_io *ios, int nr);
+int disk_aio_wait(struct disk_image *disk);
+void disk_aio_reap(struct disk_image *disk);
 #else /* !CONFIG_HAS_AIO */
 static inline int disk_aio_setup(struct disk_image *disk)
 {
@@ -121,13 +381,48 @@ static inline int disk_aio_setup(struct disk_image *disk)
 static inline void disk_aio_destroy(struct disk_image *disk)
 {
 }
+#endif /* CONFIG_HAS_AIO */
+
+#ifdef CONFIG_HAS_IO_URING
+int disk_uring_setup(struct disk_image *disk, bool sqpoll);
+void disk_uring_destroy(struct disk_image *disk);
+ssize_t disk_uring_read(struct disk_image *disk, u64 offset,
+			const struct iovec *iov, int iovcount, void *param);
+ssize_t disk_uring_write(struct disk_image *disk, u64 offset,
+			 const struct iovec *iov, int iovcount, void *param);
+int disk_uring_submit_batch(struct disk_image *disk, struct disk_io *ios, int nr);
+int disk_uring_wait(struct disk_image *disk);
+void disk_uring_reap(struct disk_image *disk);
+#else /* !CONFIG_HAS_IO_URING */
+static inline int disk_uring_setup(struct disk_image *disk, bool sqpoll)
+{
+	return -ENOSYS;
+}
+static inline void disk_uring_destroy(struct disk_image *disk)
+{
+}
+#endif /* CONFIG_HAS_IO_URING */
 
+#ifdef DISK_IMAGE_HAS_ASYNC
+ssize_t raw_image__read_async(struct disk_image *disk, u64 sector,
+			      const struct iovec *iov, int iovcount, void *param);
+ssize_t raw_image__write_async(struct disk_image *disk, u64 sector,
+			       const struct iovec *iov, int iovcount, void *param);
+int raw_image__submit_batch(struct disk_image *disk, struct disk_io *ios, int nr);
+int raw_image__wait(struct disk_image *disk);
+
+#define raw_image__read		raw_image__read_async
+#define raw_image__write	raw_image__write_async
+#define raw_image__batch	raw_image__submit_batch
+
+#else /* !DISK_IMAGE_HAS_ASYNC */
 static inline int raw_image__wait(struct disk_image *disk)
 {
 	return 0;
 }
 #define raw_image__read		raw_image__read_sync
 #define raw_image__write	raw_image__write_sync
-#endif /* CONFIG_HAS_AIO */
+#define raw_image__batch	NULL
+#endif /* DISK_IMAGE_HAS_ASYNC */
 
 #endif /* KVM__DISK_IMAGE_H */
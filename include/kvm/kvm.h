@@ -76,6 +76,8 @@ struct kvm_mem_bank {
 	u32			slot;
 };
 
+struct kvm_mem_map;
+
 struct kvm {
 	struct kvm_arch		arch;
 	struct kvm_config	cfg;
@@ -92,6 +94,8 @@ struct kvm {
 	u64			ram_pagesize;
 	struct mutex		mem_banks_lock;
 	struct list_head	mem_banks;
+	/* Sorted copy of the banks, for address translation without locking */
+	struct kvm_mem_map	*mem_map;
 
 	bool			nmi_disabled;
 	bool			msix_needs_devid;
@@ -210,6 +214,7 @@ static inline bool kvm__arch_has_cfg_ram_address(void)
 #endif
 
 void *guest_flat_to_host(struct kvm *kvm, u64 offset);
+void *guest_flat_to_host_range(struct kvm *kvm, u64 offset, u64 len);
 u64 host_to_guest_flat(struct kvm *kvm, void *ptr);
 
 bool kvm__arch_load_kernel_image(struct kvm *kvm, int fd_kernel, int fd_initrd,
@@ -30,6 +30,19 @@ static inline void mutex_lock(struct mutex *lock)
 
 }
 
+/* Returns 1 if the lock was taken, 0 if it is held elsewhere */
+static inline int mutex_trylock(struct mutex *lock)
+{
+	int r = pthread_mutex_trylock(&lock->mutex);
+
+	if (r == EBUSY)
+		return 0;
+	if (r != 0)
+		die("unexpected pthread_mutex_trylock() failure!");
+
+	return 1;
+}
+
 static inline void mutex_unlock(struct mutex *lock)
 {
 	if (pthread_mutex_unlock(&lock->mutex) != 0)
@@ -34,6 +34,8 @@
 #define PCI_CONFIG_BUS_FORWARD	0xcfa
 #define PCI_IO_SIZE		0x100
 #define PCI_IOPORT_START	0x6200
+/* Devices are all on bus 0, addressed with 5 bits */
+#define PCI_MAX_DEVICES		32
 
 struct kvm;
 
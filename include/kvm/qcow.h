@@ -5,7 +5,7 @@
 
 #include <linux/types.h>
 #include <stdbool.h>
-#include <linux/rbtree.h>
+#include <pthread.h>
 #include <linux/list.h>
 
 #define QCOW_MAGIC		(('Q' << 24) | ('F' << 16) | ('I' << 8) | 0xfb)
@@ -22,11 +22,22 @@
 
 #define QCOW2_OFFSET_MASK	(~QCOW2_OFLAGS_MASK)
 
-#define MAX_CACHE_NODES         32
+/* Default number of L2 tables, and of refcount blocks, kept in memory */
+#define QCOW_DEFAULT_CACHE_NODES	256
+
+/* Number of data clusters reserved at once by the write path */
+#define QCOW_PREALLOC_CLUSTERS		16
+
+/* Number of decompressed clusters kept in memory */
+#define QCOW_ZCACHE_CLUSTERS		32
+#define QCOW_ZCACHE_HASH_BITS		6
+
+/* Longest chain of backing files, which also stops loops */
+#define QCOW_MAX_BACKING_DEPTH		16
 
 struct qcow_l2_table {
 	u64				offset;
-	struct rb_node			node;
+	struct hlist_node		node;
 	struct list_head		list;
 	u8				dirty;
 	u64				table[];
@@ -37,7 +48,7 @@ struct qcow_l1_table {
 	u64				*l1_table;
 
 	/* Level2 caching data structures */
-	struct rb_root			root;
+	struct hlist_head		*hash;
 	struct list_head		lru_list;
 	int				nr_cached;
 };
@@ -46,7 +57,7 @@ struct qcow_l1_table {
 
 struct qcow_refcount_block {
 	u64				offset;
-	struct rb_node			node;
+	struct hlist_node		node;
 	struct list_head		list;
 	u64				size;
 	u8				dirty;
@@ -58,11 +69,32 @@ struct qcow_refcount_table {
 	u64				*rf_table;
 
 	/* Refcount block caching data structures */
-	struct rb_root			root;
+	struct hlist_head		*hash;
+	struct list_head		lru_list;
+	int				nr_cached;
+};
+
+/* A decompressed cluster, keyed by the offset of its compressed data */
+struct qcow_zcluster {
+	u64				offset;
+	struct hlist_node		node;
+	struct list_head		list;
+	u8				data[];
+};
+
+struct qcow_zcache {
+	struct mutex			lock;
+	struct hlist_head		hash[1 << QCOW_ZCACHE_HASH_BITS];
 	struct list_head		lru_list;
 	int				nr_cached;
 };
 
+/* Clusters waiting for the metadata writeback before being released */
+struct qcow_free_range {
+	u64				offset;
+	u64				size;
+};
+
 struct qcow_header {
 	u64				size;	/* in bytes */
 	u64				l1_table_offset;
@@ -71,10 +103,21 @@ struct qcow_header {
 	u8				l2_bits;
 	u64				refcount_table_offset;
 	u32				refcount_table_size;
+	u64				backing_file_offset;
+	u32				backing_file_size;
 };
 
+/*
+ * Locking: reads and overwrites of allocated clusters hold 'lock' for
+ * reading, anything that changes the metadata holds it for writing. Clusters
+ * being allocated are filled beforehand, so no data I/O happens with it held
+ * for writing. Readers share the L2 cache under 'cache_lock', and the
+ * decompressed clusters under 'zcache.lock'. There is no per-table locking:
+ * metadata updates of the whole image are serialised.
+ */
 struct qcow {
-	struct mutex			mutex;
+	pthread_rwlock_t		lock;
+	struct mutex			cache_lock;
 	struct qcow_header		*header;
 	struct qcow_l1_table		table;
 	struct qcow_refcount_table	refcount_table;
@@ -85,9 +128,26 @@ struct qcow {
 	u64				cluster_size;
 	u64				cluster_offset_mask;
 	u64				free_clust_idx;
-	void				*cluster_cache;
-	void				*cluster_data;
-	void				*copy_buff;
+	struct qcow_zcache		zcache;
+	int				cache_nodes;
+	u32				cache_hash_bits;
+
+	/* Unallocated clusters are read from here, if set */
+	struct disk_image		*backing;
+	char				*backing_path;
+	bool				copy_on_read;
+
+	/* The image itself, whose async I/O may target freed clusters */
+	struct disk_image		*disk;
+
+	/* Metadata writeback state, protected by 'lock' */
+	int				nr_dirty;
+	bool				l1_dirty;
+	u64				prealloc_offset;
+	u32				prealloc_nr;
+	struct qcow_free_range		*pending_frees;
+	int				nr_pending_frees;
+	int				max_pending_frees;
 };
 
 struct qcow1_header_disk {
@@ -128,6 +188,8 @@ struct qcow2_header_disk {
 	u64				snapshots_offset;
 };
 
-struct disk_image *qcow_probe(int fd, bool readonly);
+struct disk_image_params;
+
+struct disk_image *qcow_probe(int fd, struct disk_image_params *params);
 
 #endif /* KVM__QCOW_H */
@@ -17,6 +17,18 @@ int init_list_add(struct init_item *t, int (*init)(struct kvm *),
 int exit_list_add(struct init_item *t, int (*init)(struct kvm *),
 			int priority, const char *name);
 
+/*
+ * Called by kvm__pause() once the vCPUs are stopped, in the order of the exit
+ * list, and by kvm__continue() in the order of the init list.
+ */
+int init_list__pause(struct kvm *kvm);
+int init_list__continue(struct kvm *kvm);
+
+int pause_list_add(struct init_item *t, int (*pause)(struct kvm *),
+			int priority, const char *name);
+int continue_list_add(struct init_item *t, int (*cont)(struct kvm *),
+			int priority, const char *name);
+
 #define __init_list_add(cb, l)						\
 static void __attribute__ ((constructor)) __init__##cb(void)		\
 {									\
@@ -33,6 +45,22 @@ static void __attribute__ ((constructor)) __init__##cb(void)		\
 	exit_list_add(&t, cb, l, name);					\
 }
 
+#define __pause_list_add(cb, l)						\
+static void __attribute__ ((constructor)) __pause__##cb(void)		\
+{									\
+	static char name[] = #cb;					\
+	static struct init_item t;					\
+	pause_list_add(&t, cb, l, name);				\
+}
+
+#define __continue_list_add(cb, l)					\
+static void __attribute__ ((constructor)) __continue__##cb(void)	\
+{									\
+	static char name[] = #cb;					\
+	static struct init_item t;					\
+	continue_list_add(&t, cb, l, name);				\
+}
+
 #define core_init(cb) __init_list_add(cb, 0)
 #define base_init(cb) __init_list_add(cb, 2)
 #define dev_base_init(cb)  __init_list_add(cb, 4)
@@ -48,4 +76,12 @@ static void __attribute__ ((constructor)) __init__##cb(void)		\
 #define virtio_dev_exit(cb) __exit_list_add(cb, 6)
 #define firmware_exit(cb) __exit_list_add(cb, 7)
 #define late_exit(cb) __exit_list_add(cb, 9)
+
+#define dev_base_pause(cb) __pause_list_add(cb, 4)
+#define dev_pause(cb) __pause_list_add(cb, 5)
+#define virtio_dev_pause(cb) __pause_list_add(cb, 6)
+
+#define dev_base_continue(cb) __continue_list_add(cb, 4)
+#define dev_continue(cb) __continue_list_add(cb, 5)
+#define virtio_dev_continue(cb) __continue_list_add(cb, 6)
 #endif
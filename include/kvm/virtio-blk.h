@@ -2,6 +2,10 @@
 #define KVM__BLK_VIRTIO_H
 
 #include "kvm/disk-image.h"
+#include "kvm/virtio-pci.h"
+
+/* One MSI-X vector per queue, plus the config vector */
+#define VIRTIO_BLK_MAX_QUEUES		VIRTIO_PCI_MAX_VQ
 
 struct kvm;
 
@@ -19,6 +19,9 @@ struct virtio_net_params {
 	int vhost;
 	int fd;
 	int mq;
+	/* Interrupt coalescing of the data queues, see virtio_coalesce__init() */
+	u32 coalesce_usecs;
+	u32 coalesce_frames;
 };
 
 int virtio_net__init(struct kvm *kvm);
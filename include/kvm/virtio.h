@@ -67,6 +67,12 @@ struct vring_addr {
 	};
 };
 
+/* Where the descriptors of a buffer of a packed ring are, indexed by buffer id */
+struct virt_queue_packed_buf {
+	u16		pos;
+	u16		nr_descs;
+};
+
 struct virt_queue {
 	struct vring	vring;
 	struct vring_addr vring_addr;
@@ -77,8 +83,33 @@ struct virt_queue {
 	u16		endian;
 	bool		use_event_idx;
 	bool		enabled;
+	/* The device asked the guest not to notify it */
+	bool		no_notify;
 	struct virtio_device *vdev;
 
+	/*
+	 * VIRTIO_F_RING_PACKED. last_avail_idx is then the next descriptor to
+	 * look at, and used_idx the next one to write a used element to. Used
+	 * elements are first written at pending_idx, and published by
+	 * virt_queue__used_idx_advance().
+	 */
+	bool		packed;
+	struct vring_packed_desc	*desc_packed;
+	struct vring_packed_desc_event	*driver_event;
+	struct vring_packed_desc_event	*device_event;
+	struct virt_queue_packed_buf	*bufs;
+	bool		avail_wrap;
+	bool		used_wrap;
+	u16		used_idx;
+	bool		pending_wrap;
+	u16		pending_idx;
+	u16		pending_flags;
+	bool		signalled_valid;
+
+	/* Used elements published so far, and interrupt coalescing state */
+	u32		nr_used;
+	struct virt_queue_coalesce	*coalesce;
+
 	/* vhost IRQ handling */
 	int		gsi;
 	int		irqfd;
@@ -155,10 +186,16 @@ static inline u64 virtio_host_to_guest_u64(u16 endian, u64 value)
 
 #endif
 
+u16 virt_queue__pop_packed(struct virt_queue *queue);
+bool virt_queue__available_packed(struct virt_queue *vq);
+
 static inline u16 virt_queue__pop(struct virt_queue *queue)
 {
 	__u16 guest_idx;
 
+	if (queue->packed)
+		return virt_queue__pop_packed(queue);
+
 	/*
 	 * The guest updates the avail index after writing the ring entry.
 	 * Ensure that we read the updated entry once virt_queue__available()
@@ -178,11 +215,15 @@ static inline struct vring_desc *virt_queue__get_desc(struct virt_queue *queue,
 static inline bool virt_queue__available(struct virt_queue *vq)
 {
 	u16 last_avail_idx = virtio_host_to_guest_u16(vq->endian, vq->last_avail_idx);
+	u16 avail_idx;
+
+	if (vq->packed)
+		return virt_queue__available_packed(vq);
 
 	if (!vq->vring.avail)
 		return 0;
 
-	if (vq->use_event_idx) {
+	if (vq->use_event_idx && !vq->no_notify) {
 		vring_avail_event(&vq->vring) = last_avail_idx;
 		/*
 		 * After the driver writes a new avail index, it reads the event
@@ -192,14 +233,52 @@ static inline bool virt_queue__available(struct virt_queue *vq)
 		mb();
 	}
 
-	return vq->vring.avail->idx != last_avail_idx;
+	/* More buffers than the ring holds is a broken or malicious guest */
+	avail_idx = virtio_guest_to_host_u16(vq->endian, vq->vring.avail->idx);
+	if ((u16)(avail_idx - vq->last_avail_idx) > vq->vring.num) {
+		WARN_ONCE(1, "virtio: avail index %u too far ahead of %u",
+			  avail_idx, vq->last_avail_idx);
+		return false;
+	}
+
+	return avail_idx != vq->last_avail_idx;
 }
 
 void virt_queue__used_idx_advance(struct virt_queue *queue, u16 jump);
 struct vring_used_elem * virt_queue__set_used_elem_no_update(struct virt_queue *queue, u32 head, u32 len, u16 offset);
 struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32 head, u32 len);
 
+/*
+ * Used elements added to a batch are written to the used ring right away, but
+ * only published when the batch is. Nothing else may write to the used ring of
+ * the queue in between.
+ */
+struct virt_queue_used_batch {
+	struct virt_queue	*vq;
+	u16			nr;
+};
+
+static inline void virt_queue__used_batch_init(struct virt_queue_used_batch *batch,
+					       struct virt_queue *vq)
+{
+	batch->vq = vq;
+	batch->nr = 0;
+}
+
+void virt_queue__used_batch_add(struct virt_queue_used_batch *batch, u32 head, u32 len);
+bool virt_queue__used_batch_publish(struct virt_queue_used_batch *batch);
+
 bool virtio_queue__should_signal(struct virt_queue *vq);
+
+int virtio_coalesce__init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
+			  u32 max_usecs, u32 max_frames);
+void virtio_coalesce__exit(struct virtio_device *vdev);
+void virtio_coalesce__set(struct virtio_device *vdev, u32 id, u32 max_usecs,
+			  u32 max_frames);
+void virtio_coalesce__attach(struct virtio_device *vdev, struct virt_queue *vq);
+bool virtio_coalesce__should_signal(struct virt_queue *vq, bool wanted);
+void virt_queue__disable_notify(struct virt_queue *vq);
+bool virt_queue__enable_notify(struct virt_queue *vq);
 u16 virt_queue__get_iov(struct virt_queue *vq, struct iovec iov[],
 			u16 *out, u16 *in, struct kvm *kvm);
 u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[],
@@ -224,6 +303,8 @@ struct virtio_device {
 	u16			endian;
 	u64			features;
 	u32			status;
+	/* Interrupt coalescing of the queues, NULL if not set up */
+	struct virtio_coalesce	*coalesce;
 };
 
 struct virtio_ops {
@@ -12,6 +12,8 @@
 #include "kvm/builtin-setup.h"
 #include "kvm/builtin-stop.h"
 #include "kvm/builtin-stat.h"
+#include "kvm/builtin-throttle.h"
+#include "kvm/builtin-overlay.h"
 #include "kvm/builtin-help.h"
 #include "kvm/builtin-sandbox.h"
 #include "kvm/kvm-cmd.h"
@@ -28,6 +30,8 @@ struct cmd_struct kvm_commands[] = {
 	{ "--version",	kvm_cmd_version,	NULL,			0 },
 	{ "stop",	kvm_cmd_stop,		kvm_stop_help,		0 },
 	{ "stat",	kvm_cmd_stat,		kvm_stat_help,		0 },
+	{ "throttle",	kvm_cmd_throttle,	kvm_throttle_help,	0 },
+	{ "overlay",	kvm_cmd_overlay,	kvm_overlay_help,	0 },
 	{ "help",	kvm_cmd_help,		NULL,			0 },
 	{ "setup",	kvm_cmd_setup,		kvm_setup_help,		0 },
 	{ "run",	kvm_cmd_run,		kvm_run_help,		0 },
@@ -168,9 +168,178 @@ struct kvm *kvm__new(void)
 	return kvm;
 }
 
+/*
+ * Address translation is done by every I/O thread for every buffer, so it
+ * doesn't take mem_banks_lock: it looks the address up in a snapshot of the
+ * banks, sorted by guest and by host address, that is replaced whenever the
+ * banks change. Threads may still be reading a replaced map, which is why
+ * maps are only freed on exit. Banks are rarely added or removed after the
+ * guest starts, so few maps pile up. Each thread also remembers the last range
+ * it found, which is usually the one it needs next.
+ */
+struct kvm_mem_range {
+	u64			guest_phys_addr;
+	void			*host_addr;
+	u64			size;
+};
+
+struct kvm_mem_map {
+	/* Maps replaced by this one */
+	struct kvm_mem_map	*prev;
+	unsigned int		nr;
+	struct kvm_mem_range	*by_guest;
+	struct kvm_mem_range	*by_host;
+	struct kvm_mem_range	ranges[];
+};
+
+static __thread struct kvm_mem_map *last_map;
+static __thread struct kvm_mem_range *last_guest, *last_host;
+
+static int kvm_mem_range__cmp_guest(const void *a, const void *b)
+{
+	const struct kvm_mem_range *ra = a, *rb = b;
+
+	if (ra->guest_phys_addr != rb->guest_phys_addr)
+		return ra->guest_phys_addr < rb->guest_phys_addr ? -1 : 1;
+
+	return 0;
+}
+
+static int kvm_mem_range__cmp_host(const void *a, const void *b)
+{
+	const struct kvm_mem_range *ra = a, *rb = b;
+
+	if (ra->host_addr != rb->host_addr)
+		return ra->host_addr < rb->host_addr ? -1 : 1;
+
+	return 0;
+}
+
+/* Publish a new map of the banks. Called with mem_banks_lock held. */
+static int kvm__update_mem_map(struct kvm *kvm)
+{
+	struct kvm_mem_bank *bank;
+	struct kvm_mem_map *map;
+	unsigned int nr = 0;
+
+	list_for_each_entry(bank, &kvm->mem_banks, list)
+		nr++;
+
+	map = calloc(1, sizeof(*map) + 2 * nr * sizeof(map->ranges[0]));
+	if (!map)
+		return -ENOMEM;
+
+	map->by_guest	= map->ranges;
+	map->by_host	= map->ranges + nr;
+
+	/* Reserved regions aren't backed by anything */
+	list_for_each_entry(bank, &kvm->mem_banks, list) {
+		if (!bank->host_addr)
+			continue;
+
+		map->by_guest[map->nr++] = (struct kvm_mem_range) {
+			.guest_phys_addr	= bank->guest_phys_addr,
+			.host_addr		= bank->host_addr,
+			.size			= bank->size,
+		};
+	}
+
+	memcpy(map->by_host, map->by_guest, map->nr * sizeof(*map->by_host));
+	qsort(map->by_guest, map->nr, sizeof(*map->by_guest),
+	      kvm_mem_range__cmp_guest);
+	qsort(map->by_host, map->nr, sizeof(*map->by_host),
+	      kvm_mem_range__cmp_host);
+
+	map->prev = kvm->mem_map;
+	__atomic_store_n(&kvm->mem_map, map, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static struct kvm_mem_map *kvm__get_mem_map(struct kvm *kvm)
+{
+	struct kvm_mem_map *map = __atomic_load_n(&kvm->mem_map, __ATOMIC_ACQUIRE);
+
+	if (map != last_map) {
+		last_map	= map;
+		last_guest	= NULL;
+		last_host	= NULL;
+	}
+
+	return map;
+}
+
+/* The range holding @offset, if any */
+static struct kvm_mem_range *kvm__find_guest_range(struct kvm *kvm, u64 offset)
+{
+	struct kvm_mem_map *map = kvm__get_mem_map(kvm);
+	struct kvm_mem_range *range = last_guest;
+	unsigned int lo = 0, hi, mid;
+
+	if (range && offset - range->guest_phys_addr < range->size)
+		return range;
+
+	if (!map)
+		return NULL;
+
+	/* Find the last range starting at or below @offset */
+	hi = map->nr;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (map->by_guest[mid].guest_phys_addr <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo)
+		return NULL;
+
+	range = &map->by_guest[lo - 1];
+	if (offset - range->guest_phys_addr >= range->size)
+		return NULL;
+
+	last_guest = range;
+	return range;
+}
+
+static struct kvm_mem_range *kvm__find_host_range(struct kvm *kvm, void *ptr)
+{
+	struct kvm_mem_map *map = kvm__get_mem_map(kvm);
+	struct kvm_mem_range *range = last_host;
+	unsigned int lo = 0, hi, mid;
+
+	if (range && ptr >= range->host_addr &&
+	    (u64)(ptr - range->host_addr) < range->size)
+		return range;
+
+	if (!map)
+		return NULL;
+
+	hi = map->nr;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (map->by_host[mid].host_addr <= ptr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo)
+		return NULL;
+
+	range = &map->by_host[lo - 1];
+	if ((u64)(ptr - range->host_addr) >= range->size)
+		return NULL;
+
+	last_host = range;
+	return range;
+}
+
 int kvm__exit(struct kvm *kvm)
 {
 	struct kvm_mem_bank *bank, *tmp;
+	struct kvm_mem_map *map, *prev;
 
 	kvm__arch_delete_ram(kvm);
 
@@ -179,6 +348,11 @@ int kvm__exit(struct kvm *kvm)
 		free(bank);
 	}
 
+	for (map = kvm->mem_map; map; map = prev) {
+		prev = map->prev;
+		free(map);
+	}
+
 	free(kvm);
 	return 0;
 }
@@ -227,7 +401,7 @@ int kvm__destroy_mem(struct kvm *kvm, u64 guest_phys, u64 size,
 	list_del(&bank->list);
 	free(bank);
 	kvm->mem_slots--;
-	ret = 0;
+	ret = kvm__update_mem_map(kvm);
 
 out:
 	mutex_unlock(&kvm->mem_banks_lock);
@@ -297,7 +471,7 @@ int kvm__register_mem(struct kvm *kvm, u64 guest_phys, u64 size,
 	}
 
 	if (merged) {
-		ret = 0;
+		ret = kvm__update_mem_map(kvm);
 		goto out;
 	}
 
@@ -335,7 +509,7 @@ int kvm__register_mem(struct kvm *kvm, u64 guest_phys, u64 size,
 
 	list_add(&bank->list, prev_entry);
 	kvm->mem_slots++;
-	ret = 0;
+	ret = kvm__update_mem_map(kvm);
 
 out:
 	mutex_unlock(&kvm->mem_banks_lock);
@@ -344,33 +518,44 @@ out:
 
 void *guest_flat_to_host(struct kvm *kvm, u64 offset)
 {
-	struct kvm_mem_bank *bank;
+	struct kvm_mem_range *range = kvm__find_guest_range(kvm, offset);
 
-	list_for_each_entry(bank, &kvm->mem_banks, list) {
-		u64 bank_start = bank->guest_phys_addr;
-		u64 bank_end = bank_start + bank->size;
-
-		if (offset >= bank_start && offset < bank_end)
-			return bank->host_addr + (offset - bank_start);
-	}
+	if (range)
+		return range->host_addr + (offset - range->guest_phys_addr);
 
 	pr_warning("unable to translate guest address 0x%llx to host",
 			(unsigned long long)offset);
 	return NULL;
 }
 
-u64 host_to_guest_flat(struct kvm *kvm, void *ptr)
+/*
+ * Translate the @len bytes at @offset, which must all be in the same bank to
+ * be contiguous in our address space. Returns NULL otherwise.
+ */
+void *guest_flat_to_host_range(struct kvm *kvm, u64 offset, u64 len)
 {
-	struct kvm_mem_bank *bank;
+	struct kvm_mem_range *range = kvm__find_guest_range(kvm, offset);
+	u64 start;
 
-	list_for_each_entry(bank, &kvm->mem_banks, list) {
-		void *bank_start = bank->host_addr;
-		void *bank_end = bank_start + bank->size;
-
-		if (ptr >= bank_start && ptr < bank_end)
-			return bank->guest_phys_addr + (ptr - bank_start);
+	if (range) {
+		start = offset - range->guest_phys_addr;
+		if (len <= range->size - start)
+			return range->host_addr + start;
 	}
 
+	pr_warning("unable to translate guest range 0x%llx-0x%llx to host",
+			(unsigned long long)offset,
+			(unsigned long long)(offset + len - 1));
+	return NULL;
+}
+
+u64 host_to_guest_flat(struct kvm *kvm, void *ptr)
+{
+	struct kvm_mem_range *range = kvm__find_host_range(kvm, ptr);
+
+	if (range)
+		return range->guest_phys_addr + (ptr - range->host_addr);
+
 	pr_warning("unable to translate host address %p to guest", ptr);
 	return 0;
 }
@@ -573,6 +758,7 @@ void kvm__reboot(struct kvm *kvm)
 
 void kvm__continue(struct kvm *kvm)
 {
+	init_list__continue(kvm);
 	mutex_unlock(&pause_lock);
 }
 
@@ -604,6 +790,9 @@ void kvm__pause(struct kvm *kvm)
 		paused_vcpus += cur_read;
 	}
 	close(pause_event);
+
+	/* Let the devices settle, e.g. in-flight disk I/O land */
+	init_list__pause(kvm);
 }
 
 void kvm__notify_paused(void)
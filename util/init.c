@@ -8,6 +8,8 @@
 
 static struct hlist_head init_lists[PRIORITY_LISTS];
 static struct hlist_head exit_lists[PRIORITY_LISTS];
+static struct hlist_head pause_lists[PRIORITY_LISTS];
+static struct hlist_head continue_lists[PRIORITY_LISTS];
 
 int init_list_add(struct init_item *t, int (*init)(struct kvm *),
 			int priority, const char *name)
@@ -29,6 +31,26 @@ int exit_list_add(struct init_item *t, int (*init)(struct kvm *),
 	return 0;
 }
 
+int pause_list_add(struct init_item *t, int (*pause)(struct kvm *),
+			int priority, const char *name)
+{
+	t->init = pause;
+	t->fn_name = name;
+	hlist_add_head(&t->n, &pause_lists[priority]);
+
+	return 0;
+}
+
+int continue_list_add(struct init_item *t, int (*cont)(struct kvm *),
+			int priority, const char *name)
+{
+	t->init = cont;
+	t->fn_name = name;
+	hlist_add_head(&t->n, &continue_lists[priority]);
+
+	return 0;
+}
+
 int init_list__init(struct kvm *kvm)
 {
 	unsigned int i;
@@ -65,3 +87,36 @@ int init_list__exit(struct kvm *kvm)
 fail:
 	return r;
 }
+
+/* Devices stop submitting before what they submit to is drained */
+int init_list__pause(struct kvm *kvm)
+{
+	int i;
+	int r = 0;
+	struct init_item *t;
+
+	for (i = ARRAY_SIZE(pause_lists) - 1; i >= 0; i--)
+		hlist_for_each_entry(t, &pause_lists[i], n) {
+			r = t->init(kvm);
+			if (r < 0)
+				pr_warning("%s failed.\n", t->fn_name);
+		}
+
+	return r;
+}
+
+int init_list__continue(struct kvm *kvm)
+{
+	unsigned int i;
+	int r = 0;
+	struct init_item *t;
+
+	for (i = 0; i < ARRAY_SIZE(continue_lists); i++)
+		hlist_for_each_entry(t, &continue_lists[i], n) {
+			r = t->init(kvm);
+			if (r < 0)
+				pr_warning("%s failed.\n", t->fn_name);
+		}
+
+	return r;
+}
@@ -1340,7 +1340,8 @@ static u8 virtio_p9_get_cmd(struct p9_pdu *pdu)
 	return msg->cmd;
 }
 
-static bool virtio_p9_do_io_request(struct kvm *kvm, struct p9_dev_job *job)
+static bool virtio_p9_do_io_request(struct kvm *kvm, struct p9_dev_job *job,
+				    struct virt_queue_used_batch *used)
 {
 	u8 cmd;
 	u32 len = 0;
@@ -1362,7 +1363,7 @@ static bool virtio_p9_do_io_request(struct kvm *kvm, struct p9_dev_job *job)
 		handler = virtio_9p_dotl_handler[cmd];
 
 	handler(p9dev, p9pdu, &len);
-	virt_queue__set_used_elem(vq, p9pdu->queue_head, len);
+	virt_queue__used_batch_add(used, p9pdu->queue_head, len);
 	free(p9pdu);
 	return true;
 }
@@ -1372,11 +1373,20 @@ static void virtio_p9_do_io(struct kvm *kvm, void *param)
 	struct p9_dev_job *job = (struct p9_dev_job *)param;
 	struct p9_dev *p9dev   = job->p9dev;
 	struct virt_queue *vq  = job->vq;
+	struct virt_queue_used_batch used;
 
-	while (virt_queue__available(vq)) {
-		virtio_p9_do_io_request(kvm, job);
-		p9dev->vdev.ops->signal_vq(kvm, &p9dev->vdev, vq - p9dev->vqs);
-	}
+	virt_queue__used_batch_init(&used, vq);
+
+	/* No kicks while draining, check again once they are back on */
+	do {
+		virt_queue__disable_notify(vq);
+		while (virt_queue__available(vq))
+			virtio_p9_do_io_request(kvm, job, &used);
+
+		if (virt_queue__used_batch_publish(&used))
+			p9dev->vdev.ops->signal_vq(kvm, &p9dev->vdev,
+						   vq - p9dev->vqs);
+	} while (virt_queue__enable_notify(vq));
 }
 
 static u8 *get_config(struct kvm *kvm, void *dev)
@@ -1395,7 +1405,7 @@ static size_t get_config_size(struct kvm *kvm, void *dev)
 
 static u64 get_host_features(struct kvm *kvm, void *dev)
 {
-	return 1 << VIRTIO_9P_MOUNT_TAG;
+	return 1 << VIRTIO_9P_MOUNT_TAG | 1ULL << VIRTIO_F_RING_PACKED;
 }
 
 static void notify_status(struct kvm *kvm, void *dev, u32 status)
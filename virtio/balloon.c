@@ -49,7 +49,9 @@ struct bln_dev {
 static struct bln_dev bdev;
 static int compat_id = -1;
 
-static bool virtio_bln_do_io_request(struct kvm *kvm, struct bln_dev *bdev, struct virt_queue *queue)
+static bool virtio_bln_do_io_request(struct kvm *kvm, struct bln_dev *bdev,
+				     struct virt_queue *queue,
+				     struct virt_queue_used_batch *used)
 {
 	struct iovec iov[VIRTIO_BLN_QUEUE_SIZE];
 	unsigned int len = 0;
@@ -75,7 +77,7 @@ static bool virtio_bln_do_io_request(struct kvm *kvm, struct bln_dev *bdev, stru
 	}
 	bdev->config.actual = cpu_to_le32(actual);
 
-	virt_queue__set_used_elem(queue, head, len);
+	virt_queue__used_batch_add(used, head, len);
 
 	return true;
 }
@@ -112,6 +114,7 @@ static bool virtio_bln_do_stat_request(struct kvm *kvm, struct bln_dev *bdev, st
 
 static void virtio_bln_do_io(struct kvm *kvm, void *param)
 {
+	struct virt_queue_used_batch used;
 	struct virt_queue *vq = param;
 
 	if (vq == &bdev.vqs[VIRTIO_BLN_STATS]) {
@@ -120,10 +123,13 @@ static void virtio_bln_do_io(struct kvm *kvm, void *param)
 		return;
 	}
 
-	while (virt_queue__available(vq)) {
-		virtio_bln_do_io_request(kvm, &bdev, vq);
+	/* The pages of all the available requests are handed back at once */
+	virt_queue__used_batch_init(&used, vq);
+	while (virt_queue__available(vq))
+		virtio_bln_do_io_request(kvm, &bdev, vq, &used);
+
+	if (virt_queue__used_batch_publish(&used))
 		bdev.vdev.ops->signal_vq(kvm, &bdev.vdev, vq - bdev.vqs);
-	}
 }
 
 static int virtio_bln__collect_stats(struct kvm *kvm)
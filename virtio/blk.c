@@ -18,29 +18,157 @@
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <linux/types.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
 #include <pthread.h>
-
-#define VIRTIO_BLK_MAX_DEV		4
+#include <limits.h>
 
 /*
  * the header and status consume too entries
  */
 #define DISK_SEG_MAX			(VIRTIO_BLK_QUEUE_SIZE - 2)
 #define VIRTIO_BLK_QUEUE_SIZE		256
-#define NUM_VIRT_QUEUES			1
+/* Limits for discard and write zeroes requests */
+#define VIRTIO_BLK_DISCARD_MAX_SEG	16
+#define VIRTIO_BLK_DISCARD_MAX_SECTORS	(1U << 22)
+
+/* Largest disk I/O built by merging contiguous requests */
+#define VIRTIO_BLK_MERGE_MAX_SECTORS	2048
+
+#define VIRTIO_BLK_WORKER_EVENTS	32
+
+/* Shortest polling window, however rarely polling finds requests */
+#define VIRTIO_BLK_POLL_MIN_NS		2000ULL
+
+/*
+ * The queues of all devices are serviced by a pool of I/O workers, at most
+ * one per host CPU, each of them waiting on the fds of several queues. The
+ * lock is held while events are handled, so that a queue can be removed from
+ * its worker without racing with an event that was already fetched.
+ */
+/* Identifies the fd that fired, embedded in the queue or device it belongs to */
+struct blk_dev_event {
+	int				type;
+};
+
+struct blk_worker {
+	pthread_t			thread;
+	int				epoll_fd;
+	struct mutex			lock;
+	/* Queues being busy-polled, the worker doesn't sleep while any are */
+	struct list_head		polling;
+	/* Gets the worker out of epoll_wait() to park it */
+	int				wake_fd;
+	struct blk_dev_event		wake_ev;
+};
+
+enum {
+	BLK_EV_KICK,
+	BLK_EV_TIMER,
+	BLK_EV_DONE,
+	BLK_EV_WAKE,
+};
 
 struct blk_dev_req {
 	struct virt_queue		*vq;
 	struct blk_dev			*bdev;
+	struct blk_dev_queue		*queue;
 	struct iovec			iov[VIRTIO_BLK_QUEUE_SIZE];
 	u16				out, in, head;
 	u8				*status;
 	struct kvm			*kvm;
+
+	/* Size of the data buffers of a read or write */
+	size_t				len;
+	/*
+	 * When contiguous requests are merged, the first one carries the
+	 * combined iovec and the others are chained behind it.
+	 */
+	struct iovec			*merge_iov;
+	struct blk_dev_req		*merge_next;
+
+	/* DISK_STAT_* type, or -1, and start time for the disk statistics */
+	int				stat_op;
+	u64				start;
+
+	/*
+	 * Sequence number of a write, or for a flush, the sequence number of
+	 * the next write. Writes in flight and waiting flushes are on the
+	 * lists of the device.
+	 */
+	u64				seq;
+	struct list_head		flush_list;
+	/* Flushes that came right after this one, completed along with it */
+	struct blk_dev_req		*flush_joined;
+
+	/* Used length, and next request, while waiting on a blk_done list */
+	u32				done_len;
+	struct blk_dev_req		*done_next;
 };
 
-struct blk_dev {
+/*
+ * Requests completed while a worker handles an event, handed back to the guest
+ * once it is done, with one used ring update and one signal per queue.
+ */
+struct blk_done {
+	struct blk_dev_req		*first;
+	struct blk_dev_req		**last;
+};
+
+/* Reads and writes popped from the virtqueue and not yet submitted */
+struct blk_dev_batch {
+	struct disk_io			ios[VIRTIO_BLK_QUEUE_SIZE];
+	int				nr;
+};
+
+/*
+ * Each virtqueue has its own request array and its own lock for the used ring,
+ * so that queues never contend with each other. Queues are spread over the
+ * workers.
+ */
+struct blk_dev_queue {
+	int				id;
+	struct blk_dev			*bdev;
+	struct virt_queue		vq;
+	struct blk_dev_req		*reqs;
 	struct mutex			mutex;
 
+	/*
+	 * Requests popped and not handed back yet. Only drops under @mutex,
+	 * which exit_vq() waits on for it to reach zero.
+	 */
+	u32				inflight;
+	pthread_cond_t			idle;
+
+	/*
+	 * The eventfds stay open until the device is freed, since kicks can
+	 * come from any thread. Their events are only handled while the
+	 * virtqueue is set up, which changes under the worker lock.
+	 */
+	struct blk_worker		*worker;
+	bool				enabled;
+	int				io_efd;
+	struct blk_dev_event		kick_ev;
+	struct blk_dev_event		timer_ev;
+
+	/*
+	 * A read or write held back by the disk throttle. The queue isn't
+	 * processed any further until the timer lets it through.
+	 */
+	struct disk_io			throttled;
+	int				timer_fd;
+
+	/*
+	 * With polling enabled, the queue stays on the polling list of its
+	 * worker until @poll_deadline. The window grows when polling finds
+	 * requests and shrinks when it doesn't.
+	 */
+	struct list_head		poll_list;
+	u64				poll_ns;
+	u64				poll_deadline;
+};
+
+struct blk_dev {
 	struct list_head		list;
 
 	struct virtio_device		vdev;
@@ -48,11 +176,34 @@ struct blk_dev {
 	u64				capacity;
 	struct disk_image		*disk;
 
-	struct virt_queue		vqs[NUM_VIRT_QUEUES];
-	struct blk_dev_req		reqs[VIRTIO_BLK_QUEUE_SIZE];
-
-	pthread_t			io_thread;
-	int				io_efd;
+	struct blk_dev_queue		queues[VIRTIO_BLK_MAX_QUEUES];
+	u16				nr_queues;
+
+	/*
+	 * Worker reaping the completions of the disk, if it has a fd for them,
+	 * the one of the first queue
+	 */
+	struct blk_worker		*worker;
+	struct blk_dev_event		done_ev;
+
+	/*
+	 * Flushes of async disks are submitted without stalling the queue.
+	 * A flush only waits for the writes submitted before it, which are
+	 * those with a lower sequence number. A flush with no write since the
+	 * previous one, which is still pending, joins it. A flush with no
+	 * write since the last completed one completes right away.
+	 */
+	struct mutex			flush_lock;
+	u64				write_seq;
+	u64				flushed_seq;
+	/* Writes in flight, oldest first */
+	struct list_head		writes;
+	/* Flushes waiting for writes, oldest first */
+	struct list_head		flushes;
+	/* Their number, which the queues check without taking the lock */
+	u32				nr_flushes;
+	/* Latest flush not completed yet */
+	struct blk_dev_req		*last_flush;
 
 	struct kvm			*kvm;
 };
@@ -60,27 +211,556 @@ struct blk_dev {
 static LIST_HEAD(bdevs);
 static int compat_id = -1;
 
+static struct blk_worker *workers;
+static int nr_workers;
+static int next_worker;
+/*
+ * While the guest is paused, the workers are parked between two rounds of
+ * events, so that they don't submit anything.
+ */
+static DEFINE_MUTEX(park_lock);
+static pthread_cond_t park_cond = PTHREAD_COND_INITIALIZER;
+static bool workers_parked;
+static int nr_parked;
+
+/* Completions of the current thread are deferred to this list, if set */
+static __thread struct blk_done *blk_done;
+
+static void virtio_blk_set_status(struct blk_dev_req *req, long len)
+{
+	u8 *status = req->status;
+
+	if (!status)
+		return;
+
+	if (len == -EOPNOTSUPP)
+		*status = VIRTIO_BLK_S_UNSUPP;
+	else
+		*status	= (len < 0) ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+}
+
+static void virtio_blk_account(struct blk_dev_req *req, long len, u64 now)
+{
+	disk_stats__end(req->bdev->disk, req->stat_op, req->len, req->start,
+			now, len < 0);
+}
+
+static void virtio_blk_kick(struct blk_dev_queue *queue)
+{
+	u64 data = 1;
+
+	if (write(queue->io_efd, &data, sizeof(data)) < 0)
+		pr_warning("virtio-blk: failed to kick queue %d", queue->id);
+}
+
+/* Called with flush_lock held */
+static bool virtio_blk_flush_ready(struct blk_dev *bdev,
+				   struct blk_dev_req *flush)
+{
+	struct blk_dev_req *oldest;
+
+	oldest = list_first_entry_or_null(&bdev->writes, struct blk_dev_req,
+					  flush_list);
+
+	return !oldest || oldest->seq >= flush->seq;
+}
+
+/* Give the async disk the flushes whose writes have all completed */
+static void virtio_blk_flush_submit(struct blk_dev *bdev)
+{
+	struct disk_io io = { .type = DISK_IO_FLUSH };
+	struct blk_dev_req *flush;
+
+	while (1) {
+		mutex_lock(&bdev->flush_lock);
+		flush = list_first_entry_or_null(&bdev->flushes,
+						 struct blk_dev_req, flush_list);
+		if (!flush || !virtio_blk_flush_ready(bdev, flush)) {
+			mutex_unlock(&bdev->flush_lock);
+			return;
+		}
+		list_del_init(&flush->flush_list);
+		__sync_fetch_and_sub(&bdev->nr_flushes, 1);
+		mutex_unlock(&bdev->flush_lock);
+
+		io.param = flush;
+		disk_image__submit_batch(bdev->disk, &io, 1);
+	}
+}
+
+static void virtio_blk_flush(struct blk_dev *bdev, struct blk_dev_req *req)
+{
+	struct blk_dev_req *last;
+
+	mutex_lock(&bdev->flush_lock);
+	req->seq = bdev->write_seq;
+	req->flush_joined = NULL;
+
+	last = bdev->last_flush;
+	if (last && last->seq == req->seq) {
+		req->flush_joined = last->flush_joined;
+		last->flush_joined = req;
+		mutex_unlock(&bdev->flush_lock);
+		return;
+	}
+
+	if (!last && bdev->flushed_seq == req->seq) {
+		mutex_unlock(&bdev->flush_lock);
+		virtio_blk_complete(req, 0);
+		return;
+	}
+
+	list_add_tail(&req->flush_list, &bdev->flushes);
+	__sync_fetch_and_add(&bdev->nr_flushes, 1);
+	bdev->last_flush = req;
+	mutex_unlock(&bdev->flush_lock);
+
+	virtio_blk_flush_submit(bdev);
+}
+
+/* Number the writes of a batch, before they are merged and submitted */
+static void virtio_blk_track_writes(struct blk_dev *bdev,
+				    struct blk_dev_batch *batch)
+{
+	struct blk_dev_req *req;
+	int i;
+
+	mutex_lock(&bdev->flush_lock);
+	for (i = 0; i < batch->nr; i++) {
+		if (batch->ios[i].type != DISK_IO_WRITE)
+			continue;
+
+		req = batch->ios[i].param;
+		req->seq = bdev->write_seq++;
+		list_add_tail(&req->flush_list, &bdev->writes);
+	}
+	mutex_unlock(&bdev->flush_lock);
+}
+
+/* For writes that bypass the tracking, such as discards */
+static void virtio_blk_dirty(struct blk_dev *bdev)
+{
+	mutex_lock(&bdev->flush_lock);
+	bdev->write_seq++;
+	mutex_unlock(&bdev->flush_lock);
+}
+
+/*
+ * Retire a write, and the ones merged behind it. If the oldest write is gone,
+ * the first waiting flush may be ready, in which case its queue is kicked to
+ * submit it. Submitting from here could deadlock with the disk reaping
+ * completions.
+ */
+static void virtio_blk_writes_done(struct blk_dev *bdev, struct blk_dev_req *req)
+{
+	struct blk_dev_queue *kick = NULL;
+	struct blk_dev_req *flush;
+
+	mutex_lock(&bdev->flush_lock);
+	for (; req; req = req->merge_next)
+		list_del(&req->flush_list);
+
+	flush = list_first_entry_or_null(&bdev->flushes, struct blk_dev_req,
+					 flush_list);
+	if (flush && virtio_blk_flush_ready(bdev, flush))
+		kick = flush->queue;
+	mutex_unlock(&bdev->flush_lock);
+
+	if (kick)
+		virtio_blk_kick(kick);
+}
+
+/* Returns the flushes that joined @req, which share its result */
+static struct blk_dev_req *virtio_blk_flush_done(struct blk_dev *bdev,
+						 struct blk_dev_req *req,
+						 long len)
+{
+	struct blk_dev_req *joined;
+
+	mutex_lock(&bdev->flush_lock);
+	if (bdev->last_flush == req)
+		bdev->last_flush = NULL;
+	if (len >= 0)
+		bdev->flushed_seq = max(bdev->flushed_seq, req->seq);
+	joined = req->flush_joined;
+	req->flush_joined = NULL;
+	mutex_unlock(&bdev->flush_lock);
+
+	return joined;
+}
+
+/*
+ * Drop the waiting flushes of a queue being reset. A flush that others
+ * joined hands its place over to the first of them. Returns the number of
+ * flushes dropped.
+ */
+static u32 virtio_blk_flush_forget(struct blk_dev *bdev,
+				   struct blk_dev_queue *queue)
+{
+	struct blk_dev_req *flush, *next, *heir, **joined;
+	u32 dropped = 0;
+
+	mutex_lock(&bdev->flush_lock);
+	list_for_each_entry_safe(flush, next, &bdev->flushes, flush_list) {
+		joined = &flush->flush_joined;
+		while (*joined) {
+			if ((*joined)->queue == queue) {
+				*joined = (*joined)->flush_joined;
+				dropped++;
+			} else {
+				joined = &(*joined)->flush_joined;
+			}
+		}
+
+		if (flush->queue != queue)
+			continue;
+
+		dropped++;
+
+		heir = flush->flush_joined;
+		if (heir) {
+			heir->seq = flush->seq;
+			list_replace_init(&flush->flush_list, &heir->flush_list);
+		} else {
+			list_del_init(&flush->flush_list);
+			__sync_fetch_and_sub(&bdev->nr_flushes, 1);
+		}
+		if (bdev->last_flush == flush)
+			bdev->last_flush = heir;
+	}
+	mutex_unlock(&bdev->flush_lock);
+
+	return dropped;
+}
+
+/*
+ * Hand the completed requests on @first back to the guest, a queue at a time:
+ * those of a queue are published with a single used ring update, under one
+ * acquisition of its lock, and the guest is signalled at most once for them.
+ * The list is followed before each request is handed back, since the guest
+ * may reuse it right away.
+ */
+static void virtio_blk_done(struct blk_dev_req *first)
+{
+	struct virt_queue_used_batch used;
+	struct blk_dev_req *req, *next, *rest, **last;
+	struct blk_dev_queue *queue;
+	struct blk_dev *bdev;
+	bool signal;
+	u32 nr;
+
+	while (first) {
+		queue	= first->queue;
+		bdev	= first->bdev;
+		rest	= NULL;
+		last	= &rest;
+		nr	= 0;
+
+		mutex_lock(&queue->mutex);
+		virt_queue__used_batch_init(&used, &queue->vq);
+		for (req = first; req; req = next) {
+			next = req->done_next;
+			if (req->queue != queue) {
+				*last = req;
+				last = &req->done_next;
+				continue;
+			}
+			virt_queue__used_batch_add(&used, req->head, req->done_len);
+			nr++;
+		}
+		*last = NULL;
+		signal = virt_queue__used_batch_publish(&used);
+		if (!__sync_sub_and_fetch(&queue->inflight, nr))
+			pthread_cond_broadcast(&queue->idle);
+		mutex_unlock(&queue->mutex);
+
+		if (signal)
+			bdev->vdev.ops->signal_vq(bdev->kvm, &bdev->vdev,
+						  queue->id);
+
+		first = rest;
+	}
+}
+
+/*
+ * Completes @param, along with the requests merged behind it, which share its
+ * fate. Within a worker event, the requests are only handed back once the
+ * event is handled, along with the others completed meanwhile.
+ */
 void virtio_blk_complete(void *param, long len)
 {
 	struct blk_dev_req *req = param;
 	struct blk_dev *bdev = req->bdev;
-	int queueid = req->vq - bdev->vqs;
-	u8 *status;
+	struct blk_dev_req *next, *joined = NULL;
+	struct blk_done done, *list = blk_done;
+	bool merged = req->merge_next;
+	u64 now;
+
+	if (bdev->disk->async) {
+		if (req->stat_op == DISK_STAT_WRITE)
+			virtio_blk_writes_done(bdev, req);
+		else if (req->stat_op == DISK_STAT_FLUSH)
+			joined = virtio_blk_flush_done(bdev, req, len);
+	}
+
+	if (req->merge_iov) {
+		free(req->merge_iov);
+		req->merge_iov = NULL;
+	}
+
+	if (!list) {
+		done.last = &done.first;
+		list = &done;
+	}
+
+	now = disk_stats__now();
+
+	for (; req; req = next) {
+		next = req->merge_next;
+		virtio_blk_account(req, len, now);
+		virtio_blk_set_status(req, len);
+
+		req->done_len	= merged && len >= 0 ? (long)req->len : len;
+		req->done_next	= NULL;
+		*list->last	= req;
+		list->last	= &req->done_next;
+	}
+
+	if (list == &done)
+		virtio_blk_done(done.first);
+
+	for (; joined; joined = next) {
+		next = joined->flush_joined;
+		joined->flush_joined = NULL;
+		virtio_blk_complete(joined, len);
+	}
+}
+
+/* Defer the completions of the current thread until virtio_blk_done_end() */
+static void virtio_blk_done_begin(struct blk_done *done)
+{
+	done->first	= NULL;
+	done->last	= &done->first;
+	blk_done	= done;
+}
+
+static void virtio_blk_done_end(struct blk_done *done)
+{
+	blk_done = NULL;
+	virtio_blk_done(done->first);
+}
+
+static bool virtio_blk_can_merge(struct disk_io *io, size_t len,
+				 int iovcount, struct disk_io *next)
+{
+	struct blk_dev_req *req = next->param;
+
+	return next->type == io->type &&
+	       !(len & (SECTOR_SIZE - 1)) &&
+	       next->sector == io->sector + (len >> SECTOR_SHIFT) &&
+	       (len + req->len) >> SECTOR_SHIFT <= VIRTIO_BLK_MERGE_MAX_SECTORS &&
+	       iovcount + next->iovcount <= IOV_MAX;
+}
+
+/*
+ * Replace the requests ios[first..last] of the batch with a single disk I/O
+ * spanning all of them. Returns false if the combined iovec can't be
+ * allocated, in which case the requests are submitted separately.
+ */
+static bool virtio_blk_merge_run(struct disk_io *ios, int first, int last,
+				 int iovcount, struct disk_io *merged)
+{
+	struct blk_dev_req *req, *prev = NULL;
+	struct iovec *iov;
+	int i, n = 0;
+
+	iov = malloc(iovcount * sizeof(*iov));
+	if (!iov)
+		return false;
+
+	for (i = first; i <= last; i++) {
+		memcpy(iov + n, ios[i].iov, ios[i].iovcount * sizeof(*iov));
+		n += ios[i].iovcount;
+
+		req = ios[i].param;
+		if (prev)
+			prev->merge_next = req;
+		prev = req;
+	}
+
+	req = ios[first].param;
+	req->merge_iov = iov;
+
+	*merged = (struct disk_io) {
+		.type		= ios[first].type,
+		.sector		= ios[first].sector,
+		.iov		= iov,
+		.iovcount	= iovcount,
+		.param		= req,
+	};
+
+	return true;
+}
+
+/*
+ * Combine runs of sector-contiguous reads, or writes, into one vectored disk
+ * I/O each. Guests that issue streams of small requests then cost the disk a
+ * single request per run. The requests of a run are completed together.
+ */
+static void virtio_blk_merge(struct blk_dev_batch *batch)
+{
+	struct disk_io *ios = batch->ios;
+	int first, last, nr = 0;
+	int iovcount;
+	size_t len;
+
+	for (first = 0; first < batch->nr; first = last + 1) {
+		len = ((struct blk_dev_req *)ios[first].param)->len;
+		iovcount = ios[first].iovcount;
+
+		for (last = first; last + 1 < batch->nr; last++) {
+			if (!virtio_blk_can_merge(&ios[first], len, iovcount,
+						  &ios[last + 1]))
+				break;
+
+			len += ((struct blk_dev_req *)ios[last + 1].param)->len;
+			iovcount += ios[last + 1].iovcount;
+		}
+
+		if (last > first &&
+		    virtio_blk_merge_run(ios, first, last, iovcount, &ios[nr])) {
+			nr++;
+			continue;
+		}
+
+		memmove(&ios[nr], &ios[first], (last - first + 1) * sizeof(*ios));
+		nr += last - first + 1;
+	}
+
+	batch->nr = nr;
+}
+
+static void virtio_blk_submit(struct blk_dev *bdev, struct blk_dev_batch *batch)
+{
+	if (!batch->nr)
+		return;
+
+	if (bdev->disk->async)
+		virtio_blk_track_writes(bdev, batch);
+
+	if (bdev->disk->merge && batch->nr > 1)
+		virtio_blk_merge(batch);
+
+	disk_image__submit_batch(bdev->disk, batch->ios, batch->nr);
+	batch->nr = 0;
+}
+
+/*
+ * The payload of discard and write zeroes requests is an array of ranges,
+ * each of them handled synchronously by the disk.
+ */
+static int virtio_blk_discard(struct blk_dev *bdev, u32 type,
+			      struct iovec *iov, size_t iovcount)
+{
+	struct virtio_blk_discard_write_zeroes range;
+	size_t nr_ranges;
+	u32 nr_sectors;
+	u64 sector;
+	u32 flags;
+	int r = 0;
+
+	nr_ranges = iov_size(iov, iovcount) / sizeof(range);
+	if (!nr_ranges || nr_ranges > VIRTIO_BLK_DISCARD_MAX_SEG)
+		return -EINVAL;
+
+	while (nr_ranges--) {
+		if (memcpy_fromiovec_safe(&range, &iov, sizeof(range), &iovcount))
+			return -EINVAL;
+
+		sector		= le64_to_cpu(range.sector);
+		nr_sectors	= le32_to_cpu(range.num_sectors);
+		flags		= le32_to_cpu(range.flags);
+
+		if (nr_sectors > VIRTIO_BLK_DISCARD_MAX_SECTORS)
+			return -EINVAL;
+
+		if (type == VIRTIO_BLK_T_DISCARD) {
+			/* Discard with unmap flag is reserved */
+			if (flags)
+				return -EOPNOTSUPP;
+			r = disk_image__discard(bdev->disk, sector, nr_sectors);
+		} else {
+			r = disk_image__write_zeroes(bdev->disk, sector, nr_sectors,
+					flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP);
+		}
+		if (r < 0)
+			return r;
+	}
 
-	/* status */
-	status = req->status;
-	*status	= (len < 0) ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+	return 0;
+}
+
+/*
+ * Add a read or write to the batch if the disk throttle admits it. Otherwise
+ * park it on the queue and arm the timer to retry it, so that the guest sees
+ * its requests slow down rather than fail.
+ */
+static bool virtio_blk_add_io(struct blk_dev_queue *queue,
+			      struct blk_dev_batch *batch, struct disk_io *io)
+{
+	struct blk_dev_req *req = io->param;
+	struct itimerspec its = {};
+	u64 delay;
+
+	delay = disk_throttle__admit(queue->bdev->disk, io->type, req->len);
+	if (delay) {
+		queue->throttled = *io;
+		its.it_value.tv_sec	= delay / 1000000000;
+		its.it_value.tv_nsec	= delay % 1000000000;
+		if (timerfd_settime(queue->timer_fd, 0, &its, NULL) < 0)
+			pr_warning("virtio-blk: failed to arm throttle timer");
+		return false;
+	}
+
+	/* The guest can make more requests available than the ring holds */
+	if (batch->nr == ARRAY_SIZE(batch->ios))
+		virtio_blk_submit(queue->bdev, batch);
+
+	batch->ios[batch->nr++] = *io;
+	queue->throttled.param = NULL;
+
+	return true;
+}
 
-	mutex_lock(&bdev->mutex);
-	virt_queue__set_used_elem(req->vq, req->head, len);
-	mutex_unlock(&bdev->mutex);
+/*
+ * Hand back a request that can't be parsed, with an error status if it has a
+ * buffer for one. A chain that was rejected, e.g. because it isn't in guest
+ * memory, has no buffers at all: nothing is written to it.
+ */
+static void virtio_blk_reject(struct blk_dev_req *req)
+{
+	struct iovec *iov = req->iov + req->out;
+	int i;
 
-	if (virtio_queue__should_signal(&bdev->vqs[queueid]))
-		bdev->vdev.ops->signal_vq(req->kvm, &bdev->vdev, queueid);
+	for (i = req->in - 1; i >= 0 && !req->status; i--) {
+		if (iov[i].iov_len)
+			req->status = iov[i].iov_base + iov[i].iov_len - 1;
+	}
+
+	virtio_blk_complete(req, req->status ? -EIO : 0);
 }
 
-static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, struct blk_dev_req *req)
+/*
+ * Reads and writes are only added to the batch here, and submitted together
+ * once the virtqueue has been drained. Any other request first pushes out the
+ * batch, so that it is processed in order with the reads and writes popped
+ * before it.
+ */
+static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq,
+				     struct blk_dev_req *req,
+				     struct blk_dev_batch *batch)
 {
+	struct disk_io io;
 	struct virtio_blk_outhdr req_hdr;
 	size_t iovcount, last_iov;
 	struct blk_dev *bdev;
@@ -92,10 +772,18 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, str
 	bdev		= req->bdev;
 	iov		= req->iov;
 
+	req->status	= NULL;
+	req->stat_op	= -1;
+	req->merge_iov	= NULL;
+	req->merge_next	= NULL;
+	req->len	= 0;
+	req->start	= disk_stats__start(bdev->disk);
+
 	iovcount = req->out;
 	len = memcpy_fromiovec_safe(&req_hdr, &iov, sizeof(req_hdr), &iovcount);
 	if (len) {
 		pr_warning("Failed to get header");
+		virtio_blk_reject(req);
 		return;
 	}
 
@@ -105,6 +793,7 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, str
 	iovcount += req->in;
 	if (!iov_size(iov, iovcount)) {
 		pr_warning("Invalid IOV");
+		virtio_blk_reject(req);
 		return;
 	}
 
@@ -119,12 +808,40 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, str
 
 	switch (type) {
 	case VIRTIO_BLK_T_IN:
-		disk_image__read(bdev->disk, sector, iov, iovcount, req);
+		req->stat_op = DISK_STAT_READ;
 		break;
 	case VIRTIO_BLK_T_OUT:
-		disk_image__write(bdev->disk, sector, iov, iovcount, req);
+		req->stat_op = DISK_STAT_WRITE;
+		break;
+	case VIRTIO_BLK_T_FLUSH:
+		req->stat_op = DISK_STAT_FLUSH;
+		break;
+	default:
+		req->stat_op = -1;
 		break;
+	}
+
+	if (type == VIRTIO_BLK_T_IN || type == VIRTIO_BLK_T_OUT) {
+		req->len = iov_size(iov, iovcount);
+		io = (struct disk_io) {
+			.type		= type == VIRTIO_BLK_T_IN ? DISK_IO_READ : DISK_IO_WRITE,
+			.sector		= sector,
+			.iov		= iov,
+			.iovcount	= iovcount,
+			.param		= req,
+		};
+		virtio_blk_add_io(req->queue, batch, &io);
+		return;
+	}
+
+	virtio_blk_submit(bdev, batch);
+
+	switch (type) {
 	case VIRTIO_BLK_T_FLUSH:
+		if (bdev->disk->async) {
+			virtio_blk_flush(bdev, req);
+			break;
+		}
 		len = disk_image__flush(bdev->disk);
 		virtio_blk_complete(req, len);
 		break;
@@ -133,26 +850,70 @@ static void virtio_blk_do_io_request(struct kvm *kvm, struct virt_queue *vq, str
 					     VIRTIO_BLK_ID_BYTES);
 		virtio_blk_complete(req, len);
 		break;
+	case VIRTIO_BLK_T_DISCARD:
+	case VIRTIO_BLK_T_WRITE_ZEROES:
+		len = virtio_blk_discard(bdev, type, iov, iovcount);
+		if (bdev->disk->async)
+			virtio_blk_dirty(bdev);
+		virtio_blk_complete(req, len);
+		break;
 	default:
 		pr_warning("request type %d", type);
+		virtio_blk_complete(req, -EOPNOTSUPP);
 		break;
 	}
 }
 
-static void virtio_blk_do_io(struct kvm *kvm, struct virt_queue *vq, struct blk_dev *bdev)
+/* Longest polling window of the queue, 0 if it isn't polled */
+static u64 virtio_blk_poll_max(struct blk_dev_queue *queue)
 {
+	return (u64)queue->bdev->disk->poll_us * 1000;
+}
+
+/*
+ * Gather every read and write available at the time of the kick and hand them
+ * to the disk in one go. A throttled request stops the gathering, and has to
+ * be admitted before anything else is popped.
+ */
+static void virtio_blk_do_io(struct kvm *kvm, struct blk_dev_queue *queue)
+{
+	struct blk_dev_batch batch = { .nr = 0 };
+	struct virt_queue *vq = &queue->vq;
+	struct blk_dev *bdev = queue->bdev;
 	struct blk_dev_req *req;
 	u16 head;
 
-	while (virt_queue__available(vq)) {
-		head		= virt_queue__pop(vq);
-		req		= &bdev->reqs[head];
-		req->head	= virt_queue__get_head_iov(vq, req->iov, &req->out,
-					&req->in, head, kvm);
-		req->vq		= vq;
+	/*
+	 * A flush queued after this check gets submitted by whoever queued it,
+	 * or by the queue kicked once its writes are done.
+	 */
+	if (__atomic_load_n(&bdev->nr_flushes, __ATOMIC_ACQUIRE))
+		virtio_blk_flush_submit(bdev);
 
-		virtio_blk_do_io_request(kvm, vq, req);
-	}
+	if (queue->throttled.param &&
+	    !virtio_blk_add_io(queue, &batch, &queue->throttled))
+		return;
+
+	/*
+	 * Kicks are useless while the queue is being drained. With polling,
+	 * they stay off until the worker gives up on it.
+	 */
+	virt_queue__disable_notify(vq);
+	do {
+		while (!queue->throttled.param && virt_queue__available(vq)) {
+			head		= virt_queue__pop(vq);
+			req		= &queue->reqs[head];
+			__sync_fetch_and_add(&queue->inflight, 1);
+			req->head	= virt_queue__get_head_iov(vq, req->iov,
+						&req->out, &req->in, head, kvm);
+			req->vq		= vq;
+
+			virtio_blk_do_io_request(kvm, vq, req, &batch);
+		}
+	} while (!virtio_blk_poll_max(queue) && virt_queue__enable_notify(vq) &&
+		 !queue->throttled.param);
+
+	virtio_blk_submit(bdev, &batch);
 }
 
 static u8 *get_config(struct kvm *kvm, void *dev)
@@ -169,16 +930,37 @@ static size_t get_config_size(struct kvm *kvm, void *dev)
 	return sizeof(bdev->blk_config);
 }
 
+/*
+ * O_DIRECT disks want requests aligned to the block size of the host, which
+ * the guest is asked to use as its logical block size, within what it takes.
+ */
+static u32 virtio_blk_block_size(struct disk_image *disk)
+{
+	u32 size = disk->dio_align;
+
+	if (size <= SECTOR_SIZE || size > 4096 || (size & (size - 1)))
+		return 0;
+
+	return size;
+}
+
 static u64 get_host_features(struct kvm *kvm, void *dev)
 {
 	struct blk_dev *bdev = dev;
+	struct disk_image *disk = bdev->disk;
+	bool writable = !disk->readonly;
 
 	return	1UL << VIRTIO_BLK_F_SEG_MAX
 		| 1UL << VIRTIO_BLK_F_FLUSH
 		| 1UL << VIRTIO_RING_F_EVENT_IDX
 		| 1UL << VIRTIO_RING_F_INDIRECT_DESC
 		| 1UL << VIRTIO_F_ANY_LAYOUT
-		| (bdev->disk->readonly ? 1UL << VIRTIO_BLK_F_RO : 0);
+		| 1ULL << VIRTIO_F_RING_PACKED
+		| (bdev->nr_queues > 1 ? 1UL << VIRTIO_BLK_F_MQ : 0)
+		| (virtio_blk_block_size(disk) ? 1UL << VIRTIO_BLK_F_BLK_SIZE : 0)
+		| (writable && disk->ops->discard ? 1UL << VIRTIO_BLK_F_DISCARD : 0)
+		| (writable && disk->ops->write_zeroes ? 1UL << VIRTIO_BLK_F_WRITE_ZEROES : 0)
+		| (disk->readonly ? 1UL << VIRTIO_BLK_F_RO : 0);
 }
 
 static void notify_status(struct kvm *kvm, void *dev, u32 status)
@@ -191,70 +973,383 @@ static void notify_status(struct kvm *kvm, void *dev, u32 status)
 
 	conf->capacity = virtio_host_to_guest_u64(bdev->vdev.endian, bdev->capacity);
 	conf->seg_max = virtio_host_to_guest_u32(bdev->vdev.endian, DISK_SEG_MAX);
+	conf->num_queues = virtio_host_to_guest_u16(bdev->vdev.endian, bdev->nr_queues);
+	conf->blk_size = virtio_host_to_guest_u32(bdev->vdev.endian,
+					virtio_blk_block_size(bdev->disk));
+
+	conf->max_discard_sectors = virtio_host_to_guest_u32(bdev->vdev.endian,
+					VIRTIO_BLK_DISCARD_MAX_SECTORS);
+	conf->max_discard_seg = virtio_host_to_guest_u32(bdev->vdev.endian,
+					VIRTIO_BLK_DISCARD_MAX_SEG);
+	conf->discard_sector_alignment = virtio_host_to_guest_u32(bdev->vdev.endian,
+					bdev->disk->discard_align ?: 1);
+	conf->max_write_zeroes_sectors = virtio_host_to_guest_u32(bdev->vdev.endian,
+					VIRTIO_BLK_DISCARD_MAX_SECTORS);
+	conf->max_write_zeroes_seg = virtio_host_to_guest_u32(bdev->vdev.endian,
+					VIRTIO_BLK_DISCARD_MAX_SEG);
+	conf->write_zeroes_may_unmap = 1;
 }
 
-static void *virtio_blk_thread(void *dev)
+/*
+ * Once a queue has been drained, keep checking it for new requests instead of
+ * waiting for a kick, which the guest is asked not to send meanwhile.
+ */
+static void virtio_blk_poll_start(struct blk_dev_queue *queue)
 {
-	struct blk_dev *bdev = dev;
+	u64 max_ns = virtio_blk_poll_max(queue);
+
+	if (!max_ns)
+		return;
+
+	/* The throttle timer takes over, no point in polling */
+	if (queue->throttled.param) {
+		if (!list_empty(&queue->poll_list)) {
+			list_del_init(&queue->poll_list);
+			virt_queue__enable_notify(&queue->vq);
+		}
+		return;
+	}
+
+	if (list_empty(&queue->poll_list)) {
+		if (!queue->poll_ns)
+			queue->poll_ns = max_ns;
+		virt_queue__disable_notify(&queue->vq);
+		list_add_tail(&queue->poll_list, &queue->worker->polling);
+	}
+
+	queue->poll_deadline = disk_stats__now() + queue->poll_ns;
+}
+
+static void virtio_blk_service(struct blk_dev_queue *queue)
+{
+	struct blk_done done;
+
+	virtio_blk_done_begin(&done);
+	virtio_blk_do_io(queue->bdev->kvm, queue);
+	virtio_blk_done_end(&done);
+	virtio_blk_poll_start(queue);
+}
+
+static void virtio_blk_poll(struct blk_worker *worker)
+{
+	struct blk_dev_queue *queue, *next;
+	u64 max_ns, now = disk_stats__now();
+
+	list_for_each_entry_safe(queue, next, &worker->polling, poll_list) {
+		max_ns = virtio_blk_poll_max(queue);
+
+		if (virt_queue__available(&queue->vq)) {
+			queue->poll_ns = min_t(u64, queue->poll_ns * 2, max_ns);
+			virtio_blk_service(queue);
+		} else if (now >= queue->poll_deadline) {
+			queue->poll_ns = max_t(u64, queue->poll_ns / 2,
+					       min_t(u64, VIRTIO_BLK_POLL_MIN_NS, max_ns));
+			list_del_init(&queue->poll_list);
+			/* Requests may have come in before kicks were back on */
+			if (virt_queue__enable_notify(&queue->vq))
+				virtio_blk_service(queue);
+		}
+	}
+}
+
+static void virtio_blk_handle_event(struct blk_dev_event *ev)
+{
+	struct blk_done done;
+	struct blk_dev_queue *queue;
+	struct blk_worker *worker;
+	struct blk_dev *bdev;
 	u64 data;
-	int r;
+
+	switch (ev->type) {
+	case BLK_EV_DONE:
+		bdev = container_of(ev, struct blk_dev, done_ev);
+		virtio_blk_done_begin(&done);
+		disk_image__reap(bdev->disk);
+		virtio_blk_done_end(&done);
+		break;
+	case BLK_EV_KICK:
+		queue = container_of(ev, struct blk_dev_queue, kick_ev);
+		if (!queue->enabled ||
+		    read(queue->io_efd, &data, sizeof(u64)) < 0)
+			break;
+		virtio_blk_service(queue);
+		break;
+	case BLK_EV_TIMER:
+		/* The throttle delay of the parked request is over */
+		queue = container_of(ev, struct blk_dev_queue, timer_ev);
+		if (!queue->enabled ||
+		    read(queue->timer_fd, &data, sizeof(u64)) < 0)
+			break;
+		virtio_blk_service(queue);
+		break;
+	case BLK_EV_WAKE:
+		/* Only there to get the worker to virtio_blk_park() */
+		worker = container_of(ev, struct blk_worker, wake_ev);
+		if (read(worker->wake_fd, &data, sizeof(u64)) < 0 &&
+		    errno != EAGAIN)
+			pr_warning("virtio-blk: failed to read wake event");
+		break;
+	}
+}
+
+static void virtio_blk_park_cleanup(void *param)
+{
+	nr_parked--;
+	mutex_unlock(&park_lock);
+}
+
+/* Wait for virtio_blk__continue() if virtio_blk__pause() asked us to */
+static void virtio_blk_park(void)
+{
+	if (!__atomic_load_n(&workers_parked, __ATOMIC_ACQUIRE))
+		return;
+
+	mutex_lock(&park_lock);
+	nr_parked++;
+	pthread_cond_broadcast(&park_cond);
+
+	pthread_cleanup_push(virtio_blk_park_cleanup, NULL);
+	while (workers_parked)
+		pthread_cond_wait(&park_cond, &park_lock.mutex);
+	pthread_cleanup_pop(1);
+}
+
+static void *virtio_blk_worker(void *p)
+{
+	struct epoll_event events[VIRTIO_BLK_WORKER_EVENTS];
+	struct blk_worker *worker = p;
+	int i, nr, timeout;
 
 	kvm__set_thread_name("virtio-blk-io");
 
 	while (1) {
-		r = read(bdev->io_efd, &data, sizeof(u64));
-		if (r < 0)
+		virtio_blk_park();
+
+		timeout = list_empty(&worker->polling) ? -1 : 0;
+		nr = epoll_wait(worker->epoll_fd, events, ARRAY_SIZE(events),
+				timeout);
+		if (nr < 0)
 			continue;
-		virtio_blk_do_io(bdev->kvm, &bdev->vqs[0], bdev);
+
+		mutex_lock(&worker->lock);
+		for (i = 0; i < nr; i++)
+			virtio_blk_handle_event(events[i].data.ptr);
+		virtio_blk_poll(worker);
+		mutex_unlock(&worker->lock);
 	}
 
 	pthread_exit(NULL);
 	return NULL;
 }
 
+/*
+ * Keep the workers from submitting anything until virtio_blk__continue(). The
+ * events being handled are finished first. The disks are drained after this:
+ * with no worker reaping, the drain does it.
+ */
+static int virtio_blk__pause(struct kvm *kvm)
+{
+	u64 data = 1;
+	int i;
+
+	mutex_lock(&park_lock);
+	__atomic_store_n(&workers_parked, true, __ATOMIC_RELEASE);
+	for (i = 0; i < nr_workers; i++) {
+		if (write(workers[i].wake_fd, &data, sizeof(data)) < 0)
+			pr_warning("virtio-blk: failed to wake worker %d", i);
+	}
+
+	while (nr_parked < nr_workers)
+		pthread_cond_wait(&park_cond, &park_lock.mutex);
+	mutex_unlock(&park_lock);
+
+	return 0;
+}
+virtio_dev_pause(virtio_blk__pause);
+
+static int virtio_blk__continue(struct kvm *kvm)
+{
+	mutex_lock(&park_lock);
+	workers_parked = false;
+	pthread_cond_broadcast(&park_cond);
+	mutex_unlock(&park_lock);
+
+	return 0;
+}
+virtio_dev_continue(virtio_blk__continue);
+
+static int virtio_blk_watch(struct blk_worker *worker, int fd,
+			    struct blk_dev_event *ev)
+{
+	struct epoll_event event = {
+		.events		= EPOLLIN,
+		.data.ptr	= ev,
+	};
+
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void virtio_blk_unwatch(struct blk_worker *worker, int fd)
+{
+	if (fd >= 0)
+		epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static void virtio_blk_stop_workers(void)
+{
+	int i;
+
+	for (i = 0; i < nr_workers; i++) {
+		pthread_cancel(workers[i].thread);
+		pthread_join(workers[i].thread, NULL);
+		close(workers[i].epoll_fd);
+		close(workers[i].wake_fd);
+	}
+
+	free(workers);
+	workers = NULL;
+	nr_workers = 0;
+}
+
+/* One worker per host CPU, but no more than there are queues to service */
+static int virtio_blk_start_workers(struct kvm *kvm)
+{
+	int i, r, nr_queues = 0;
+	long nr_cpus;
+
+	for (i = 0; i < kvm->nr_disks; i++) {
+		if (!kvm->disks[i]->wwpn)
+			nr_queues += kvm->disks[i]->nr_queues ?: 1;
+	}
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nr_workers = max(1L, min_t(long, nr_queues, nr_cpus));
+
+	workers = calloc(nr_workers, sizeof(*workers));
+	if (!workers)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_workers; i++) {
+		mutex_init(&workers[i].lock);
+		INIT_LIST_HEAD(&workers[i].polling);
+		workers[i].wake_ev.type = BLK_EV_WAKE;
+		workers[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (workers[i].epoll_fd < 0) {
+			r = -errno;
+			goto err;
+		}
+
+		workers[i].wake_fd = eventfd(0, EFD_NONBLOCK);
+		if (workers[i].wake_fd < 0) {
+			r = -errno;
+			close(workers[i].epoll_fd);
+			goto err;
+		}
+
+		r = virtio_blk_watch(&workers[i], workers[i].wake_fd,
+				     &workers[i].wake_ev);
+		if (!r && pthread_create(&workers[i].thread, NULL,
+					 virtio_blk_worker, &workers[i]))
+			r = -errno;
+		if (r) {
+			close(workers[i].wake_fd);
+			close(workers[i].epoll_fd);
+			goto err;
+		}
+	}
+
+	return 0;
+err:
+	nr_workers = i;
+	virtio_blk_stop_workers();
+	return r;
+}
+
 static int init_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	unsigned int i;
+	int r;
 	struct blk_dev *bdev = dev;
+	struct blk_dev_queue *queue = &bdev->queues[vq];
 
 	compat__remove_message(compat_id);
 
-	virtio_init_device_vq(kvm, &bdev->vdev, &bdev->vqs[vq],
+	virtio_init_device_vq(kvm, &bdev->vdev, &queue->vq,
 			      VIRTIO_BLK_QUEUE_SIZE);
 
-	if (vq != 0)
-		return 0;
+	if (!queue->reqs) {
+		queue->reqs = calloc(VIRTIO_BLK_QUEUE_SIZE, sizeof(*queue->reqs));
+		if (!queue->reqs)
+			return -ENOMEM;
+	}
 
-	for (i = 0; i < ARRAY_SIZE(bdev->reqs); i++) {
-		bdev->reqs[i] = (struct blk_dev_req) {
+	for (i = 0; i < VIRTIO_BLK_QUEUE_SIZE; i++) {
+		queue->reqs[i] = (struct blk_dev_req) {
 			.bdev = bdev,
+			.queue = queue,
 			.kvm = kvm,
 		};
 	}
 
-	mutex_init(&bdev->mutex);
-	bdev->io_efd = eventfd(0, 0);
-	if (bdev->io_efd < 0)
+	queue->id = vq;
+	queue->bdev = bdev;
+	queue->kick_ev.type = BLK_EV_KICK;
+	queue->timer_ev.type = BLK_EV_TIMER;
+	mutex_init(&queue->mutex);
+	if (queue->io_efd < 0)
+		queue->io_efd = eventfd(0, EFD_NONBLOCK);
+	if (queue->io_efd < 0)
 		return -errno;
 
-	if (pthread_create(&bdev->io_thread, NULL, virtio_blk_thread, bdev))
+	queue->throttled.param = NULL;
+	queue->poll_ns = 0;
+	if (queue->timer_fd < 0)
+		queue->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (queue->timer_fd < 0)
 		return -errno;
 
-	return 0;
+	mutex_lock(&queue->worker->lock);
+	queue->enabled = true;
+	mutex_unlock(&queue->worker->lock);
+
+	r = virtio_blk_watch(queue->worker, queue->io_efd, &queue->kick_ev);
+	if (!r)
+		r = virtio_blk_watch(queue->worker, queue->timer_fd,
+				     &queue->timer_ev);
+
+	return r;
 }
 
 static void exit_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct blk_dev *bdev = dev;
+	struct blk_dev_queue *queue = &bdev->queues[vq];
+	u32 dropped = 0;
+
+	mutex_lock(&queue->worker->lock);
+	list_del_init(&queue->poll_list);
+	virtio_blk_unwatch(queue->worker, queue->io_efd);
+	virtio_blk_unwatch(queue->worker, queue->timer_fd);
+	queue->enabled = false;
+	/* Held back by the throttle, it is never going to be submitted */
+	if (queue->throttled.param) {
+		queue->throttled.param = NULL;
+		dropped++;
+	}
+	mutex_unlock(&queue->worker->lock);
 
-	if (vq != 0)
-		return;
-
-	close(bdev->io_efd);
-	pthread_cancel(bdev->io_thread);
-	pthread_join(bdev->io_thread, NULL);
+	if (bdev->disk->async)
+		dropped += virtio_blk_flush_forget(bdev, queue);
 
-	disk_image__wait(bdev->disk);
+	/* Other queues keep going, only wait for the requests of this one */
+	mutex_lock(&queue->mutex);
+	__sync_sub_and_fetch(&queue->inflight, dropped);
+	while (queue->inflight)
+		pthread_cond_wait(&queue->idle, &queue->mutex.mutex);
+	mutex_unlock(&queue->mutex);
 }
 
 static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
@@ -263,7 +1358,7 @@ static int notify_vq(struct kvm *kvm, void *dev, u32 vq)
 	u64 data = 1;
 	int r;
 
-	r = write(bdev->io_efd, &data, sizeof(data));
+	r = write(bdev->queues[vq].io_efd, &data, sizeof(data));
 	if (r < 0)
 		return r;
 
@@ -274,7 +1369,7 @@ static struct virt_queue *get_vq(struct kvm *kvm, void *dev, u32 vq)
 {
 	struct blk_dev *bdev = dev;
 
-	return &bdev->vqs[vq];
+	return &bdev->queues[vq].vq;
 }
 
 static int get_size_vq(struct kvm *kvm, void *dev, u32 vq)
@@ -291,7 +1386,9 @@ static int set_size_vq(struct kvm *kvm, void *dev, u32 vq, int size)
 
 static unsigned int get_vq_count(struct kvm *kvm, void *dev)
 {
-	return NUM_VIRT_QUEUES;
+	struct blk_dev *bdev = dev;
+
+	return bdev->nr_queues;
 }
 
 static struct virtio_ops blk_dev_virtio_ops = {
@@ -311,7 +1408,7 @@ static struct virtio_ops blk_dev_virtio_ops = {
 static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 {
 	struct blk_dev *bdev;
-	int r;
+	int i, r, fd;
 
 	if (!disk)
 		return -EINVAL;
@@ -323,11 +1420,42 @@ static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 	*bdev = (struct blk_dev) {
 		.disk			= disk,
 		.capacity		= disk->size / SECTOR_SIZE,
+		.nr_queues		= disk->nr_queues ?: 1,
+		.done_ev.type		= BLK_EV_DONE,
 		.kvm			= kvm,
 	};
 
+	for (i = 0; i < bdev->nr_queues; i++) {
+		bdev->queues[i].io_efd = bdev->queues[i].timer_fd = -1;
+		bdev->queues[i].worker = &workers[next_worker++ % nr_workers];
+		INIT_LIST_HEAD(&bdev->queues[i].poll_list);
+		pthread_cond_init(&bdev->queues[i].idle, NULL);
+	}
+
+	mutex_init(&bdev->flush_lock);
+	bdev->write_seq = 1;
+	INIT_LIST_HEAD(&bdev->writes);
+	INIT_LIST_HEAD(&bdev->flushes);
+
 	list_add_tail(&bdev->list, &bdevs);
 
+	/*
+	 * The disk has a single async context, whose completions are those of
+	 * all the queues mixed together, so a single worker reaps them. More
+	 * reapers would only contend on the context, without steering anything
+	 * to the worker of its queue. Each queue still gets its completions
+	 * handed back under its own lock, with one signal per queue. Since the
+	 * first queues of the disks are spread over the workers, so are the
+	 * reapers.
+	 */
+	fd = disk_image__completion_fd(disk);
+	if (fd >= 0) {
+		bdev->worker = bdev->queues[0].worker;
+		r = virtio_blk_watch(bdev->worker, fd, &bdev->done_ev);
+		if (r < 0)
+			return r;
+	}
+
 	r = virtio_init(kvm, bdev, &bdev->vdev, &blk_dev_virtio_ops,
 			kvm->cfg.virtio_transport, PCI_DEVICE_ID_VIRTIO_BLK,
 			VIRTIO_ID_BLOCK, PCI_CLASS_BLK);
@@ -336,6 +1464,14 @@ static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 
 	disk_image__set_callback(bdev->disk, virtio_blk_complete);
 
+	if (disk->coalesce_usecs) {
+		r = virtio_coalesce__init(kvm, bdev, &bdev->vdev,
+					  disk->coalesce_usecs,
+					  disk->coalesce_frames);
+		if (r < 0)
+			return r;
+	}
+
 	if (compat_id == -1)
 		compat_id = virtio_compat_add_message("virtio-blk", "CONFIG_VIRTIO_BLK");
 
@@ -344,8 +1480,26 @@ static int virtio_blk__init_one(struct kvm *kvm, struct disk_image *disk)
 
 static int virtio_blk__exit_one(struct kvm *kvm, struct blk_dev *bdev)
 {
+	int i;
+
 	list_del(&bdev->list);
+	virtio_coalesce__exit(&bdev->vdev);
 	virtio_exit(kvm, &bdev->vdev);
+	if (bdev->worker) {
+		mutex_lock(&bdev->worker->lock);
+		virtio_blk_unwatch(bdev->worker,
+				   disk_image__completion_fd(bdev->disk));
+		mutex_unlock(&bdev->worker->lock);
+	}
+	for (i = 0; i < bdev->nr_queues; i++) {
+		struct blk_dev_queue *queue = &bdev->queues[i];
+
+		if (queue->io_efd >= 0)
+			close(queue->io_efd);
+		if (queue->timer_fd >= 0)
+			close(queue->timer_fd);
+		free(queue->reqs);
+	}
 	free(bdev);
 
 	return 0;
@@ -355,6 +1509,13 @@ int virtio_blk__init(struct kvm *kvm)
 {
 	int i, r = 0;
 
+	if (!kvm->nr_disks)
+		return 0;
+
+	r = virtio_blk_start_workers(kvm);
+	if (r < 0)
+		return r;
+
 	for (i = 0; i < kvm->nr_disks; i++) {
 		if (kvm->disks[i]->wwpn)
 			continue;
@@ -379,6 +1540,8 @@ int virtio_blk__exit(struct kvm *kvm)
 		virtio_blk__exit_one(kvm, bdev);
 	}
 
+	virtio_blk_stop_workers();
+
 	return 0;
 }
 virtio_dev_exit(virtio_blk__exit);
@@ -0,0 +1,243 @@
+#include "kvm/virtio.h"
+#include "kvm/epoll.h"
+#include "kvm/mutex.h"
+#include "kvm/kvm.h"
+
+#include <sys/timerfd.h>
+
+/*
+ * Interrupt coalescing. Once the guest wants to be signalled about a queue,
+ * the interrupt is held back until max_usecs have passed, or until max_frames
+ * buffers have been used since the guest was last signalled, so that one
+ * interrupt covers the buffers used meanwhile. The timers of all queues are
+ * handled by a single thread.
+ */
+struct virt_queue_coalesce {
+	struct mutex		lock;
+	struct kvm		*kvm;
+	struct virtio_device	*vdev;
+	struct virt_queue	*vq;
+	u32			id;
+	u32			max_usecs;
+	u32			max_frames;
+	int			timer_fd;
+	/* An interrupt is being held back */
+	bool			held;
+	/* Used elements published when the guest was last signalled */
+	u32			signalled;
+};
+
+struct virtio_coalesce {
+	unsigned int		nr_queues;
+	struct virt_queue_coalesce queues[];
+};
+
+static struct kvm__epoll epoll;
+
+static void virtio_coalesce__expire(struct kvm *kvm, struct epoll_event *ev)
+{
+	struct virt_queue_coalesce *c = ev->data.ptr;
+	bool signal;
+	u64 tmp;
+
+	/* Nothing to read if the timer was rearmed since it fired */
+	if (read(c->timer_fd, &tmp, sizeof(tmp)) < 0)
+		return;
+
+	mutex_lock(&c->lock);
+	signal		= c->held;
+	c->held		= false;
+	c->signalled	= c->vq->nr_used;
+	mutex_unlock(&c->lock);
+
+	if (signal && c->vdev->ops->signal_vq(kvm, c->vdev, c->id))
+		pr_warning("%s failed to signal virtqueue", __func__);
+}
+
+static int virtio_coalesce__start(struct kvm *kvm)
+{
+	if (epoll.fd)
+		return 0;
+
+	if (epoll__init(kvm, &epoll, "virtio-coalesce", virtio_coalesce__expire))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Called by devices with the limits of all their queues, once there is
+ * something to coalesce: after virtio_init() if they are configured with
+ * limits, or when the guest first sets some. Queues already set up are
+ * attached right away, the others when they are.
+ */
+int virtio_coalesce__init(struct kvm *kvm, void *dev, struct virtio_device *vdev,
+			  u32 max_usecs, u32 max_frames)
+{
+	struct epoll_event event = { .events = EPOLLIN };
+	struct virt_queue_coalesce *c;
+	struct virtio_coalesce *coalesce;
+	unsigned int i, nr;
+	int r;
+
+	r = virtio_coalesce__start(kvm);
+	if (r)
+		return r;
+
+	nr = vdev->ops->get_vq_count(kvm, dev);
+	coalesce = calloc(1, sizeof(*coalesce) + nr * sizeof(*c));
+	if (!coalesce)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		c = &coalesce->queues[i];
+		c->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					     TFD_NONBLOCK | TFD_CLOEXEC);
+		if (c->timer_fd < 0) {
+			r = -errno;
+			goto err_close;
+		}
+
+		event.data.ptr = c;
+		if (epoll_ctl(epoll.fd, EPOLL_CTL_ADD, c->timer_fd, &event) < 0) {
+			r = -errno;
+			close(c->timer_fd);
+			goto err_close;
+		}
+
+		mutex_init(&c->lock);
+		c->kvm		= kvm;
+		c->vdev		= vdev;
+		c->vq		= vdev->ops->get_vq(kvm, dev, i);
+		c->id		= i;
+		c->max_usecs	= max_usecs;
+		c->max_frames	= max_frames;
+		c->signalled	= c->vq->nr_used;
+		coalesce->nr_queues++;
+	}
+
+	__atomic_store_n(&vdev->coalesce, coalesce, __ATOMIC_RELEASE);
+
+	for (i = 0; i < nr; i++) {
+		c = &coalesce->queues[i];
+		if (c->vq->enabled)
+			__atomic_store_n(&c->vq->coalesce, c, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+
+err_close:
+	for (i = 0; i < coalesce->nr_queues; i++)
+		close(coalesce->queues[i].timer_fd);
+	free(coalesce);
+	return r;
+}
+
+void virtio_coalesce__exit(struct virtio_device *vdev)
+{
+	struct virtio_coalesce *coalesce = vdev->coalesce;
+	unsigned int i;
+
+	if (!coalesce)
+		return;
+
+	for (i = 0; i < coalesce->nr_queues; i++) {
+		epoll_ctl(epoll.fd, EPOLL_CTL_DEL, coalesce->queues[i].timer_fd,
+			  NULL);
+		close(coalesce->queues[i].timer_fd);
+	}
+
+	vdev->coalesce = NULL;
+	free(coalesce);
+}
+
+void virtio_coalesce__set(struct virtio_device *vdev, u32 id, u32 max_usecs,
+			  u32 max_frames)
+{
+	struct virt_queue_coalesce *c;
+
+	if (!vdev->coalesce || id >= vdev->coalesce->nr_queues)
+		return;
+
+	c = &vdev->coalesce->queues[id];
+	mutex_lock(&c->lock);
+	c->max_usecs	= max_usecs;
+	c->max_frames	= max_frames;
+	mutex_unlock(&c->lock);
+}
+
+/* Called when the queue is set up, with a count of used elements back at 0 */
+void virtio_coalesce__attach(struct virtio_device *vdev, struct virt_queue *vq)
+{
+	struct virtio_coalesce *coalesce;
+	struct virt_queue_coalesce *c;
+	unsigned int i;
+
+	coalesce = __atomic_load_n(&vdev->coalesce, __ATOMIC_ACQUIRE);
+	if (!coalesce)
+		return;
+
+	for (i = 0; i < coalesce->nr_queues; i++) {
+		c = &coalesce->queues[i];
+		if (c->vq != vq)
+			continue;
+
+		mutex_lock(&c->lock);
+		c->held		= false;
+		c->signalled	= 0;
+		mutex_unlock(&c->lock);
+		__atomic_store_n(&vq->coalesce, c, __ATOMIC_RELEASE);
+		return;
+	}
+}
+
+/*
+ * Decide whether to signal the guest now, given whether it wants to be. An
+ * interrupt held back is delivered by the timer, if not by a later call.
+ */
+bool virtio_coalesce__should_signal(struct virt_queue *vq, bool wanted)
+{
+	struct virt_queue_coalesce *c = vq->coalesce;
+	struct itimerspec its = {};
+	bool signal = false;
+
+	/* Disabled, with no interrupt left to deliver */
+	if (!__atomic_load_n(&c->max_usecs, __ATOMIC_RELAXED) &&
+	    !__atomic_load_n(&c->held, __ATOMIC_RELAXED))
+		return wanted;
+
+	mutex_lock(&c->lock);
+
+	/* Only a timer guarantees that a held interrupt is ever delivered */
+	if (!c->max_usecs) {
+		signal = wanted || c->held;
+		goto out_signal;
+	}
+
+	if (!wanted && !c->held)
+		goto out;
+
+	if (c->max_frames && vq->nr_used - c->signalled >= c->max_frames) {
+		signal = true;
+		goto out_signal;
+	}
+
+	if (c->held)
+		goto out;
+
+	its.it_value.tv_sec	= c->max_usecs / 1000000;
+	its.it_value.tv_nsec	= (c->max_usecs % 1000000) * 1000;
+	if (timerfd_settime(c->timer_fd, 0, &its, NULL) < 0) {
+		signal = true;
+		goto out_signal;
+	}
+	c->held = true;
+	goto out;
+
+out_signal:
+	c->held		= false;
+	c->signalled	= vq->nr_used;
+out:
+	mutex_unlock(&c->lock);
+	return signal;
+}
@@ -98,12 +98,15 @@ static void virtio_console_handle_callback(struct kvm *kvm, void *param)
 	 * So there is no need to inject an interrupt for the tx path.
 	 */
 
-	while (virt_queue__available(vq)) {
-		head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-		len = term_putc_iov(iov, out, 0);
-		virt_queue__set_used_elem(vq, head, len);
-	}
-
+	/* No kicks while draining, check again once they are back on */
+	do {
+		virt_queue__disable_notify(vq);
+		while (virt_queue__available(vq)) {
+			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+			len = term_putc_iov(iov, out, 0);
+			virt_queue__set_used_elem(vq, head, len);
+		}
+	} while (virt_queue__enable_notify(vq));
 }
 
 static u8 *get_config(struct kvm *kvm, void *dev)
@@ -122,7 +125,7 @@ static size_t get_config_size(struct kvm *kvm, void *dev)
 
 static u64 get_host_features(struct kvm *kvm, void *dev)
 {
-	return 1 << VIRTIO_F_ANY_LAYOUT;
+	return 1 << VIRTIO_F_ANY_LAYOUT | 1ULL << VIRTIO_F_RING_PACKED;
 }
 
 static void notify_status(struct kvm *kvm, void *dev, u32 status)
@@ -51,10 +51,268 @@ int virtio_transport_parser(const struct option *opt, const char *arg, int unset
 	return 0;
 }
 
+/*
+ * Buffers must be contiguous in our address space. A descriptor straddling two
+ * banks, or outside of them, fails the whole chain, which is then handed to
+ * the device without any iovec: leaving it out would shift the data of the
+ * descriptors after it.
+ */
+static bool virt_desc__map(struct kvm *kvm, struct iovec *iov, u64 addr,
+			   u32 len)
+{
+	iov->iov_base	= guest_flat_to_host_range(kvm, addr, len);
+	iov->iov_len	= len;
+
+	if (!iov->iov_base) {
+		WARN_ONCE(1, "virtio: descriptor at 0x%llx (%u bytes) isn't in guest memory",
+			  (unsigned long long)addr, len);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Packed rings, where the driver makes descriptors available and the device
+ * marks them used in place, in a single ring. A descriptor is available when
+ * its AVAIL flag matches the driver's wrap counter and its USED flag doesn't,
+ * and used when both match the device's wrap counter, which flip every time
+ * the ring wraps around.
+ */
+static u16 virt_packed__flags(struct virt_queue *vq, u16 idx)
+{
+	return virtio_guest_to_host_u16(vq->endian, vq->desc_packed[idx].flags);
+}
+
+static bool virt_packed__is_avail(u16 flags, bool wrap)
+{
+	bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+	bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+
+	return avail == wrap && used != wrap;
+}
+
+static void virt_packed__next(struct virt_queue *vq, u16 *idx, bool *wrap)
+{
+	if (++*idx == vq->vring.num) {
+		*idx = 0;
+		*wrap = !*wrap;
+	}
+}
+
+bool virt_queue__available_packed(struct virt_queue *vq)
+{
+	if (!vq->desc_packed)
+		return false;
+
+	return virt_packed__is_avail(virt_packed__flags(vq, vq->last_avail_idx),
+				     vq->avail_wrap);
+}
+
+/*
+ * Take the next buffer, and remember where its descriptors are. The buffer id
+ * is in the last descriptor of the chain.
+ */
+u16 virt_queue__pop_packed(struct virt_queue *vq)
+{
+	u16 pos = vq->last_avail_idx;
+	struct vring_packed_desc *desc;
+	u16 flags, id, n = 0;
+
+	/* Read the descriptors after their flags said they are available */
+	rmb();
+
+	do {
+		desc	= &vq->desc_packed[vq->last_avail_idx];
+		flags	= virtio_guest_to_host_u16(vq->endian, desc->flags);
+		id	= virtio_guest_to_host_u16(vq->endian, desc->id);
+		virt_packed__next(vq, &vq->last_avail_idx, &vq->avail_wrap);
+	} while (++n < vq->vring.num && (flags & VRING_DESC_F_NEXT) &&
+		 !(flags & VRING_DESC_F_INDIRECT));
+
+	/* Keep a buggy guest from making us write out of bounds */
+	id %= vq->vring.num;
+	vq->bufs[id] = (struct virt_queue_packed_buf) {
+		.pos		= pos,
+		.nr_descs	= n,
+	};
+
+	return id;
+}
+
+/*
+ * The iovec arrays of the devices are sized for their queues, so a buffer
+ * can't have more descriptors than the ring. Returns false once it has, or if
+ * the buffer is rejected.
+ */
+static bool virt_packed__add_iov(struct virt_queue *vq, struct kvm *kvm,
+				 struct vring_packed_desc *desc,
+				 struct iovec out_iov[], struct iovec in_iov[],
+				 u16 *out, u16 *in)
+{
+	u16 flags = virtio_guest_to_host_u16(vq->endian, desc->flags);
+	struct iovec *iov;
+
+	if (*out + *in >= vq->vring.num)
+		return false;
+
+	/* Without an array for input descriptors, all go to out_iov */
+	if (!in_iov)
+		iov = &out_iov[*out + *in];
+	else if (flags & VRING_DESC_F_WRITE)
+		iov = &in_iov[*in];
+	else
+		iov = &out_iov[*out];
+
+	if (!virt_desc__map(kvm, iov,
+			    virtio_guest_to_host_u64(vq->endian, desc->addr),
+			    virtio_guest_to_host_u32(vq->endian, desc->len))) {
+		*out = *in = 0;
+		return false;
+	}
+
+	if (flags & VRING_DESC_F_WRITE)
+		(*in)++;
+	else
+		(*out)++;
+
+	return true;
+}
+
+static void virt_packed__get_iov(struct virt_queue *vq, struct kvm *kvm,
+				 u16 head, struct iovec out_iov[],
+				 struct iovec in_iov[], u16 *out, u16 *in)
+{
+	struct virt_queue_packed_buf *buf = &vq->bufs[head];
+	struct vring_packed_desc *desc, *table;
+	u16 i, idx = buf->pos;
+	u32 j, nr;
+
+	*out = *in = 0;
+
+	for (i = 0; i < buf->nr_descs; i++, idx = (idx + 1) % vq->vring.num) {
+		desc = &vq->desc_packed[idx];
+
+		if (!(virtio_guest_to_host_u16(vq->endian, desc->flags) &
+		      VRING_DESC_F_INDIRECT)) {
+			if (!virt_packed__add_iov(vq, kvm, desc, out_iov,
+						  in_iov, out, in))
+				return;
+			continue;
+		}
+
+		nr	= virtio_guest_to_host_u32(vq->endian, desc->len) /
+			  sizeof(*table);
+		if (nr > vq->vring.num) {
+			pr_warning("virtio: indirect table of %u descriptors", nr);
+			*out = *in = 0;
+			return;
+		}
+
+		table	= guest_flat_to_host_range(kvm,
+				virtio_guest_to_host_u64(vq->endian, desc->addr),
+				nr * sizeof(*table));
+		if (!table) {
+			*out = *in = 0;
+			return;
+		}
+
+		for (j = 0; j < nr; j++) {
+			if (!virt_packed__add_iov(vq, kvm, &table[j], out_iov,
+						  in_iov, out, in))
+				return;
+		}
+	}
+}
+
+/*
+ * A used element takes the place of the first descriptor of its buffer, and
+ * the next one goes after all of them. The flags of the first element of a
+ * batch are written last, so that the guest sees the whole batch at once.
+ */
+static void virt_packed__set_used(struct virt_queue *vq, u32 head, u32 len,
+				  u16 offset)
+{
+	struct vring_packed_desc *desc;
+	u16 flags, i;
+
+	if (!offset) {
+		vq->pending_idx		= vq->used_idx;
+		vq->pending_wrap	= vq->used_wrap;
+	}
+
+	desc		= &vq->desc_packed[vq->pending_idx];
+	desc->id	= virtio_host_to_guest_u16(vq->endian, head);
+	desc->len	= virtio_host_to_guest_u32(vq->endian, len);
+	flags		= vq->pending_wrap ? 1 << VRING_PACKED_DESC_F_AVAIL |
+					     1 << VRING_PACKED_DESC_F_USED : 0;
+
+	if (!offset) {
+		vq->pending_flags = flags;
+	} else {
+		/* The id and length must be visible before the flags */
+		wmb();
+		desc->flags = virtio_host_to_guest_u16(vq->endian, flags);
+	}
+
+	for (i = 0; i < vq->bufs[head % vq->vring.num].nr_descs; i++)
+		virt_packed__next(vq, &vq->pending_idx, &vq->pending_wrap);
+}
+
+static void virt_packed__publish(struct virt_queue *vq)
+{
+	wmb();
+	vq->desc_packed[vq->used_idx].flags =
+		virtio_host_to_guest_u16(vq->endian, vq->pending_flags);
+	vq->used_idx	= vq->pending_idx;
+	vq->used_wrap	= vq->pending_wrap;
+}
+
+static bool virt_packed__should_signal(struct virt_queue *vq)
+{
+	u16 flags, off_wrap, old, new;
+	bool valid;
+	int event;
+
+	/* As for split rings, publish the used elements first */
+	mb();
+
+	flags		= virtio_guest_to_host_u16(vq->endian,
+						   vq->driver_event->flags);
+	off_wrap	= virtio_guest_to_host_u16(vq->endian,
+						   vq->driver_event->off_wrap);
+
+	old			= vq->last_used_signalled;
+	new			= vq->used_idx;
+	valid			= vq->signalled_valid;
+	vq->last_used_signalled	= new;
+	vq->signalled_valid	= true;
+
+	if (flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+		return false;
+	if (flags != VRING_PACKED_EVENT_FLAG_DESC || !vq->use_event_idx || !valid)
+		return true;
+
+	/* The event offset is relative to the ring pass of its wrap counter */
+	event = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+	if (vq->used_wrap != !!(off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR))
+		event -= vq->vring.num;
+
+	return vring_need_event(event, new, old);
+}
+
 void virt_queue__used_idx_advance(struct virt_queue *queue, u16 jump)
 {
-	u16 idx = virtio_guest_to_host_u16(queue->endian,
-					   queue->vring.used->idx);
+	u16 idx;
+
+	queue->nr_used += jump;
+
+	if (queue->packed) {
+		virt_packed__publish(queue);
+		return;
+	}
+
+	idx = virtio_guest_to_host_u16(queue->endian, queue->vring.used->idx);
 
 	/*
 	 * Use wmb to assure that used elem was updated with head and len.
@@ -71,8 +329,15 @@ virt_queue__set_used_elem_no_update(struct virt_queue *queue, u32 head,
 				    u32 len, u16 offset)
 {
 	struct vring_used_elem *used_elem;
-	u16 idx = virtio_guest_to_host_u16(queue->endian, queue->vring.used->idx);
+	u16 idx;
+
+	/* Packed rings have no used ring to point into */
+	if (queue->packed) {
+		virt_packed__set_used(queue, head, len, offset);
+		return NULL;
+	}
 
+	idx = virtio_guest_to_host_u16(queue->endian, queue->vring.used->idx);
 	idx += offset;
 	used_elem	= &queue->vring.used->ring[idx % queue->vring.num];
 	used_elem->id	= virtio_host_to_guest_u32(queue->endian, head);
@@ -91,6 +356,27 @@ struct vring_used_elem *virt_queue__set_used_elem(struct virt_queue *queue, u32
 	return used_elem;
 }
 
+void virt_queue__used_batch_add(struct virt_queue_used_batch *batch,
+				u32 head, u32 len)
+{
+	virt_queue__set_used_elem_no_update(batch->vq, head, len, batch->nr++);
+}
+
+/*
+ * Make the elements of the batch visible to the guest, with a single barrier
+ * and index update, and tell whether it wants to be signalled.
+ */
+bool virt_queue__used_batch_publish(struct virt_queue_used_batch *batch)
+{
+	if (!batch->nr)
+		return false;
+
+	virt_queue__used_idx_advance(batch->vq, batch->nr);
+	batch->nr = 0;
+
+	return virtio_queue__should_signal(batch->vq);
+}
+
 static inline bool virt_desc__test_flag(struct virt_queue *vq,
 					struct vring_desc *desc, u16 flag)
 {
@@ -123,6 +409,11 @@ u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out
 	u16 idx;
 	u16 max;
 
+	if (vq->packed) {
+		virt_packed__get_iov(vq, kvm, head, iov, NULL, out, in);
+		return head;
+	}
+
 	idx = head;
 	*out = *in = 0;
 	max = vq->vring.num;
@@ -130,15 +421,21 @@ u16 virt_queue__get_head_iov(struct virt_queue *vq, struct iovec iov[], u16 *out
 
 	if (virt_desc__test_flag(vq, &desc[idx], VRING_DESC_F_INDIRECT)) {
 		max = virtio_guest_to_host_u32(vq->endian, desc[idx].len) / sizeof(struct vring_desc);
-		desc = guest_flat_to_host(kvm, virtio_guest_to_host_u64(vq->endian, desc[idx].addr));
+		desc = guest_flat_to_host_range(kvm, virtio_guest_to_host_u64(vq->endian, desc[idx].addr),
+						max * sizeof(struct vring_desc));
 		idx = 0;
+		if (!desc || !max)
+			return head;
 	}
 
 	do {
 		/* Grab the first descriptor, and check it's OK. */
-		iov[*out + *in].iov_len = virtio_guest_to_host_u32(vq->endian, desc[idx].len);
-		iov[*out + *in].iov_base = guest_flat_to_host(kvm,
-							      virtio_guest_to_host_u64(vq->endian, desc[idx].addr));
+		if (!virt_desc__map(kvm, &iov[*out + *in],
+				    virtio_guest_to_host_u64(vq->endian, desc[idx].addr),
+				    virtio_guest_to_host_u32(vq->endian, desc[idx].len))) {
+			*out = *in = 0;
+			break;
+		}
 		/* If this is an input descriptor, increment that count. */
 		if (virt_desc__test_flag(vq, &desc[idx], VRING_DESC_F_WRITE))
 			(*in)++;
@@ -165,21 +462,29 @@ u16 virt_queue__get_inout_iov(struct kvm *kvm, struct virt_queue *queue,
 {
 	struct vring_desc *desc;
 	u16 head, idx;
+	bool mapped;
 
 	idx = head = virt_queue__pop(queue);
+
+	if (queue->packed) {
+		virt_packed__get_iov(queue, kvm, head, out_iov, in_iov, out, in);
+		return head;
+	}
+
 	*out = *in = 0;
 	do {
 		u64 addr;
+		u32 len;
 		desc = virt_queue__get_desc(queue, idx);
 		addr = virtio_guest_to_host_u64(queue->endian, desc->addr);
-		if (virt_desc__test_flag(queue, desc, VRING_DESC_F_WRITE)) {
-			in_iov[*in].iov_base = guest_flat_to_host(kvm, addr);
-			in_iov[*in].iov_len = virtio_guest_to_host_u32(queue->endian, desc->len);
-			(*in)++;
-		} else {
-			out_iov[*out].iov_base = guest_flat_to_host(kvm, addr);
-			out_iov[*out].iov_len = virtio_guest_to_host_u32(queue->endian, desc->len);
-			(*out)++;
+		len = virtio_guest_to_host_u32(queue->endian, desc->len);
+		if (virt_desc__test_flag(queue, desc, VRING_DESC_F_WRITE))
+			mapped = virt_desc__map(kvm, &in_iov[(*in)++], addr, len);
+		else
+			mapped = virt_desc__map(kvm, &out_iov[(*out)++], addr, len);
+		if (!mapped) {
+			*out = *in = 0;
+			break;
 		}
 		if (virt_desc__test_flag(queue, desc, VRING_DESC_F_NEXT))
 			idx = virtio_guest_to_host_u16(queue->endian, desc->next);
@@ -198,9 +503,32 @@ void virtio_init_device_vq(struct kvm *kvm, struct virtio_device *vdev,
 	vq->endian		= vdev->endian;
 	vq->use_event_idx	= (vdev->features & (1UL << VIRTIO_RING_F_EVENT_IDX));
 	vq->enabled		= true;
+	vq->no_notify		= false;
 	vq->vdev		= vdev;
+	vq->packed		= vdev->features & (1ULL << VIRTIO_F_RING_PACKED);
+	vq->nr_used		= 0;
+	virtio_coalesce__attach(vdev, vq);
 
-	if (addr->legacy) {
+	if (vq->packed) {
+		u64 desc = (u64)addr->desc_hi << 32 | addr->desc_lo;
+		u64 driver = (u64)addr->avail_hi << 32 | addr->avail_lo;
+		u64 device = (u64)addr->used_hi << 32 | addr->used_lo;
+
+		free(vq->bufs);
+		vq->bufs = calloc(nr_descs, sizeof(*vq->bufs));
+		if (!vq->bufs)
+			die("Failed allocating packed virtqueue state");
+
+		vq->desc_packed		= guest_flat_to_host(kvm, desc);
+		vq->driver_event	= guest_flat_to_host(kvm, driver);
+		vq->device_event	= guest_flat_to_host(kvm, device);
+		vq->vring.num		= nr_descs;
+		vq->last_avail_idx	= 0;
+		vq->used_idx		= 0;
+		vq->avail_wrap		= true;
+		vq->used_wrap		= true;
+		vq->signalled_valid	= false;
+	} else if (addr->legacy) {
 		unsigned long base = (u64)addr->pfn * addr->pgsize;
 		void *p = guest_flat_to_host(kvm, base);
 
@@ -226,6 +554,7 @@ void virtio_exit_vq(struct kvm *kvm, struct virtio_device *vdev,
 
 	if (vq->enabled && vdev->ops->exit_vq)
 		vdev->ops->exit_vq(kvm, dev, num);
+	free(vq->bufs);
 	memset(vq, 0, sizeof(*vq));
 }
 
@@ -243,10 +572,58 @@ int virtio__get_dev_specific_field(int offset, bool msix, u32 *config_off)
 	return VIRTIO_PCI_O_CONFIG;
 }
 
-bool virtio_queue__should_signal(struct virt_queue *vq)
+/*
+ * Ask the guest not to notify the queue, when the device is going to check it
+ * for new buffers anyway. With EVENT_IDX, the avail event simply stops moving
+ * forward, so the guest may still notify once.
+ */
+void virt_queue__disable_notify(struct virt_queue *vq)
+{
+	if (vq->no_notify)
+		return;
+
+	vq->no_notify = true;
+	if (vq->packed)
+		vq->device_event->flags = virtio_host_to_guest_u16(vq->endian,
+					VRING_PACKED_EVENT_FLAG_DISABLE);
+	else if (!vq->use_event_idx)
+		vq->vring.used->flags |= virtio_host_to_guest_u16(vq->endian,
+							VRING_USED_F_NO_NOTIFY);
+}
+
+/*
+ * Let the guest notify the queue again. Returns true if buffers are available,
+ * since the guest may have added some without notifying us, before it could
+ * see that notifications are back on.
+ */
+bool virt_queue__enable_notify(struct virt_queue *vq)
+{
+	if (vq->no_notify) {
+		vq->no_notify = false;
+		if (vq->packed) {
+			vq->device_event->flags = virtio_host_to_guest_u16(vq->endian,
+						VRING_PACKED_EVENT_FLAG_ENABLE);
+			/* Enable notifications before looking at the ring */
+			mb();
+		} else if (!vq->use_event_idx) {
+			vq->vring.used->flags &= ~virtio_host_to_guest_u16(vq->endian,
+							VRING_USED_F_NO_NOTIFY);
+			/* Clear the flag before reading the avail index */
+			mb();
+		}
+	}
+
+	/* With EVENT_IDX, this moves the avail event and has the barrier */
+	return virt_queue__available(vq);
+}
+
+static bool virt_queue__wants_signal(struct virt_queue *vq)
 {
 	u16 old_idx, new_idx, event_idx;
 
+	if (vq->packed)
+		return virt_packed__should_signal(vq);
+
 	/*
 	 * Use mb to assure used idx has been increased before we signal the
 	 * guest, and we don't read a stale value for used_event. Without a mb
@@ -276,6 +653,16 @@ bool virtio_queue__should_signal(struct virt_queue *vq)
 	return false;
 }
 
+bool virtio_queue__should_signal(struct virt_queue *vq)
+{
+	bool wanted = virt_queue__wants_signal(vq);
+
+	if (__atomic_load_n(&vq->coalesce, __ATOMIC_ACQUIRE))
+		return virtio_coalesce__should_signal(vq, wanted);
+
+	return wanted;
+}
+
 void virtio_set_guest_features(struct kvm *kvm, struct virtio_device *vdev,
 			       void *dev, u64 features)
 {
@@ -168,6 +168,7 @@ static void *virtio_net_tx_thread(void *p)
 	struct net_dev_queue *queue = p;
 	struct virt_queue *vq = &queue->vq;
 	struct net_dev *ndev = queue->ndev;
+	struct virt_queue_used_batch used;
 	struct kvm *kvm;
 	u16 out, in;
 	u16 head;
@@ -176,6 +177,7 @@ static void *virtio_net_tx_thread(void *p)
 	kvm__set_thread_name("virtio-net-tx");
 
 	kvm = ndev->kvm;
+	virt_queue__used_batch_init(&used, vq);
 
 	while (1) {
 		mutex_lock(&queue->lock);
@@ -183,20 +185,25 @@ static void *virtio_net_tx_thread(void *p)
 			pthread_cond_wait(&queue->cond, &queue->lock.mutex);
 		mutex_unlock(&queue->lock);
 
-		while (virt_queue__available(vq)) {
-			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-			len = ndev->ops->tx(iov, out, ndev);
-			if (len < 0) {
-				pr_warning("%s: tx on vq %u failed (%d)\n",
-						__func__, queue->id, errno);
-				goto out_err;
+		/* No kicks while draining, check again once they are back on */
+		do {
+			virt_queue__disable_notify(vq);
+			while (virt_queue__available(vq)) {
+				head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
+				len = ndev->ops->tx(iov, out, ndev);
+				if (len < 0) {
+					pr_warning("%s: tx on vq %u failed (%d)\n",
+							__func__, queue->id, errno);
+					goto out_err;
+				}
+
+				virt_queue__used_batch_add(&used, head, len);
 			}
 
-			virt_queue__set_used_elem(vq, head, len);
-		}
-
-		if (virtio_queue__should_signal(vq))
-			ndev->vdev.ops->signal_vq(kvm, &ndev->vdev, queue->id);
+			/* Hand back everything that was sent in one go */
+			if (virt_queue__used_batch_publish(&used))
+				ndev->vdev.ops->signal_vq(kvm, &ndev->vdev, queue->id);
+		} while (virt_queue__enable_notify(vq));
 	}
 
 out_err:
@@ -210,6 +217,48 @@ static virtio_net_ctrl_ack virtio_net_handle_mq(struct kvm* kvm, struct net_dev
 	return VIRTIO_NET_OK;
 }
 
+/* Receive queues have even numbers, transmit queues odd ones */
+static void virtio_net_set_coalesce(struct net_dev *ndev, bool tx, u32 usecs,
+				    u32 frames)
+{
+	u32 i;
+
+	for (i = 0; i < ndev->queue_pairs; i++)
+		virtio_coalesce__set(&ndev->vdev, i * 2 + tx, usecs, frames);
+}
+
+/* The TX and RX commands share the layout of struct virtio_net_ctrl_coal */
+static virtio_net_ctrl_ack virtio_net_handle_coal(struct net_dev *ndev,
+						  struct virtio_net_ctrl_hdr *ctrl,
+						  struct iovec *iov, size_t len)
+{
+	struct virtio_net_ctrl_coal coal;
+	u32 usecs, frames;
+
+	if (len < sizeof(coal))
+		return VIRTIO_NET_ERR;
+
+	memcpy_fromiovec((void *)&coal, iov, sizeof(coal));
+	usecs	= virtio_guest_to_host_u32(ndev->vdev.endian, coal.max_usecs);
+	frames	= virtio_guest_to_host_u32(ndev->vdev.endian, coal.max_packets);
+
+	/* Not set up until there is something to coalesce */
+	if (usecs && !ndev->vdev.coalesce &&
+	    virtio_coalesce__init(ndev->kvm, ndev, &ndev->vdev, 0, 0) < 0)
+		return VIRTIO_NET_ERR;
+
+	switch (ctrl->cmd) {
+	case VIRTIO_NET_CTRL_NOTF_COAL_TX_SET:
+		virtio_net_set_coalesce(ndev, true, usecs, frames);
+		return VIRTIO_NET_OK;
+	case VIRTIO_NET_CTRL_NOTF_COAL_RX_SET:
+		virtio_net_set_coalesce(ndev, false, usecs, frames);
+		return VIRTIO_NET_OK;
+	}
+
+	return VIRTIO_NET_ERR;
+}
+
 static void *virtio_net_ctrl_thread(void *p)
 {
 	struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
@@ -231,19 +280,28 @@ static void *virtio_net_ctrl_thread(void *p)
 		mutex_unlock(&queue->lock);
 
 		while (virt_queue__available(vq)) {
+			/* The header and command are read, the ack is written */
 			head = virt_queue__get_iov(vq, iov, &out, &in, kvm);
-			len = min(iov_size(iov, in), sizeof(ctrl));
-			memcpy_fromiovec((void *)&ctrl, iov, len);
+			len = iov_size(iov, out);
+			if (len < sizeof(ctrl) || !in) {
+				virt_queue__set_used_elem(vq, head, 0);
+				continue;
+			}
+			memcpy_fromiovec((void *)&ctrl, iov, sizeof(ctrl));
+			len -= sizeof(ctrl);
 
 			switch (ctrl.class) {
 			case VIRTIO_NET_CTRL_MQ:
 				ack = virtio_net_handle_mq(kvm, ndev, &ctrl);
 				break;
+			case VIRTIO_NET_CTRL_NOTF_COAL:
+				ack = virtio_net_handle_coal(ndev, &ctrl, iov, len);
+				break;
 			default:
 				ack = VIRTIO_NET_ERR;
 				break;
 			}
-			memcpy_toiovec(iov + in, &ack, sizeof(ack));
+			memcpy_toiovec(iov + out, &ack, sizeof(ack));
 			virt_queue__set_used_elem(vq, head, sizeof(ack));
 		}
 
@@ -495,7 +553,9 @@ static u64 get_host_features(struct kvm *kvm, void *dev)
 		| 1UL << VIRTIO_NET_F_CTRL_VQ
 		| 1UL << VIRTIO_NET_F_MRG_RXBUF
 		| 1UL << (ndev->queue_pairs > 1 ? VIRTIO_NET_F_MQ : 0)
-		| 1UL << VIRTIO_F_ANY_LAYOUT;
+		| 1UL << VIRTIO_F_ANY_LAYOUT
+		| 1ULL << VIRTIO_F_RING_PACKED
+		| 1ULL << VIRTIO_NET_F_NOTF_COAL;
 
 	/*
 	 * The UFO feature for host and guest only can be enabled when the
@@ -511,7 +571,12 @@ static u64 get_host_features(struct kvm *kvm, void *dev)
 		if (ioctl(ndev->vhost_fd, VHOST_GET_FEATURES, &vhost_features) != 0)
 			die_perror("VHOST_GET_FEATURES failed");
 
-		features &= vhost_features;
+		/*
+		 * vhost is only ever handed split rings, and signals the guest
+		 * on its own.
+		 */
+		features &= vhost_features & ~(1ULL << VIRTIO_F_RING_PACKED |
+					       1ULL << VIRTIO_NET_F_NOTF_COAL);
 	}
 
 	return features;
@@ -791,6 +856,10 @@ static int set_net_param(struct kvm *kvm, struct virtio_net_params *p,
 		p->fd = atoi(val);
 	} else if (strcmp(param, "mq") == 0) {
 		p->mq = atoi(val);
+	} else if (strcmp(param, "coalesce_usecs") == 0) {
+		p->coalesce_usecs = atoi(val);
+	} else if (strcmp(param, "coalesce_frames") == 0) {
+		p->coalesce_frames = atoi(val);
 	} else
 		die("Unknown network parameter %s", param);
 
@@ -910,8 +979,18 @@ static int virtio_net__init_one(struct virtio_net_params *params)
 		return r;
 	}
 
-	if (params->vhost)
+	if (params->vhost) {
 		virtio_net__vhost_init(params->kvm, ndev);
+	} else if (params->coalesce_usecs) {
+		/* Otherwise, only set up if the guest asks for it */
+		r = virtio_coalesce__init(params->kvm, ndev, &ndev->vdev, 0, 0);
+		if (r < 0)
+			return r;
+		virtio_net_set_coalesce(ndev, false, params->coalesce_usecs,
+					params->coalesce_frames);
+		virtio_net_set_coalesce(ndev, true, params->coalesce_usecs,
+					params->coalesce_frames);
+	}
 
 	if (compat_id == -1)
 		compat_id = virtio_compat_add_message("virtio-net", "CONFIG_VIRTIO_NET");
@@ -972,6 +1051,7 @@ int virtio_net__exit(struct kvm *kvm)
 		virtio_net_stop(ndev);
 
 		list_del(&ndev->list);
+		virtio_coalesce__exit(&ndev->vdev);
 		virtio_exit(kvm, &ndev->vdev);
 		free(ndev);
 	}
@@ -233,7 +233,7 @@ int virtio_pci__signal_vq(struct kvm *kvm, struct virtio_device *vdev, u32 vq)
 		if (vpci->pci_hdr.msix.ctrl & cpu_to_le16(PCI_MSIX_FLAGS_MASKALL) ||
 		    vpci->msix_table[tbl].ctrl & cpu_to_le16(PCI_MSIX_ENTRY_CTRL_MASKBIT)) {
 
-			vpci->msix_pba |= 1 << tbl;
+			vpci->msix_pba |= 1ULL << tbl;
 			return 0;
 		}
 
@@ -257,7 +257,7 @@ int virtio_pci__signal_config(struct kvm *kvm, struct virtio_device *vdev)
 		if (vpci->pci_hdr.msix.ctrl & cpu_to_le16(PCI_MSIX_FLAGS_MASKALL) ||
 		    vpci->msix_table[tbl].ctrl & cpu_to_le16(PCI_MSIX_ENTRY_CTRL_MASKBIT)) {
 
-			vpci->msix_pba |= 1 << tbl;
+			vpci->msix_pba |= 1ULL << tbl;
 			return 0;
 		}
 
@@ -54,11 +54,12 @@ static size_t get_config_size(struct kvm *kvm, void *dev)
 
 static u64 get_host_features(struct kvm *kvm, void *dev)
 {
-	/* Unused */
-	return 0;
+	return 1ULL << VIRTIO_F_RING_PACKED;
 }
 
-static bool virtio_rng_do_io_request(struct kvm *kvm, struct rng_dev *rdev, struct virt_queue *queue)
+static bool virtio_rng_do_io_request(struct kvm *kvm, struct rng_dev *rdev,
+				     struct virt_queue *queue,
+				     struct virt_queue_used_batch *used)
 {
 	struct iovec iov[VIRTIO_RNG_QUEUE_SIZE];
 	ssize_t len;
@@ -81,7 +82,7 @@ static bool virtio_rng_do_io_request(struct kvm *kvm, struct rng_dev *rdev, stru
 			return false;
 	}
 
-	virt_queue__set_used_elem(queue, head, len);
+	virt_queue__used_batch_add(used, head, len);
 
 	return true;
 }
@@ -91,11 +92,14 @@ static void virtio_rng_do_io(struct kvm *kvm, void *param)
 	struct rng_dev_job *job	= param;
 	struct virt_queue *vq	= job->vq;
 	struct rng_dev *rdev	= job->rdev;
+	struct virt_queue_used_batch used;
 
+	virt_queue__used_batch_init(&used, vq);
 	while (virt_queue__available(vq))
-		virtio_rng_do_io_request(kvm, rdev, vq);
+		virtio_rng_do_io_request(kvm, rdev, vq, &used);
 
-	rdev->vdev.ops->signal_vq(kvm, &rdev->vdev, vq - rdev->vqs);
+	if (virt_queue__used_batch_publish(&used))
+		rdev->vdev.ops->signal_vq(kvm, &rdev->vdev, vq - rdev->vqs);
 }
 
 static int init_vq(struct kvm *kvm, void *dev, u32 vq)